@@ -0,0 +1,614 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifndef ASYNC_NO_URING
+#include <linux/io_uring.h>
+/* linux/fs.h brings in its own BLOCK_SIZE, the disk's comes from disk.h */
+#undef BLOCK_SIZE
+#endif
+
+#include "disk.h"
+#include "async.h"
+
+/* Which engine is serving requests */
+enum engine {
+	ENGINE_URING,
+	ENGINE_THREADS,
+};
+
+/* Asynchronous engine of one disk */
+struct async {
+	enum engine engine;
+	struct disk *disk;
+
+	/* Requests submitted and not yet handed back by async_complete */
+	int depth;
+	int in_flight;
+
+	/* Finished requests waiting to be reaped */
+	struct async_request *done_head;
+	struct async_request *done_tail;
+
+	/* Held by the thread driving async_transfer, the queues above have one user */
+	pthread_mutex_t transfer_lock;
+
+#ifndef ASYNC_NO_URING
+	/* io_uring instance shared with the kernel */
+	int ring_fd;
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* Requests placed in the submission ring but not yet passed to the kernel */
+	unsigned to_submit;
+#endif
+
+	/* Thread pool state, used when io_uring cannot be set up */
+	pthread_t workers[ASYNC_THREADS];
+	int worker_count;
+	pthread_mutex_t pool_lock;
+	pthread_cond_t work_ready;
+	pthread_cond_t work_done;
+	struct async_request *work_head;
+	struct async_request *work_tail;
+	bool stopping;
+};
+
+/* Append a request to a singly linked queue */
+static void queue_push(struct async_request **head, struct async_request **tail, struct async_request *req) {
+	req->next = NULL;
+	if (*tail) {
+		(*tail)->next = req;
+	} else {
+		*head = req;
+	}
+	*tail = req;
+}
+
+/* Take the oldest request off a queue */
+static struct async_request *queue_pop(struct async_request **head, struct async_request **tail) {
+	struct async_request *req = *head;
+	if (req) {
+		*head = req->next;
+		if (!*head) {
+			*tail = NULL;
+		}
+	}
+	return req;
+}
+
+#ifndef ASYNC_NO_URING
+
+/* Set up an io_uring instance and map its rings */
+static int uring_init(struct async *async, int entries) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	async->ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (async->ring_fd < 0) {
+		return -1;
+	}
+
+	async->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	async->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (async->cq_ring_size > async->sq_ring_size) {
+			async->sq_ring_size = async->cq_ring_size;
+		}
+		async->cq_ring_size = async->sq_ring_size;
+	}
+
+	async->sq_ring = mmap(NULL, async->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, async->ring_fd, IORING_OFF_SQ_RING);
+	if (async->sq_ring == MAP_FAILED) {
+		close(async->ring_fd);
+		async->ring_fd = -1;
+		return -1;
+	}
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		async->cq_ring = async->sq_ring;
+	} else {
+		async->cq_ring = mmap(NULL, async->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, async->ring_fd, IORING_OFF_CQ_RING);
+		if (async->cq_ring == MAP_FAILED) {
+			munmap(async->sq_ring, async->sq_ring_size);
+			close(async->ring_fd);
+			async->ring_fd = -1;
+			return -1;
+		}
+	}
+
+	async->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	async->sqes = mmap(NULL, async->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, async->ring_fd, IORING_OFF_SQES);
+	if (async->sqes == MAP_FAILED) {
+		if (async->cq_ring != async->sq_ring) {
+			munmap(async->cq_ring, async->cq_ring_size);
+		}
+		munmap(async->sq_ring, async->sq_ring_size);
+		close(async->ring_fd);
+		async->ring_fd = -1;
+		return -1;
+	}
+
+	async->sq_head = (unsigned *) ((char *) async->sq_ring + params.sq_off.head);
+	async->sq_tail = (unsigned *) ((char *) async->sq_ring + params.sq_off.tail);
+	async->sq_mask = (unsigned *) ((char *) async->sq_ring + params.sq_off.ring_mask);
+	async->sq_array = (unsigned *) ((char *) async->sq_ring + params.sq_off.array);
+	async->cq_head = (unsigned *) ((char *) async->cq_ring + params.cq_off.head);
+	async->cq_tail = (unsigned *) ((char *) async->cq_ring + params.cq_off.tail);
+	async->cq_mask = (unsigned *) ((char *) async->cq_ring + params.cq_off.ring_mask);
+	async->cqes = (struct io_uring_cqe *) ((char *) async->cq_ring + params.cq_off.cqes);
+
+	/* Never have more requests out than the submission ring holds */
+	if ((unsigned) async->depth > params.sq_entries) {
+		async->depth = params.sq_entries;
+	}
+	async->to_submit = 0;
+
+	return 0;
+}
+
+/* Unmap the rings and close the io_uring instance */
+static void uring_shutdown(struct async *async) {
+	munmap(async->sqes, async->sqes_size);
+	if (async->cq_ring != async->sq_ring) {
+		munmap(async->cq_ring, async->cq_ring_size);
+	}
+	munmap(async->sq_ring, async->sq_ring_size);
+	close(async->ring_fd);
+	async->ring_fd = -1;
+}
+
+/* Place a request in the submission ring */
+static void uring_queue(struct async *async, struct async_request *req, int fd) {
+	unsigned tail = *async->sq_tail;
+	unsigned index = tail & *async->sq_mask;
+	struct io_uring_sqe *sqe = &async->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = fd;
+	sqe->off = (unsigned long long) req->block * disk_get_block_size(async->disk);
+	sqe->addr = (unsigned long long) (uintptr_t) req->iov;
+	sqe->len = req->count;
+	sqe->user_data = (unsigned long long) (uintptr_t) req;
+
+	async->sq_array[index] = index;
+	__atomic_store_n(async->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	async->to_submit++;
+}
+
+/* Move completions from the completion ring onto the done queue */
+static int uring_reap(struct async *async) {
+	int reaped = 0;
+	unsigned head = *async->cq_head;
+	unsigned tail = __atomic_load_n(async->cq_tail, __ATOMIC_ACQUIRE);
+
+	while (head != tail) {
+		struct io_uring_cqe *cqe = &async->cqes[head & *async->cq_mask];
+		struct async_request *req = (struct async_request *) (uintptr_t) cqe->user_data;
+
+		req->result = (cqe->res == req->count * disk_get_block_size(async->disk)) ? 0 : -1;
+		if (req->result != 0) {
+			fprintf(stderr, "async: block %s failed: %s\n", req->write ? "write" : "read",
+				cqe->res < 0 ? strerror(-cqe->res) : "short transfer");
+		} else {
+			disk_count(async->disk, req->write, req->count);
+		}
+		queue_push(&async->done_head, &async->done_tail, req);
+		head++;
+		reaped++;
+	}
+
+	__atomic_store_n(async->cq_head, head, __ATOMIC_RELEASE);
+
+	return reaped;
+}
+
+/* Pass queued requests to the kernel, optionally waiting for completions */
+static int uring_enter(struct async *async, unsigned wait) {
+	while (async->to_submit > 0 || wait > 0) {
+		int ret = syscall(__NR_io_uring_enter, async->ring_fd, async->to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("async: io_uring_enter failed");
+			return -1;
+		}
+		async->to_submit -= ret;
+		wait = 0;
+	}
+
+	return 0;
+}
+
+#endif
+
+/* Carry out one request synchronously */
+static int run_request(struct async *async, struct async_request *req) {
+	int blocks[VECTOR_BLOCKS];
+	void *bufs[VECTOR_BLOCKS];
+
+	for (int i = 0; i < req->count; i++) {
+		blocks[i] = req->block + i;
+		bufs[i] = req->iov[i].iov_base;
+	}
+
+	if (req->write) {
+		return disk_writev(async->disk, req->count, blocks, (const void *const *) bufs);
+	}
+	return disk_readv(async->disk, req->count, blocks, bufs);
+}
+
+/* Worker thread, runs queued requests until the pool is stopped */
+static void *worker_main(void *arg) {
+	struct async *async = arg;
+
+	pthread_mutex_lock(&async->pool_lock);
+	while (true) {
+		while (!async->stopping && !async->work_head) {
+			pthread_cond_wait(&async->work_ready, &async->pool_lock);
+		}
+		if (async->stopping && !async->work_head) {
+			break;
+		}
+
+		struct async_request *req = queue_pop(&async->work_head, &async->work_tail);
+		pthread_mutex_unlock(&async->pool_lock);
+		req->result = run_request(async, req);
+		pthread_mutex_lock(&async->pool_lock);
+
+		queue_push(&async->done_head, &async->done_tail, req);
+		pthread_cond_broadcast(&async->work_done);
+	}
+	pthread_mutex_unlock(&async->pool_lock);
+
+	return NULL;
+}
+
+/* Start the worker threads */
+static int threads_init(struct async *async) {
+	async->stopping = false;
+	async->work_head = async->work_tail = NULL;
+	for (async->worker_count = 0; async->worker_count < ASYNC_THREADS; async->worker_count++) {
+		if (pthread_create(&async->workers[async->worker_count], NULL, worker_main, async) != 0) {
+			break;
+		}
+	}
+
+	if (async->worker_count == 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Let the workers drain the queue and exit */
+static void threads_shutdown(struct async *async) {
+	pthread_mutex_lock(&async->pool_lock);
+	async->stopping = true;
+	pthread_cond_broadcast(&async->work_ready);
+	pthread_mutex_unlock(&async->pool_lock);
+
+	for (int i = 0; i < async->worker_count; i++) {
+		pthread_join(async->workers[i], NULL);
+	}
+	async->worker_count = 0;
+}
+
+struct async *async_init(struct disk *disk, int size)
+{
+	if (size <= 0) {
+		fprintf(stderr, "async_init: invalid queue depth\n");
+		return NULL;
+	}
+
+	struct async *async = malloc(sizeof(struct async));
+	if (!async) {
+		fprintf(stderr, "async_init: failed to allocate\n");
+		return NULL;
+	}
+	async->disk = disk;
+	async->depth = size;
+	async->in_flight = 0;
+	async->done_head = async->done_tail = NULL;
+	pthread_mutex_init(&async->transfer_lock, NULL);
+	pthread_mutex_init(&async->pool_lock, NULL);
+	pthread_cond_init(&async->work_ready, NULL);
+	pthread_cond_init(&async->work_done, NULL);
+
+#ifndef ASYNC_NO_URING
+	/* Prefer io_uring, fall back to worker threads if the kernel refuses it */
+	if (disk_fd(disk) >= 0 && uring_init(async, size) == 0) {
+		async->engine = ENGINE_URING;
+		return async;
+	}
+#endif
+
+	if (threads_init(async) != 0) {
+		fprintf(stderr, "async_init: cannot start worker threads\n");
+		free(async);
+		return NULL;
+	}
+	async->engine = ENGINE_THREADS;
+
+	return async;
+}
+
+int async_shutdown(struct async *async)
+{
+
+	/* Wait for everything still in flight before tearing down */
+	struct async_request *done[16];
+	while (async->in_flight > 0) {
+		int n = async_complete(async, done, 1, 16);
+		if (n < 0) {
+			break;
+		}
+		for (int i = 0; i < n; i++) {
+			if (done[i]->callback) {
+				done[i]->callback(done[i]);
+			}
+		}
+	}
+
+#ifndef ASYNC_NO_URING
+	if (async->engine == ENGINE_URING) {
+		uring_shutdown(async);
+	}
+#endif
+	if (async->engine == ENGINE_THREADS) {
+		threads_shutdown(async);
+	}
+	pthread_mutex_destroy(&async->transfer_lock);
+	pthread_mutex_destroy(&async->pool_lock);
+	pthread_cond_destroy(&async->work_ready);
+	pthread_cond_destroy(&async->work_done);
+	free(async);
+
+	return 0;
+}
+
+int async_submit(struct async *async, struct async_request *req)
+{
+	if ((req->count <= 0) || (req->count > VECTOR_BLOCKS) || (req->block < 0) || (req->block + req->count > disk_get_block_count(async->disk))) {
+		fprintf(stderr, "async_submit: invalid request\n");
+		return -1;
+	}
+
+	/* The caller has to reap completions before submitting more */
+	if (async->in_flight >= async->depth) {
+		fprintf(stderr, "async_submit: queue full\n");
+		return -1;
+	}
+	async->in_flight++;
+
+#ifndef ASYNC_NO_URING
+	if (async->engine == ENGINE_URING) {
+		uring_queue(async, req, disk_fd(async->disk));
+		return 0;
+	}
+#endif
+
+	pthread_mutex_lock(&async->pool_lock);
+	queue_push(&async->work_head, &async->work_tail, req);
+	pthread_cond_signal(&async->work_ready);
+	pthread_mutex_unlock(&async->pool_lock);
+
+	return 0;
+}
+
+int async_flush(struct async *async)
+{
+#ifndef ASYNC_NO_URING
+	if (async->engine == ENGINE_URING) {
+		return uring_enter(async, 0);
+	}
+#endif
+
+	/* Worker threads pick requests up as soon as they are submitted */
+	return 0;
+}
+
+int async_complete(struct async *async, struct async_request **done, int min, int max)
+{
+	if (min > async->in_flight) {
+		min = async->in_flight;
+	}
+
+	int count = 0;
+
+#ifndef ASYNC_NO_URING
+	if (async->engine == ENGINE_URING) {
+		/* Submit what is queued and wait until enough completions are in */
+		uring_reap(async);
+		while (true) {
+			int ready = 0;
+			for (struct async_request *req = async->done_head; req && ready < min; req = req->next) {
+				ready++;
+			}
+			if (ready >= min) {
+				break;
+			}
+			if (uring_enter(async, min - ready) != 0) {
+				return -1;
+			}
+			uring_reap(async);
+		}
+		if (async->to_submit > 0 && uring_enter(async, 0) != 0) {
+			return -1;
+		}
+
+		while (count < max && async->done_head) {
+			done[count++] = queue_pop(&async->done_head, &async->done_tail);
+		}
+		async->in_flight -= count;
+
+		return count;
+	}
+#endif
+
+	pthread_mutex_lock(&async->pool_lock);
+	while (true) {
+		while (count < max && async->done_head) {
+			done[count++] = queue_pop(&async->done_head, &async->done_tail);
+		}
+		if (count >= min) {
+			break;
+		}
+		pthread_cond_wait(&async->work_done, &async->pool_lock);
+	}
+	pthread_mutex_unlock(&async->pool_lock);
+	async->in_flight -= count;
+
+	return count;
+}
+
+/* Transfer the blocks through the engine, one caller at a time */
+static int engine_transfer(struct async *async, int write, int count, const int *blocks, void *const *bufs)
+{
+	struct async_request reqs[VECTOR_BLOCKS];
+	struct iovec iov[VECTOR_BLOCKS];
+	struct async_request *done[VECTOR_BLOCKS];
+	int ret = 0;
+
+	for (int base = 0; base < count; base += VECTOR_BLOCKS) {
+		int batch = (count - base < VECTOR_BLOCKS) ? count - base : VECTOR_BLOCKS;
+
+		/* Split the batch into runs of adjacent blocks, one request each */
+		int runs = 0;
+		for (int start = 0; start < batch; ) {
+			if ((blocks[base + start] < 0) || (blocks[base + start] >= disk_get_block_count(async->disk))) {
+				fprintf(stderr, "async_transfer: block index out of bounds\n");
+				return -1;
+			}
+
+			int end = start + 1;
+			while (end < batch && blocks[base + end] == blocks[base + end - 1] + 1) {
+				end++;
+			}
+
+			for (int i = start; i < end; i++) {
+				iov[i].iov_base = bufs[base + i];
+				iov[i].iov_len = disk_get_block_size(async->disk);
+			}
+			reqs[runs].write = write;
+			reqs[runs].block = blocks[base + start];
+			reqs[runs].count = end - start;
+			reqs[runs].iov = &iov[start];
+			reqs[runs].callback = NULL;
+			runs++;
+			start = end;
+		}
+
+		/* Keep the queue as full as possible until every run has completed, background
+		 * requests may hold slots until they are reaped here too */
+		int submitted = 0;
+		int completed = 0;
+		while (completed < submitted || (ret == 0 && submitted < runs)) {
+			while (ret == 0 && submitted < runs && async->in_flight < async->depth) {
+				if (async_submit(async, &reqs[submitted]) != 0) {
+					ret = -1;
+					break;
+				}
+				submitted++;
+			}
+			if (completed == submitted && (ret != 0 || submitted == runs)) {
+				break;
+			}
+
+			/* Submitted requests point into reqs and iov, so they are reaped even after an error */
+			int n = async_complete(async, done, 1, VECTOR_BLOCKS);
+			if (n < 0) {
+				ret = -1;
+				continue;
+			}
+			for (int i = 0; i < n; i++) {
+				if (done[i]->callback) {
+					done[i]->callback(done[i]);
+					continue;
+				}
+				if (done[i]->result != 0) {
+					ret = -1;
+				}
+				completed++;
+			}
+		}
+		if (ret != 0) {
+			break;
+		}
+	}
+
+	return ret;
+}
+
+int async_transfer(struct async *async, int write, int count, const int *blocks, void *const *bufs)
+{
+	if (count <= 0) {
+		return 0;
+	}
+
+	/* Nothing to overlap on a mapped disk, and a busy engine is not
+	 * worth waiting for since the vector calls are as fast */
+	if (disk_fd(async->disk) >= 0 && pthread_mutex_trylock(&async->transfer_lock) == 0) {
+		int ret = engine_transfer(async, write, count, blocks, bufs);
+		pthread_mutex_unlock(&async->transfer_lock);
+		return ret;
+	}
+
+	if (write) {
+		return disk_writev(async->disk, count, blocks, (const void *const *) bufs);
+	}
+	return disk_readv(async->disk, count, blocks, bufs);
+}
+
+int async_start(struct async *async, struct async_request *req)
+{
+	/* Readahead is not worth waiting for the engine, and a mapped disk has no descriptor to queue on */
+	if (disk_fd(async->disk) < 0 || pthread_mutex_trylock(&async->transfer_lock) != 0) {
+		return -1;
+	}
+
+	/* Once queued the request is the engine's, a failed flush is retried by the next one */
+	int ret = -1;
+	if (async->in_flight < async->depth && async_submit(async, req) == 0) {
+		async_flush(async);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&async->transfer_lock);
+
+	return ret;
+}
+
+int async_reap(struct async *async)
+{
+	/* Whoever holds the engine reaps background requests along with its own */
+	struct async_request *done[VECTOR_BLOCKS];
+	pthread_mutex_lock(&async->transfer_lock);
+	int n = (async->in_flight > 0) ? async_complete(async, done, 1, VECTOR_BLOCKS) : 0;
+	for (int i = 0; i < n; i++) {
+		done[i]->callback(done[i]);
+	}
+	pthread_mutex_unlock(&async->transfer_lock);
+
+	return (n < 0) ? -1 : 0;
+}
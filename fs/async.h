@@ -0,0 +1,53 @@
+#ifndef _ASYNC_H_
+#define _ASYNC_H_
+
+#include <sys/uio.h>
+
+#include "disk.h"
+
+/* Default number of requests the engine keeps in flight */
+#ifndef ASYNC_DEPTH
+#define ASYNC_DEPTH 64
+#endif
+
+/* Worker threads used when io_uring is not available */
+#ifndef ASYNC_THREADS
+#define ASYNC_THREADS 4
+#endif
+
+/* One asynchronous transfer of a run of adjacent disk blocks */
+struct async_request {
+	int write;		/* nonzero to write the blocks, zero to read them */
+	int block;		/* first disk block of the run */
+	int count;		/* number of blocks, one iovec each */
+	struct iovec *iov;	/* one block sized buffer for each block */
+	int result;		/* 0 on success, -1 on failure, set on completion */
+	void *data;		/* caller's tag, untouched by the engine */
+	/* Set for requests started with async_start, called by whichever thread reaps them */
+	void (*callback)(struct async_request *req);
+	struct async_request *next;	/* engine private */
+};
+
+/* Engine moving the blocks of one disk, each open disk gets its own */
+struct async;
+
+/* Start an engine for a disk, NULL on failure */
+struct async *async_init(struct disk *disk, int depth);
+int async_shutdown(struct async *async);
+
+/* Queue a request, start queued requests, and reap finished ones */
+int async_submit(struct async *async, struct async_request *req);
+int async_flush(struct async *async);
+int async_complete(struct async *async, struct async_request **done, int min, int max);
+
+/* Transfer count blocks, keeping many runs in flight at once, safe to call
+ * from several threads while the calls above belong to a single thread */
+int async_transfer(struct async *async, int write, int count, const int *blocks, void *const *bufs);
+
+/* Start a request that finishes in the background, -1 if the engine is busy or full
+ * Finished requests are reaped by async_transfer and async_reap, which wait for one
+ * when there is nothing else to do. Both are safe to call from several threads. */
+int async_start(struct async *async, struct async_request *req);
+int async_reap(struct async *async);
+
+#endif
@@ -0,0 +1,86 @@
+#include "fs.h"
+#include "disk.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BYTES_KB 1024
+#define BYTES_MB (1024 * BYTES_KB)
+
+/* Same file size as the first test_bonus case */
+#define FILE_SIZE (30 * BYTES_MB)
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Move the whole file through fs_write or fs_read in chunks of size bytes */
+static double transfer_throughput(int fd, char *buf, int size, int write) {
+  double start = now();
+
+  for (int done = 0; done < FILE_SIZE; done += size) {
+    int length = (FILE_SIZE - done < size) ? FILE_SIZE - done : size;
+    int n = write ? fs_write(fd, buf + done, length) : fs_read(fd, buf + done, length);
+    if (n != length) {
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  return (double) FILE_SIZE / (now() - start) / BYTES_MB;
+}
+
+int main(int argc, char **argv) {
+  const char *disk_name = "bench_fs";
+  const char *file_name = "bench_file";
+  const int sizes[] = {FILE_SIZE, BYTES_MB, 64 * BYTES_KB, 4 * BYTES_KB};
+  char *buf = malloc(FILE_SIZE);
+  char *read_buf = malloc(FILE_SIZE);
+
+  /* "mmap" as the first argument runs on the mapped disk backend */
+  if (argc > 1 && strcmp(argv[1], "mmap") == 0) {
+    set_disk_backend(DISK_BACKEND_MMAP);
+  }
+
+  for (int i = 0; i < FILE_SIZE; i++) {
+    buf[i] = 'A' + rand() % 26;
+  }
+
+  remove(disk_name);
+  if (make_fs(disk_name) != 0 || mount_fs(disk_name) != 0) {
+    return EXIT_FAILURE;
+  }
+
+  for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    if (fs_create(file_name) != 0) {
+      return EXIT_FAILURE;
+    }
+    int fd = fs_open(file_name);
+    if (fd < 0) {
+      return EXIT_FAILURE;
+    }
+
+    double write_rate = transfer_throughput(fd, buf, sizes[i], 1);
+    if (fs_lseek(fd, 0) != 0) {
+      return EXIT_FAILURE;
+    }
+    double read_rate = transfer_throughput(fd, read_buf, sizes[i], 0);
+    if (memcmp(buf, read_buf, FILE_SIZE) != 0) {
+      return EXIT_FAILURE;
+    }
+    printf("30 MiB file, %8d byte chunks: write %8.1f MiB/s, read %8.1f MiB/s\n", sizes[i], write_rate, read_rate);
+
+    if (fs_close(fd) != 0 || fs_delete(file_name) != 0) {
+      return EXIT_FAILURE;
+    }
+  }
+
+  umount_fs(disk_name);
+  remove(disk_name);
+  free(buf);
+  free(read_buf);
+
+  return EXIT_SUCCESS;
+}
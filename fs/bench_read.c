@@ -0,0 +1,75 @@
+#include "fs.h"
+#include "disk.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BYTES_KB 1024
+#define BYTES_MB (1024 * BYTES_KB)
+
+/* Bytes read per measurement */
+#define READ_TOTAL (256 * BYTES_MB)
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Read the whole file over and over in chunks of size bytes */
+static double read_throughput(int fd, char *buf, int size) {
+  long total = 0;
+  double start = now();
+
+  while (total < READ_TOTAL) {
+    if (fs_lseek(fd, 0) != 0) {
+      exit(EXIT_FAILURE);
+    }
+    int n;
+    while ((n = fs_read(fd, buf, size)) > 0) {
+      total += n;
+    }
+    if (n < 0) {
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  return total / (now() - start) / BYTES_MB;
+}
+
+int main(int argc, char **argv) {
+  const char *disk_name = "bench_fs";
+  const char *file_name = "bench_file";
+  const int sizes[] = {BYTES_MB, 64 * BYTES_KB, 4 * BYTES_KB, 1000, 100};
+  char *buf = malloc(BYTES_MB);
+
+  /* "mmap" as the first argument runs on the mapped disk backend */
+  if (argc > 1 && strcmp(argv[1], "mmap") == 0) {
+    set_disk_backend(DISK_BACKEND_MMAP);
+  }
+
+  for (int i = 0; i < BYTES_MB; i++) {
+    buf[i] = 'A' + rand() % 26;
+  }
+
+  remove(disk_name);
+  if (make_fs(disk_name) != 0 || mount_fs(disk_name) != 0 || fs_create(file_name) != 0) {
+    return EXIT_FAILURE;
+  }
+  int fd = fs_open(file_name);
+  if (fd < 0 || fs_write(fd, buf, BYTES_MB) != BYTES_MB) {
+    return EXIT_FAILURE;
+  }
+
+  for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    printf("fs_read %8d bytes: %10.1f MiB/s\n", sizes[i], read_throughput(fd, buf, sizes[i]));
+  }
+
+  fs_close(fd);
+  umount_fs(disk_name);
+  remove(disk_name);
+  free(buf);
+
+  return EXIT_SUCCESS;
+}
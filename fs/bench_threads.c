@@ -0,0 +1,141 @@
+#include "fs.h"
+#include "disk.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BYTES_KB 1024
+#define BYTES_MB (1024 * BYTES_KB)
+
+/* Size of the shared file, it fits in the block cache */
+#define FILE_SIZE (2 * BYTES_MB)
+/* Bytes each thread reads per measurement, and the size of each read */
+#define READ_TOTAL (128 * BYTES_MB)
+#define READ_SIZE (64 * BYTES_KB)
+
+#define MAX_THREADS 8
+
+static const char *file_name = "bench_file";
+
+/* Descriptor shared by the random readers */
+static int shared_fd;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Read the shared file over and over through a descriptor of the thread's own */
+static void *reader(void *arg) {
+  char *buf = malloc(READ_SIZE);
+  int fd = fs_open(file_name);
+  long total = 0;
+
+  if (fd < 0) {
+    exit(EXIT_FAILURE);
+  }
+  while (total < READ_TOTAL) {
+    if (fs_lseek(fd, 0) != 0) {
+      exit(EXIT_FAILURE);
+    }
+    int n;
+    while ((n = fs_read(fd, buf, READ_SIZE)) > 0) {
+      total += n;
+    }
+    if (n < 0) {
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  fs_close(fd);
+  free(buf);
+  return NULL;
+}
+
+/* Read blocks at random offsets through the shared descriptor */
+static void *random_reader(void *arg) {
+  unsigned int seed = (unsigned int) (long) arg;
+  char *buf = malloc(BYTES_KB * 4);
+  long total = 0;
+
+  while (total < READ_TOTAL / 4) {
+    off_t offset = (off_t) (rand_r(&seed) % (FILE_SIZE / (BYTES_KB * 4))) * BYTES_KB * 4;
+    if (fs_pread(shared_fd, buf, BYTES_KB * 4, offset) != BYTES_KB * 4) {
+      exit(EXIT_FAILURE);
+    }
+    total += BYTES_KB * 4;
+  }
+
+  free(buf);
+  return NULL;
+}
+
+/* Aggregate read throughput of count threads running body at once, each reading total bytes */
+static double read_throughput(void *(*body)(void *), int count, long total) {
+  pthread_t threads[MAX_THREADS];
+  double start = now();
+
+  for (int i = 0; i < count; i++) {
+    if (pthread_create(&threads[i], NULL, body, (void *) (long) (i + 1)) != 0) {
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (int i = 0; i < count; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  return (double) total * count / (now() - start) / BYTES_MB;
+}
+
+int main(int argc, char **argv) {
+  const char *disk_name = "bench_fs";
+  char *buf = malloc(FILE_SIZE);
+
+  /* "mmap" as the first argument runs on the mapped disk backend */
+  if (argc > 1 && strcmp(argv[1], "mmap") == 0) {
+    set_disk_backend(DISK_BACKEND_MMAP);
+  }
+
+  for (int i = 0; i < FILE_SIZE; i++) {
+    buf[i] = 'A' + rand() % 26;
+  }
+
+  remove(disk_name);
+  if (make_fs(disk_name) != 0 || mount_fs(disk_name) != 0 || fs_create(file_name) != 0) {
+    return EXIT_FAILURE;
+  }
+  int fd = fs_open(file_name);
+  if (fd < 0 || fs_write(fd, buf, FILE_SIZE) != FILE_SIZE) {
+    return EXIT_FAILURE;
+  }
+
+  /* Sequential reads, a descriptor per thread */
+  double single = 0;
+  for (int count = 1; count <= MAX_THREADS; count *= 2) {
+    double throughput = read_throughput(reader, count, READ_TOTAL);
+    if (count == 1) {
+      single = throughput;
+    }
+    printf("fs_read %d threads: %10.1f MiB/s (%.2fx)\n", count, throughput, throughput / single);
+  }
+
+  /* Random 4 KiB reads, every thread on the same descriptor */
+  shared_fd = fd;
+  for (int count = 1; count <= MAX_THREADS; count *= 2) {
+    double throughput = read_throughput(random_reader, count, READ_TOTAL / 4);
+    if (count == 1) {
+      single = throughput;
+    }
+    printf("fs_pread random 4 KiB %d threads: %10.1f MiB/s (%.2fx)\n", count, throughput, throughput / single);
+  }
+  fs_close(fd);
+
+  umount_fs(disk_name);
+  remove(disk_name);
+  free(buf);
+
+  return EXIT_SUCCESS;
+}
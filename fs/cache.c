@@ -0,0 +1,699 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "disk.h"
+#include "cache.h"
+#include "async.h"
+
+/* Cached copy of a single disk block */
+struct cache_entry {
+	int block;
+	bool dirty;
+	/* Held in memory until cache_release_ordered, see cache_write_ordered */
+	bool ordered;
+	/* Readers copying the data out without the lock, the entry stays put meanwhile */
+	int pins;
+	/* Being read ahead in the background, and read ahead but not used yet */
+	bool loading;
+	bool prefetched;
+	/* Neighbours in the LRU list (most recently used at the head) */
+	int prev;
+	int next;
+	/* Next entry in the same hash bucket */
+	int hash_next;
+};
+
+/* Block cache in front of one disk */
+struct cache {
+	struct disk *disk;
+	struct async *async;
+
+	/* Guards every entry, list and counter below, data is copied out of pinned entries without it */
+	pthread_mutex_t lock;
+
+	/* Number of entries, zero when caching is disabled */
+	int capacity;
+
+	/* Block size of the disk the cache was set up for */
+	int block_size;
+
+	struct cache_entry *entries;
+	char *data;
+	int *buckets;
+	int bucket_mask;
+
+	/* Blocks of each bucket being written through, and how many such writes have finished, a
+	 * block read without the lock is only kept when its bucket saw no write over the read */
+	int *bucket_writing;
+	unsigned long *bucket_written;
+
+	/* Dirty entries collected by a flush, one per entry plus one so it is never empty */
+	int *flush_order;
+
+	/* LRU list ends and list of unused entries */
+	int lru_head;
+	int lru_tail;
+	int free_head;
+
+	/* Entries written with cache_write_ordered and not released yet */
+	int ordered_count;
+
+	/* Entries being read ahead, readahead never takes more than a quarter of the cache */
+	int loading_count;
+
+	struct cache_stats stats;
+};
+
+/* Readahead of a run of adjacent blocks, as one background request of the async engine */
+struct prefetch {
+	struct async_request req;
+	struct cache *cache;
+	int entries[VECTOR_BLOCKS];
+	struct iovec iov[VECTOR_BLOCKS];
+};
+
+/* Map a block number onto a hash bucket */
+static int hash_block(struct cache *cache, int block) {
+	return (int) (((unsigned int) block * 2654435761u) & cache->bucket_mask);
+}
+
+/* Whether a block read without the lock since stamp was its bucket's bucket_written may be kept */
+static bool read_current(struct cache *cache, int block, unsigned long stamp) {
+	int bucket = hash_block(cache, block);
+	return cache->bucket_writing[bucket] == 0 && cache->bucket_written[bucket] == stamp;
+}
+
+/* Get the cached data for an entry */
+static char *entry_data(struct cache *cache, int entry) {
+	return cache->data + (size_t) entry * cache->block_size;
+}
+
+/* Find the entry holding a block, -1 if it is not cached */
+static int lookup(struct cache *cache, int block) {
+	for (int i = cache->buckets[hash_block(cache, block)]; i != -1; i = cache->entries[i].hash_next) {
+		if (cache->entries[i].block == block) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* Find the entry holding a block like lookup, first waiting for readahead to finish loading it
+ * The lock is dropped while reaping, so entries looked up before may have changed since. */
+static int lookup_ready(struct cache *cache, int block) {
+	int entry;
+	while ((entry = lookup(cache, block)) != -1 && cache->entries[entry].loading) {
+		pthread_mutex_unlock(&cache->lock);
+		async_reap(cache->async);
+		pthread_mutex_lock(&cache->lock);
+	}
+	return entry;
+}
+
+/* Wait until no entry is being read ahead */
+static void wait_loaded(struct cache *cache) {
+	while (cache->loading_count > 0) {
+		pthread_mutex_unlock(&cache->lock);
+		async_reap(cache->async);
+		pthread_mutex_lock(&cache->lock);
+	}
+}
+
+/* Count a read served from memory */
+static void count_hit(struct cache *cache, int entry) {
+	cache->stats.hits++;
+	if (cache->entries[entry].prefetched) {
+		cache->entries[entry].prefetched = false;
+		cache->stats.prefetch_hits++;
+	}
+}
+
+/* Unlink an entry from the LRU list */
+static void lru_remove(struct cache *cache, int entry) {
+	if (cache->entries[entry].prev != -1) {
+		cache->entries[cache->entries[entry].prev].next = cache->entries[entry].next;
+	} else {
+		cache->lru_head = cache->entries[entry].next;
+	}
+	if (cache->entries[entry].next != -1) {
+		cache->entries[cache->entries[entry].next].prev = cache->entries[entry].prev;
+	} else {
+		cache->lru_tail = cache->entries[entry].prev;
+	}
+}
+
+/* Make an entry the most recently used */
+static void lru_push(struct cache *cache, int entry) {
+	cache->entries[entry].prev = -1;
+	cache->entries[entry].next = cache->lru_head;
+	if (cache->lru_head != -1) {
+		cache->entries[cache->lru_head].prev = entry;
+	}
+	cache->lru_head = entry;
+	if (cache->lru_tail == -1) {
+		cache->lru_tail = entry;
+	}
+}
+
+/* Remove an entry from its hash bucket */
+static void hash_remove(struct cache *cache, int entry) {
+	int *link = &cache->buckets[hash_block(cache, cache->entries[entry].block)];
+	while (*link != entry) {
+		link = &cache->entries[*link].hash_next;
+	}
+	*link = cache->entries[entry].hash_next;
+}
+
+/* Get an entry for a new block, evicting the least recently used one if needed */
+static int get_entry(struct cache *cache, int block) {
+	int entry = cache->free_head;
+
+	if (entry != -1) {
+		cache->free_head = cache->entries[entry].next;
+	} else {
+		/* Evict the least recently used block that may leave memory, writing it back if dirty */
+		entry = cache->lru_tail;
+		while (entry != -1 && (cache->entries[entry].ordered || cache->entries[entry].pins > 0)) {
+			entry = cache->entries[entry].prev;
+		}
+		if (entry == -1) {
+			fprintf(stderr, "cache: every block is held for ordering or pinned\n");
+			return -1;
+		}
+		if (cache->entries[entry].dirty) {
+			if (disk_write(cache->disk, cache->entries[entry].block, entry_data(cache, entry)) != 0) {
+				fprintf(stderr, "cache: failed to write back block\n");
+				return -1;
+			}
+			cache->stats.writebacks++;
+		}
+		lru_remove(cache, entry);
+		hash_remove(cache, entry);
+		cache->stats.evictions++;
+	}
+
+	/* Insert new block into hash bucket and LRU list */
+	cache->entries[entry].block = block;
+	cache->entries[entry].dirty = false;
+	cache->entries[entry].ordered = false;
+	cache->entries[entry].pins = 0;
+	cache->entries[entry].loading = false;
+	cache->entries[entry].prefetched = false;
+	cache->entries[entry].hash_next = cache->buckets[hash_block(cache, block)];
+	cache->buckets[hash_block(cache, block)] = entry;
+	lru_push(cache, entry);
+
+	return entry;
+}
+
+/* Give an entry back to the free list */
+static void put_entry(struct cache *cache, int entry) {
+	if (cache->entries[entry].ordered) {
+		cache->ordered_count--;
+	}
+	lru_remove(cache, entry);
+	hash_remove(cache, entry);
+	cache->entries[entry].block = -1;
+	cache->entries[entry].next = cache->free_head;
+	cache->free_head = entry;
+}
+
+/* Finish readahead of a run, called by whichever thread reaps its request */
+static void prefetch_finish(struct async_request *req) {
+	struct prefetch *prefetch = req->data;
+	struct cache *cache = prefetch->cache;
+
+	/* A failed read leaves the blocks to whoever asks for them next */
+	pthread_mutex_lock(&cache->lock);
+	for (int i = 0; i < req->count; i++) {
+		int entry = prefetch->entries[i];
+		cache->entries[entry].loading = false;
+		cache->entries[entry].pins--;
+		cache->loading_count--;
+		if (req->result != 0) {
+			put_entry(cache, entry);
+		} else {
+			cache->entries[entry].prefetched = true;
+			cache->stats.prefetched++;
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	free(prefetch);
+}
+
+struct cache *cache_init(struct disk *disk, struct async *async, int size)
+{
+	if (size < 0) {
+		fprintf(stderr, "cache_init: invalid cache size\n");
+		return NULL;
+	}
+
+	struct cache *cache = malloc(sizeof(struct cache));
+	if (!cache) {
+		fprintf(stderr, "cache_init: failed to allocate cache\n");
+		return NULL;
+	}
+	cache->disk = disk;
+	cache->async = async;
+
+	/* Use a power of two number of buckets, at least one per entry */
+	int nbuckets = 1;
+	while (nbuckets < size) {
+		nbuckets <<= 1;
+	}
+
+	cache->block_size = disk_get_block_size(cache->disk);
+	cache->entries = malloc(sizeof(struct cache_entry) * (size_t) size);
+	cache->data = malloc((size_t) size * cache->block_size);
+	cache->buckets = malloc(sizeof(int) * (size_t) nbuckets);
+	cache->bucket_writing = calloc(nbuckets, sizeof(int));
+	cache->bucket_written = calloc(nbuckets, sizeof(unsigned long));
+	cache->flush_order = malloc(sizeof(int) * (size_t) (size + 1));
+	if ((size > 0 && (!cache->entries || !cache->data)) || !cache->buckets || !cache->bucket_writing || !cache->bucket_written ||
+	    !cache->flush_order) {
+		fprintf(stderr, "cache_init: failed to allocate cache\n");
+		free(cache->entries);
+		free(cache->data);
+		free(cache->buckets);
+		free(cache->bucket_writing);
+		free(cache->bucket_written);
+		free(cache->flush_order);
+		free(cache);
+		return NULL;
+	}
+
+	/* All entries start out on the free list */
+	for (int i = 0; i < size; i++) {
+		cache->entries[i].block = -1;
+		cache->entries[i].dirty = false;
+		cache->entries[i].ordered = false;
+		cache->entries[i].pins = 0;
+		cache->entries[i].loading = false;
+		cache->entries[i].prefetched = false;
+		cache->entries[i].next = (i + 1 < size) ? i + 1 : -1;
+	}
+	for (int i = 0; i < nbuckets; i++) {
+		cache->buckets[i] = -1;
+	}
+
+	cache->capacity = size;
+	cache->bucket_mask = nbuckets - 1;
+	cache->free_head = (size > 0) ? 0 : -1;
+	cache->lru_head = cache->lru_tail = -1;
+	cache->ordered_count = 0;
+	cache->loading_count = 0;
+	memset(&cache->stats, 0, sizeof(cache->stats));
+	pthread_mutex_init(&cache->lock, NULL);
+
+	return cache;
+}
+
+int cache_destroy(struct cache *cache)
+{
+	/* Let readahead finish what it started */
+	pthread_mutex_lock(&cache->lock);
+	wait_loaded(cache);
+	pthread_mutex_unlock(&cache->lock);
+
+	/* Write back anything still dirty before dropping it */
+	int ret = cache_flush(cache);
+
+	free(cache->entries);
+	free(cache->data);
+	free(cache->buckets);
+	free(cache->bucket_writing);
+	free(cache->bucket_written);
+	free(cache->flush_order);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+
+	return ret;
+}
+
+/* Order entries by block number so write back is sequential on disk */
+static int compare_entries(const void *a, const void *b, void *arg) {
+	const struct cache *cache = arg;
+	return cache->entries[*(const int *) a].block - cache->entries[*(const int *) b].block;
+}
+
+int cache_flush(struct cache *cache)
+{
+	pthread_mutex_lock(&cache->lock);
+
+	/* Collect dirty entries, those held for ordering stay in memory */
+	int count = 0;
+	int *dirty = cache->flush_order;
+	for (int i = cache->lru_head; i != -1; i = cache->entries[i].next) {
+		if (cache->entries[i].dirty && !cache->entries[i].ordered) {
+			dirty[count++] = i;
+		}
+	}
+	qsort_r(dirty, count, sizeof(int), compare_entries, cache);
+
+	/* Write them back in block order */
+	int ret = 0;
+	for (int i = 0; i < count; i++) {
+		if (disk_write(cache->disk, cache->entries[dirty[i]].block, entry_data(cache, dirty[i])) != 0) {
+			fprintf(stderr, "cache_flush: failed to write back block\n");
+			ret = -1;
+			continue;
+		}
+		cache->entries[dirty[i]].dirty = false;
+		cache->stats.writebacks++;
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+
+	return ret;
+}
+
+/* Replace a block's cached copy, holding it in memory if ordered is set */
+static int write_entry(struct cache *cache, int block, const void *buf, bool ordered)
+{
+	if ((block < 0) || (block >= disk_get_block_count(cache->disk))) {
+		fprintf(stderr, "cache_write: block index out of bounds\n");
+		return -1;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+
+	/* The whole block is replaced, so a miss does not need to read it first */
+	int entry = lookup_ready(cache, block);
+	if (entry != -1) {
+		cache->stats.hits++;
+		lru_remove(cache, entry);
+		lru_push(cache, entry);
+	} else {
+		cache->stats.misses++;
+		if ((entry = get_entry(cache, block)) == -1) {
+			pthread_mutex_unlock(&cache->lock);
+			return -1;
+		}
+	}
+
+	memcpy(entry_data(cache, entry), buf, cache->block_size);
+	cache->entries[entry].dirty = true;
+	if (ordered && !cache->entries[entry].ordered) {
+		cache->entries[entry].ordered = true;
+		cache->ordered_count++;
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+
+	return 0;
+}
+
+int cache_write(struct cache *cache, int block, const void *buf)
+{
+	if (cache->capacity == 0) {
+		return disk_write(cache->disk, block, buf);
+	}
+
+	return write_entry(cache, block, buf, false);
+}
+
+int cache_write_ordered(struct cache *cache, int block, const void *buf)
+{
+	/* Without a cache the block goes straight to disk */
+	if (cache->capacity == 0) {
+		return disk_write(cache->disk, block, buf);
+	}
+
+	return write_entry(cache, block, buf, true);
+}
+
+void cache_release_ordered(struct cache *cache)
+{
+	pthread_mutex_lock(&cache->lock);
+	for (int i = cache->lru_head; i != -1 && cache->ordered_count > 0; i = cache->entries[i].next) {
+		if (cache->entries[i].ordered) {
+			cache->entries[i].ordered = false;
+			cache->ordered_count--;
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+int cache_read(struct cache *cache, int block, void *buf)
+{
+	if (cache->capacity == 0) {
+		return disk_read(cache->disk, block, buf);
+	}
+
+	if ((block < 0) || (block >= disk_get_block_count(cache->disk))) {
+		fprintf(stderr, "cache_read: block index out of bounds\n");
+		return -1;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	int entry = lookup_ready(cache, block);
+	if (entry != -1) {
+		count_hit(cache, entry);
+		lru_remove(cache, entry);
+		lru_push(cache, entry);
+		memcpy(buf, entry_data(cache, entry), cache->block_size);
+		pthread_mutex_unlock(&cache->lock);
+		return 0;
+	}
+	cache->stats.misses++;
+	unsigned long stamp = cache->bucket_written[hash_block(cache, block)];
+	pthread_mutex_unlock(&cache->lock);
+
+	/* Read without the lock, then keep a copy unless another reader got there first or a write
+	 * through may have left it stale */
+	if (disk_read(cache->disk, block, buf) != 0) {
+		return -1;
+	}
+	pthread_mutex_lock(&cache->lock);
+	if (lookup(cache, block) == -1 && read_current(cache, block, stamp) && (entry = get_entry(cache, block)) != -1) {
+		memcpy(entry_data(cache, entry), buf, cache->block_size);
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return 0;
+}
+
+int cache_writev(struct cache *cache, int count, const int *blocks, const void *const *bufs)
+{
+	if (cache->capacity == 0) {
+		return async_transfer(cache->async, 1, count, blocks, (void *const *) bufs);
+	}
+
+	int cached[VECTOR_BLOCKS];
+
+	for (int base = 0; base < count; base += VECTOR_BLOCKS) {
+		int batch = (count - base < VECTOR_BLOCKS) ? count - base : VECTOR_BLOCKS;
+
+		/* Keep cached copies current and pinned, then write the whole batch through */
+		pthread_mutex_lock(&cache->lock);
+		for (int i = 0; i < batch; i++) {
+			cached[i] = lookup_ready(cache, blocks[base + i]);
+			if (cached[i] != -1) {
+				cache->stats.hits++;
+				cache->entries[cached[i]].pins++;
+				memcpy(entry_data(cache, cached[i]), bufs[base + i], cache->block_size);
+			} else {
+				cache->stats.misses++;
+				cache->bucket_writing[hash_block(cache, blocks[base + i])]++;
+			}
+		}
+		pthread_mutex_unlock(&cache->lock);
+
+		int ret = async_transfer(cache->async, 1, batch, blocks + base, (void *const *) bufs + base);
+
+		/* Cached copies now match the disk, and reads of the others that overlapped are not kept */
+		pthread_mutex_lock(&cache->lock);
+		for (int i = 0; i < batch; i++) {
+			if (cached[i] != -1) {
+				cache->entries[cached[i]].pins--;
+				if (ret == 0) {
+					cache->entries[cached[i]].dirty = false;
+				}
+			} else {
+				cache->bucket_writing[hash_block(cache, blocks[base + i])]--;
+				cache->bucket_written[hash_block(cache, blocks[base + i])]++;
+			}
+		}
+		pthread_mutex_unlock(&cache->lock);
+		if (ret != 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int cache_readv(struct cache *cache, int count, const int *blocks, void *const *bufs)
+{
+	if (cache->capacity == 0) {
+		return async_transfer(cache->async, 0, count, blocks, bufs);
+	}
+
+	int hits[VECTOR_BLOCKS];
+	int hit_index[VECTOR_BLOCKS];
+	int miss_blocks[VECTOR_BLOCKS];
+	void *miss_bufs[VECTOR_BLOCKS];
+	unsigned long miss_stamps[VECTOR_BLOCKS];
+
+	for (int base = 0; base < count; base += VECTOR_BLOCKS) {
+		int batch = (count - base < VECTOR_BLOCKS) ? count - base : VECTOR_BLOCKS;
+
+		/* Pin the hits and gather the misses */
+		int hit_count = 0;
+		int misses = 0;
+		pthread_mutex_lock(&cache->lock);
+		for (int i = base; i < base + batch; i++) {
+			int entry = lookup_ready(cache, blocks[i]);
+			if (entry != -1) {
+				count_hit(cache, entry);
+				lru_remove(cache, entry);
+				lru_push(cache, entry);
+				cache->entries[entry].pins++;
+				hits[hit_count] = entry;
+				hit_index[hit_count] = i;
+				hit_count++;
+			} else {
+				cache->stats.misses++;
+				miss_blocks[misses] = blocks[i];
+				miss_bufs[misses] = bufs[i];
+				miss_stamps[misses] = cache->bucket_written[hash_block(cache, blocks[i])];
+				misses++;
+			}
+		}
+		pthread_mutex_unlock(&cache->lock);
+
+		/* Copy the hits out and read all misses in one vector, without the lock */
+		for (int i = 0; i < hit_count; i++) {
+			memcpy(bufs[hit_index[i]], entry_data(cache, hits[i]), cache->block_size);
+		}
+		int ret = async_transfer(cache->async, 0, misses, miss_blocks, miss_bufs);
+
+		/* Unpin, then keep copies of the misses for later reads unless a write through overlapped them */
+		pthread_mutex_lock(&cache->lock);
+		for (int i = 0; i < hit_count; i++) {
+			cache->entries[hits[i]].pins--;
+		}
+		for (int i = 0; ret == 0 && i < misses; i++) {
+			if (lookup(cache, miss_blocks[i]) != -1 || !read_current(cache, miss_blocks[i], miss_stamps[i])) {
+				continue;
+			}
+			int entry = get_entry(cache, miss_blocks[i]);
+			if (entry == -1) {
+				break;
+			}
+			memcpy(entry_data(cache, entry), miss_bufs[i], cache->block_size);
+		}
+		pthread_mutex_unlock(&cache->lock);
+		if (ret != 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int cache_discard(struct cache *cache, int block, int count)
+{
+	if (cache->capacity > 0) {
+		pthread_mutex_lock(&cache->lock);
+		wait_loaded(cache);
+
+		/* Look each block up for short runs, otherwise walk the cached entries */
+		if (count < cache->capacity) {
+			for (int i = block; i < block + count; i++) {
+				int entry = lookup(cache, i);
+				if (entry != -1) {
+					put_entry(cache, entry);
+				}
+			}
+		} else {
+			for (int i = cache->lru_head; i != -1; ) {
+				int next = cache->entries[i].next;
+				if (cache->entries[i].block >= block && cache->entries[i].block < block + count) {
+					put_entry(cache, i);
+				}
+				i = next;
+			}
+		}
+
+		pthread_mutex_unlock(&cache->lock);
+	}
+
+	return disk_discard(cache->disk, block, count);
+}
+
+int cache_prefetch(struct cache *cache, int count, const int *blocks)
+{
+	/* Readahead needs the async engine, which a mapped disk does without */
+	if (cache->capacity == 0 || disk_fd(cache->disk) < 0) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	int queued = 0;
+	for (int i = 0; i < count && cache->loading_count < cache->capacity / 4; ) {
+		if ((blocks[i] < 0) || (blocks[i] >= disk_get_block_count(cache->disk))) {
+			fprintf(stderr, "cache_prefetch: block index out of bounds\n");
+			break;
+		}
+		if (lookup(cache, blocks[i]) != -1) {
+			i++;
+			continue;
+		}
+
+		/* Adjacent blocks not cached yet go in one request */
+		struct prefetch *prefetch = malloc(sizeof(struct prefetch));
+		if (!prefetch) {
+			break;
+		}
+		int length = 0;
+		while (i < count && length < VECTOR_BLOCKS && cache->loading_count < cache->capacity / 4 &&
+		       (length == 0 || blocks[i] == blocks[i - 1] + 1) && lookup(cache, blocks[i]) == -1) {
+			int entry = get_entry(cache, blocks[i]);
+			if (entry == -1) {
+				break;
+			}
+			cache->entries[entry].loading = true;
+			cache->entries[entry].pins++;
+			cache->loading_count++;
+			prefetch->entries[length] = entry;
+			prefetch->iov[length].iov_base = entry_data(cache, entry);
+			prefetch->iov[length].iov_len = cache->block_size;
+			length++;
+			i++;
+		}
+
+		prefetch->req.write = 0;
+		prefetch->req.block = blocks[i - length];
+		prefetch->req.count = length;
+		prefetch->req.iov = prefetch->iov;
+		prefetch->req.data = prefetch;
+		prefetch->cache = cache;
+		prefetch->req.callback = prefetch_finish;
+
+		/* Give up on readahead while the engine is busy, the reads will come anyway */
+		if (length == 0 || async_start(cache->async, &prefetch->req) != 0) {
+			for (int j = 0; j < length; j++) {
+				cache->loading_count--;
+				put_entry(cache, prefetch->entries[j]);
+			}
+			free(prefetch);
+			break;
+		}
+		queued += length;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return queued;
+}
+
+void cache_get_stats(struct cache *cache, struct cache_stats *out)
+{
+	pthread_mutex_lock(&cache->lock);
+	*out = cache->stats;
+	pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,52 @@
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include "disk.h"
+#include "async.h"
+
+/* Default number of blocks held in memory by the block cache */
+#ifndef CACHE_BLOCKS
+#define CACHE_BLOCKS 1024
+#endif
+
+/* Block cache counters */
+struct cache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long writebacks;
+	unsigned long evictions;
+	/* Blocks read ahead, and those a read found in memory afterwards */
+	unsigned long prefetched;
+	unsigned long prefetch_hits;
+};
+
+/* Block cache of one disk, moving multi-block transfers through its async engine */
+struct cache;
+
+/* Set up a cache of capacity blocks, NULL on failure, zero blocks passes everything through */
+struct cache *cache_init(struct disk *disk, struct async *async, int capacity);
+int cache_destroy(struct cache *cache);
+int cache_flush(struct cache *cache);
+
+int cache_write(struct cache *cache, int block, const void *buf);
+int cache_read(struct cache *cache, int block, void *buf);
+
+/* Write a block that is held in memory, not written back, until cache_release_ordered
+ * Used for metadata that must not reach the disk before the log records describing it. */
+int cache_write_ordered(struct cache *cache, int block, const void *buf);
+void cache_release_ordered(struct cache *cache);
+
+/* Multi-block transfers, misses go to disk as coalesced vectors */
+int cache_writev(struct cache *cache, int count, const int *blocks, const void *const *bufs);
+int cache_readv(struct cache *cache, int count, const int *blocks, void *const *bufs);
+
+/* Start reading the blocks not cached yet in the background, returns how many were queued
+ * Readahead gives up quietly when a quarter of the cache is already loading. */
+int cache_prefetch(struct cache *cache, int count, const int *blocks);
+
+/* Forget count blocks from block on without writing them back, then discard them on disk */
+int cache_discard(struct cache *cache, int block, int count);
+
+void cache_get_stats(struct cache *cache, struct cache_stats *stats);
+
+#endif
@@ -1,38 +1,79 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "disk.h"
 
-/* is the virtual disk open (active) */
-static int active = 0;
+/* Most buffers handed to a single preadv/pwritev call */
+#ifdef IOV_MAX
+#define MAX_IOVECS IOV_MAX
+#else
+#define MAX_IOVECS 1024
+#endif
 
-/* file handle to virtual disk */
-static int handle;
+/* the backend disk_open picks */
+static enum disk_backend default_backend = DISK_BACKEND_FILE;
+
+/* the disk open_disk opened, which the calls without a disk act on */
+static struct disk *default_disk;
+
+/* An open virtual disk */
+struct disk {
+	/* file handle to virtual disk */
+	int handle;
+
+	/* how blocks of the disk are moved */
+	enum disk_backend backend;
+
+	/* whole disk image when it is mapped into memory */
+	char *mapping;
+
+	/* size of the image, and how it is divided into blocks */
+	off_t image_size;
+	int block_size;
+	int block_count;
+
+	/* blocks moved in and out, counted by whichever thread moved them */
+	unsigned long reads;
+	unsigned long writes;
+};
 
 int make_disk(const char *name)
 {
-	int f, cnt;
-	char buf[BLOCK_SIZE];
+	return make_disk_geometry(name, DISK_BLOCKS, BLOCK_SIZE);
+}
+
+int make_disk_geometry(const char *name, int count, int size)
+{
+	int f;
 
 	if (!name) {
 		fprintf(stderr, "make_disk: invalid file name\n");
 		return -1;
 	}
 
+	if ((size < MIN_BLOCK_SIZE) || (size > MAX_BLOCK_SIZE) || (size & (size - 1)) || (count <= 0)) {
+		fprintf(stderr, "make_disk: invalid disk geometry\n");
+		return -1;
+	}
+
 	if ((f = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
 		perror("make_disk: cannot open file");
 		return -1;
 	}
 
-	memset(buf, 0, BLOCK_SIZE);
-	for (cnt = 0; cnt < DISK_BLOCKS; ++cnt) {
-		if (write(f, buf, BLOCK_SIZE) < 0) {
-			perror("make_disk: failed to write");
-			return -1;
-		}
+	/* Extend the empty file, it stays sparse until blocks are written */
+	if (ftruncate(f, (off_t) count * size) < 0) {
+		perror("make_disk: failed to size file");
+		close(f);
+		return -1;
 	}
 
 	close(f);
@@ -40,91 +81,417 @@ int make_disk(const char *name)
 	return 0;
 }
 
-int open_disk(const char *name)
+int set_disk_backend(enum disk_backend type)
+{
+	if ((type != DISK_BACKEND_FILE) && (type != DISK_BACKEND_MMAP)) {
+		fprintf(stderr, "set_disk_backend: invalid backend\n");
+		return -1;
+	}
+
+	default_backend = type;
+
+	return 0;
+}
+
+struct disk *disk_open(const char *name)
+{
+	return disk_open_backend(name, default_backend);
+}
+
+struct disk *disk_open_backend(const char *name, enum disk_backend type)
 {
 	int f;
 
 	if (!name) {
-		fprintf(stderr, "open_disk: invalid file name\n");
+		fprintf(stderr, "disk_open: invalid file name\n");
+		return NULL;
+	}
+
+	if ((f = open(name, O_RDWR, 0644)) < 0) {
+		perror("disk_open: cannot open file");
+		return NULL;
+	}
+
+	/* Blocks are BLOCK_SIZE until the caller knows better */
+	struct stat st;
+	if (fstat(f, &st) < 0 || st.st_size < BLOCK_SIZE) {
+		fprintf(stderr, "disk_open: disk image too small\n");
+		close(f);
+		return NULL;
+	}
+
+	struct disk *disk = malloc(sizeof(struct disk));
+	if (!disk) {
+		fprintf(stderr, "disk_open: failed to allocate\n");
+		close(f);
+		return NULL;
+	}
+	disk->mapping = NULL;
+	disk->image_size = st.st_size;
+	disk->block_size = BLOCK_SIZE;
+	disk->block_count = disk->image_size / disk->block_size;
+	disk->reads = 0;
+	disk->writes = 0;
+
+	if (type == DISK_BACKEND_MMAP) {
+		/* Map the whole image, touching a page past its end would fault */
+		disk->mapping = mmap(NULL, (size_t) disk->image_size, PROT_READ | PROT_WRITE, MAP_SHARED, f, 0);
+		if (disk->mapping == MAP_FAILED) {
+			perror("disk_open: cannot map file");
+			free(disk);
+			close(f);
+			return NULL;
+		}
+	}
+
+	disk->handle = f;
+	disk->backend = type;
+
+	return disk;
+}
+
+int disk_sync(struct disk *disk)
+{
+	if (!disk) {
+		fprintf(stderr, "disk_sync: no open disk\n");
 		return -1;
 	}
 
-	if (active) {
-		fprintf(stderr, "open_disk: disk is already open\n");
+	if (disk->backend == DISK_BACKEND_MMAP) {
+		if (msync(disk->mapping, (size_t) disk->image_size, MS_SYNC) < 0) {
+			perror("disk_sync: failed to msync");
+			return -1;
+		}
+	} else if (fdatasync(disk->handle) < 0) {
+		perror("disk_sync: failed to fdatasync");
 		return -1;
 	}
 
-	if ((f = open(name, O_RDWR, 0644)) < 0) {
-		perror("open_disk: cannot open file");
+	return 0;
+}
+
+int disk_fd(struct disk *disk)
+{
+	/* A mapped disk is not accessed through its file handle */
+	if (!disk || disk->backend == DISK_BACKEND_MMAP) {
 		return -1;
 	}
 
-	handle = f;
-	active = 1;
+	return disk->handle;
+}
+
+int disk_set_block_size(struct disk *disk, int size)
+{
+	if (!disk) {
+		fprintf(stderr, "disk_set_block_size: no open disk\n");
+		return -1;
+	}
+
+	if ((size < MIN_BLOCK_SIZE) || (size > MAX_BLOCK_SIZE) || (size & (size - 1)) || (size > disk->image_size)) {
+		fprintf(stderr, "disk_set_block_size: invalid block size\n");
+		return -1;
+	}
+
+	disk->block_size = size;
+	disk->block_count = disk->image_size / size;
 
 	return 0;
 }
 
-int close_disk()
+int disk_get_block_size(struct disk *disk)
+{
+	return disk->block_size;
+}
+
+int disk_get_block_count(struct disk *disk)
+{
+	return disk->block_count;
+}
+
+int disk_close(struct disk *disk)
 {
-	if (!active) {
-		fprintf(stderr, "close_disk: no open disk\n");
+	if (!disk) {
+		fprintf(stderr, "disk_close: no open disk\n");
 		return -1;
 	}
 
-	close(handle);
+	/* Flush the mapping back to the image before dropping it */
+	if (disk->backend == DISK_BACKEND_MMAP) {
+		if (msync(disk->mapping, (size_t) disk->image_size, MS_SYNC) < 0) {
+			perror("disk_close: failed to msync");
+		}
+		munmap(disk->mapping, (size_t) disk->image_size);
+		disk->mapping = NULL;
+	}
 
-	active = handle = 0;
+	close(disk->handle);
+	free(disk);
 
 	return 0;
 }
 
-int block_write(int block, const void *buf)
+int disk_write(struct disk *disk, int block, const void *buf)
 {
-	if (!active) {
-		fprintf(stderr, "block_write: disk not active\n");
+	if (!disk) {
+		fprintf(stderr, "disk_write: disk not active\n");
+		return -1;
+	}
+
+	if ((block < 0) || (block >= disk->block_count)) {
+		fprintf(stderr, "disk_write: block index out of bounds\n");
+		return -1;
+	}
+
+	if (disk->backend == DISK_BACKEND_MMAP) {
+		memcpy(disk->mapping + (size_t) block * disk->block_size, buf, disk->block_size);
+		disk_count(disk, 1, 1);
+		return 0;
+	}
+
+	if (pwrite(disk->handle, buf, disk->block_size, (off_t) block * disk->block_size) != disk->block_size) {
+		perror("disk_write: failed to write");
 		return -1;
 	}
+	disk_count(disk, 1, 1);
 
-	if ((block < 0) || (block >= DISK_BLOCKS)) {
-		fprintf(stderr, "block_write: block index out of bounds\n");
+	return 0;
+}
+
+int disk_read(struct disk *disk, int block, void *buf)
+{
+	if (!disk) {
+		fprintf(stderr, "disk_read: disk not active\n");
 		return -1;
 	}
 
-	if (lseek(handle, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("block_write: failed to lseek");
+	if ((block < 0) || (block >= disk->block_count)) {
+		fprintf(stderr, "disk_read: block index out of bounds\n");
 		return -1;
 	}
 
-	if (write(handle, buf, BLOCK_SIZE) < 0) {
-		perror("block_write: failed to write");
+	if (disk->backend == DISK_BACKEND_MMAP) {
+		memcpy(buf, disk->mapping + (size_t) block * disk->block_size, disk->block_size);
+		disk_count(disk, 0, 1);
+		return 0;
+	}
+
+	if (pread(disk->handle, buf, disk->block_size, (off_t) block * disk->block_size) != disk->block_size) {
+		perror("disk_read: failed to read");
 		return -1;
 	}
+	disk_count(disk, 0, 1);
 
 	return 0;
 }
 
-int block_read(int block, void *buf)
+int disk_discard(struct disk *disk, int block, int count)
 {
-	if (!active) {
-		fprintf(stderr, "block_read: disk not active\n");
+	if (!disk) {
+		fprintf(stderr, "disk_discard: disk not active\n");
 		return -1;
 	}
 
-	if ((block < 0) || (block >= DISK_BLOCKS)) {
-		fprintf(stderr, "block_read: block index out of bounds\n");
+	if ((count <= 0) || (block < 0) || (block + count > disk->block_count)) {
+		fprintf(stderr, "disk_discard: block index out of bounds\n");
 		return -1;
 	}
 
-	if (lseek(handle, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("block_read: failed to lseek");
+	/* Punch a hole in the image, a mapping of it reads back zeros there too */
+	if (fallocate(disk->handle, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t) block * disk->block_size, (off_t) count * disk->block_size) < 0) {
+		/* Images without hole support just keep the old contents */
+		if (errno == EOPNOTSUPP || errno == ENOSYS) {
+			return 0;
+		}
+		perror("disk_discard: failed to punch hole");
 		return -1;
 	}
 
-	if (read(handle, buf, BLOCK_SIZE) < 0) {
-		perror("block_read: failed to read");
+	return 0;
+}
+
+/* Move a run of physically contiguous blocks with as few calls as possible */
+static int transfer_run(struct disk *disk, int write, int block, struct iovec *iov, int count)
+{
+	off_t offset = (off_t) block * disk->block_size;
+
+	while (count > 0) {
+		int batch = (count < MAX_IOVECS) ? count : MAX_IOVECS;
+		ssize_t done;
+
+		if (batch == 1) {
+			done = write ? pwrite(disk->handle, iov->iov_base, iov->iov_len, offset)
+				     : pread(disk->handle, iov->iov_base, iov->iov_len, offset);
+		} else {
+			done = write ? pwritev(disk->handle, iov, batch, offset)
+				     : preadv(disk->handle, iov, batch, offset);
+		}
+		if (done <= 0) {
+			return -1;
+		}
+		offset += done;
+
+		/* Skip the buffers that were fully transferred */
+		while (count > 0 && done >= (ssize_t) iov->iov_len) {
+			done -= iov->iov_len;
+			iov++;
+			count--;
+		}
+
+		/* Continue a partially transferred buffer */
+		if (done > 0) {
+			iov->iov_base = (char *) iov->iov_base + done;
+			iov->iov_len -= done;
+		}
+	}
+
+	return 0;
+}
+
+/* Split a block list into physically contiguous runs and transfer each run */
+static int transfer_vector(struct disk *disk, int write, int count, const int *blocks, void *const *bufs)
+{
+	const char *name = write ? "disk_writev" : "disk_readv";
+
+	if (!disk) {
+		fprintf(stderr, "%s: disk not active\n", name);
 		return -1;
 	}
 
+	if (count <= 0) {
+		return 0;
+	}
+
+	struct iovec iov[VECTOR_BLOCKS];
+
+	int start = 0;
+	while (start < count) {
+		/* Check every block of the run and extend it while blocks are adjacent */
+		int end = start;
+		do {
+			if ((blocks[end] < 0) || (blocks[end] >= disk->block_count)) {
+				fprintf(stderr, "%s: block index out of bounds\n", name);
+				return -1;
+			}
+			iov[end - start].iov_base = bufs[end];
+			iov[end - start].iov_len = disk->block_size;
+			end++;
+		} while (end < count && end - start < VECTOR_BLOCKS && blocks[end] == blocks[end - 1] + 1);
+
+		if (disk->backend == DISK_BACKEND_MMAP) {
+			/* Mapped disk, the run is just a copy per buffer */
+			for (int i = start; i < end; i++) {
+				char *image = disk->mapping + (size_t) blocks[i] * disk->block_size;
+				if (write) {
+					memcpy(image, bufs[i], disk->block_size);
+				} else {
+					memcpy(bufs[i], image, disk->block_size);
+				}
+			}
+		} else if (transfer_run(disk, write, blocks[start], iov, end - start) != 0) {
+			perror(write ? "disk_writev: failed to write" : "disk_readv: failed to read");
+			return -1;
+		}
+		disk_count(disk, write, end - start);
+		start = end;
+	}
+
 	return 0;
 }
+
+int disk_writev(struct disk *disk, int count, const int *blocks, const void *const *bufs)
+{
+	return transfer_vector(disk, 1, count, blocks, (void *const *) bufs);
+}
+
+int disk_readv(struct disk *disk, int count, const int *blocks, void *const *bufs)
+{
+	return transfer_vector(disk, 0, count, blocks, bufs);
+}
+
+void disk_count(struct disk *disk, int write, int count)
+{
+	__atomic_fetch_add(write ? &disk->writes : &disk->reads, (unsigned long) count, __ATOMIC_RELAXED);
+}
+
+void disk_get_stats(struct disk *disk, struct disk_stats *stats)
+{
+	stats->reads = __atomic_load_n(&disk->reads, __ATOMIC_RELAXED);
+	stats->writes = __atomic_load_n(&disk->writes, __ATOMIC_RELAXED);
+}
+
+int open_disk(const char *name)
+{
+	return open_disk_backend(name, default_backend);
+}
+
+int open_disk_backend(const char *name, enum disk_backend type)
+{
+	if (default_disk) {
+		fprintf(stderr, "open_disk: disk is already open\n");
+		return -1;
+	}
+
+	if ((default_disk = disk_open_backend(name, type)) == NULL) {
+		return -1;
+	}
+
+	return 0;
+}
+
+int sync_disk()
+{
+	return disk_sync(default_disk);
+}
+
+int close_disk()
+{
+	int ret = disk_close(default_disk);
+	default_disk = NULL;
+
+	return ret;
+}
+
+int disk_handle()
+{
+	return disk_fd(default_disk);
+}
+
+int set_disk_block_size(int size)
+{
+	return disk_set_block_size(default_disk, size);
+}
+
+int disk_block_size()
+{
+	return default_disk ? disk_get_block_size(default_disk) : 0;
+}
+
+int disk_block_count()
+{
+	return default_disk ? disk_get_block_count(default_disk) : 0;
+}
+
+int block_write(int block, const void *buf)
+{
+	return disk_write(default_disk, block, buf);
+}
+
+int block_read(int block, void *buf)
+{
+	return disk_read(default_disk, block, buf);
+}
+
+int block_discard(int block, int count)
+{
+	return disk_discard(default_disk, block, count);
+}
+
+int block_writev(int count, const int *blocks, const void *const *bufs)
+{
+	return disk_writev(default_disk, count, blocks, bufs);
+}
+
+int block_readv(int count, const int *blocks, void *const *bufs)
+{
+	return disk_readv(default_disk, count, blocks, bufs);
+}
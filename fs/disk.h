@@ -1,14 +1,81 @@
 #ifndef _DISK_H_
 #define _DISK_H_
 
+/* Geometry of a disk made by make_disk */
 #define DISK_BLOCKS  8192
 #define BLOCK_SIZE   4096
 
+/* Block sizes make_disk_geometry accepts, powers of two in this range */
+#define MIN_BLOCK_SIZE 1024
+#define MAX_BLOCK_SIZE 65536
+
+/* Most blocks moved per batch by the vectored calls, longer lists are split */
+#define VECTOR_BLOCKS 256
+
+/* How block_read/block_write reach the disk image */
+enum disk_backend {
+	DISK_BACKEND_FILE,	/* pread/pwrite on the image file */
+	DISK_BACKEND_MMAP,	/* memcpy in and out of a shared mapping */
+};
+
+/* Blocks moved in and out of a disk image since it was opened */
+struct disk_stats {
+	unsigned long reads;
+	unsigned long writes;
+};
+
 int make_disk(const char *name);
+int make_disk_geometry(const char *name, int count, int size);
+int set_disk_backend(enum disk_backend backend);
+
+/* One disk at a time, opened with the backend set by set_disk_backend or the one given */
 int open_disk(const char *name);
+int open_disk_backend(const char *name, enum disk_backend backend);
+int sync_disk();
 int close_disk();
 
+/* File handle of the open disk, -1 if blocks are not moved through it */
+int disk_handle();
+
+/* Block size of the open disk, BLOCK_SIZE until set, the block count follows from the image size */
+int set_disk_block_size(int size);
+int disk_block_size();
+int disk_block_count();
+
 int block_write(int block, const void *buf);
 int block_read(int block, void *buf);
 
+/* Drop the contents of count blocks from block on, they may read back as zeros */
+int block_discard(int block, int count);
+
+/* Transfer count blocks, coalescing runs of adjacent block numbers */
+int block_writev(int count, const int *blocks, const void *const *bufs);
+int block_readv(int count, const int *blocks, void *const *bufs);
+
+/* An open disk image, any number may be open at once through the calls below, which
+ * work as the ones above do on the disk given */
+struct disk;
+
+/* Open a disk image, NULL on failure */
+struct disk *disk_open(const char *name);
+struct disk *disk_open_backend(const char *name, enum disk_backend backend);
+int disk_sync(struct disk *disk);
+int disk_close(struct disk *disk);
+
+int disk_fd(struct disk *disk);
+
+int disk_set_block_size(struct disk *disk, int size);
+int disk_get_block_size(struct disk *disk);
+int disk_get_block_count(struct disk *disk);
+
+int disk_write(struct disk *disk, int block, const void *buf);
+int disk_read(struct disk *disk, int block, void *buf);
+int disk_discard(struct disk *disk, int block, int count);
+int disk_writev(struct disk *disk, int count, const int *blocks, const void *const *bufs);
+int disk_readv(struct disk *disk, int count, const int *blocks, void *const *bufs);
+
+/* Count blocks moved through the disk's handle without the calls above */
+void disk_count(struct disk *disk, int write, int count);
+void disk_get_stats(struct disk *disk, struct disk_stats *stats);
+
 #endif
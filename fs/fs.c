@@ -1,670 +1,4133 @@
 #include "disk.h"
+#include "cache.h"
+#include "async.h"
 #include "fs.h"
+#include "lz.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
 
-#define MAX_FILES 64
+/* Inodes in the inode table, the first one holds the directory */
+#define MAX_FILES 4096
 #define MAX_FILE_DESCRIPTORS 32
 #define MAX_FILE_NAME 15
-#define MAX_FILE_SIZE 1024 * 1024
+/* Only bounded by the size field, the disk fills up long before that */
+#define MAX_FILE_SIZE INT_MAX
+
+/* Marks a disk made by make_fs with the current layout */
+#define FS_MAGIC 0x39534653
 
 /* Super block information */
 struct super_block {
-	char usage_bitmap[DISK_BLOCKS / 8];
-	int directory_offset;
-	int directory_size;
+	uint32_t magic;
+	/* Geometry the disk was made with */
+	int block_size;
+	int block_count;
+	/* Inodes in use, including the directory's */
+	uint64_t inode_bitmap[MAX_FILES / 64];
+	/* Blocks holding the block usage bitmap */
+	int bitmap_offset;
+	int bitmap_size;
+	/* Blocks holding the share table */
+	int share_offset;
+	int share_size;
 	int inode_table_offset;
 	int inode_table_size;
+	/* Metadata log between the inode table and the data */
+	int log_offset;
+	int log_size;
+	/* Sequence number of the first transaction to replay */
+	uint32_t log_sequence;
 	int data_offset;
 	int data_size;
+	/* Free data blocks, kept up to date by the allocator */
+	int free_blocks;
+	/* Next-fit cursor, allocation searches start here */
+	int next_free;
 	bool is_mounted;
 };
 
+/* Run of physically contiguous disk blocks */
+struct extent {
+	int start;
+	int length;
+};
+
+/* Inode flags, kept on disk */
+#define INODE_COMPRESSED 1	/* contents are stored in compressed chunks */
+#define INODE_DEDUP 2		/* blocks written share disk blocks already holding the same data */
+#define INODE_INLINE 4		/* contents are kept in the inode, in place of its extents */
+
 /* Inode information */
 struct inode {
 	int ref_count;
 	int file_size;
-	int blocks[MAX_FILE_SIZE / BLOCK_SIZE];
+	int flags;
+	/* Descriptors open on the file, only kept in memory */
+	int open_count;
+	/* Read in from the inode table, and changed since */
+	bool loaded;
+	bool dirty;
+	/* Changed since the last log commit, its extents from log_extent on */
+	bool log_pending;
+	int log_extent;
+	/* Extents holding the file's blocks in file order */
+	int extent_count;
+	int extent_space;
+	struct extent *extents;
+	/* Blocks holding the extents past the direct ones: the indirect block
+	 * first, then the ones listed in the double indirect block */
+	int index_count;
+	int *index_blocks;
+	int double_indirect;
+	/* Held shared to read the file and exclusively to change it, also guards the file
+	 * pointers of descriptors open on it, together with their own locks while shared */
+	pthread_rwlock_t lock;
+	/* Chunk of a compressed file decompressed last, so reads and writes of small pieces
+	 * of it need not decompress it again; chunk_lock guards it while the inode is shared */
+	char *chunk_data;
+	int chunk_index;
+	pthread_mutex_t chunk_lock;
+	/* Contents of an INODE_INLINE file, INLINE_DATA bytes, set exactly while the flag is */
+	char *inline_data;
+};
+
+/* Extents kept in the inode itself, as many as fill it to 256 bytes */
+#define DIRECT_EXTENTS 29
+/* Extents per indirect block */
+#define INDIRECT_EXTENTS ((int) (fs->block_size / sizeof(struct extent)))
+/* Indirect blocks listed in the double indirect block */
+#define DOUBLE_INDIRECT_BLOCKS ((int) (fs->block_size / sizeof(int)))
+/* Most extents one inode can address */
+#define MAX_EXTENTS (DIRECT_EXTENTS + INDIRECT_EXTENTS * (1 + DOUBLE_INDIRECT_BLOCKS))
+
+/* Bytes of a file small enough to be kept in its inode, the room its extent map takes */
+#define INLINE_DATA ((int) (sizeof(struct extent) * DIRECT_EXTENTS + sizeof(int) * 2))
+
+/* Inode as stored on disk, block numbers are 0 when unused (block 0 is the super block) */
+struct disk_inode {
+	int ref_count;
+	int file_size;
+	int flags;
+	int extent_count;
+	union {
+		struct {
+			struct extent extents[DIRECT_EXTENTS];
+			/* Block of INDIRECT_EXTENTS more extents */
+			int indirect;
+			/* Block of indirect block numbers for the extents after those */
+			int double_indirect;
+		} map;
+		/* The file's contents instead, for INODE_INLINE files */
+		char data[INLINE_DATA];
+	} contents;
 };
 
-/* Directory file information */
+/* Inodes packed into each block of the inode table */
+#define INODES_PER_BLOCK ((int) (fs->block_size / sizeof(struct disk_inode)))
+
+/* Directory file information, unused entries have an empty name */
 struct directory_file {
-	char name[MAX_FILE_NAME];
+	char name[MAX_FILE_NAME + 1];
+	unsigned int hash;
+	int inode_index;
+};
+
+/* The directory is a hash table stored in the blocks of its own inode
+ * Each block is one bucket of entries. The bucket count is a power of two
+ * and doubles when a name's bucket is full. */
+#define DIRECTORY_INODE 0
+#define DIRECTORY_ENTRIES ((int) (fs->block_size / sizeof(struct directory_file)))
+#define MAX_DIRECTORY_BLOCKS 1024
+
+/* Where a name is, or would go, in the directory */
+struct directory_slot {
+	int disk_block;		/* bucket the name hashes to, -1 if the directory is empty */
+	int entry;		/* entry holding the name, -1 if there is none */
+	int free_entry;		/* first unused entry in the bucket, -1 if it is full */
+};
+
+/* Metadata log
+ * Changes are logged as records that set state, so replaying one twice does no harm.
+ * Records build up in memory and each commit writes them as one transaction: a header,
+ * then the records, starting on a new block. A checkpoint writes the metadata in place
+ * and starts the log over, which happens when it is half full and at unmount. */
+#define LOG_MAGIC 0x474f4c46
+/* Log blocks per 64 disk blocks, and the fewest a disk gets */
+#define LOG_FRACTION 64
+#define LOG_MIN_BLOCKS 16
+/* Bytes of records that make the next operation commit, at most a quarter of the log */
+#define LOG_BATCH (64 * 1024)
+
+enum log_type {
+	LOG_BLOCKS = 1,		/* run of blocks marked used or free */
+	LOG_INODE,		/* inode fields, index blocks and extents from first_extent on */
+	LOG_ENTRY,		/* one directory entry */
+	LOG_BUCKET,		/* directory bucket holding count entries, the rest unused */
+	LOG_SHARES,		/* share count of one block */
+};
+
+/* Start of a transaction */
+struct log_header {
+	uint32_t magic;
+	uint32_t checksum;	/* of the rest of the header and the records */
+	uint32_t sequence;
+	int length;		/* bytes of records after the header */
+	/* Allocator state at the commit */
+	int free_blocks;
+	int next_free;
+};
+
+/* Where the checksummed part of a transaction starts */
+#define LOG_CHECKED offsetof(struct log_header, sequence)
+
+struct log_record {
+	int type;
+	int length;		/* bytes of payload after the record */
+};
+
+struct log_blocks {
+	int start;
+	int length;
+	int used;
+};
+
+/* Followed by index_count block numbers, then the extents from first_extent on, or for
+ * INODE_INLINE files by the contents, padded to a whole number of ints */
+struct log_inode {
 	int inode_index;
+	int ref_count;
+	int file_size;
+	int flags;
+	int extent_count;
+	int first_extent;
+	int index_count;
+	int double_indirect;
+};
+
+struct log_entry {
+	int disk_block;
+	int entry;
+	struct directory_file file;
+};
+
+/* Followed by count entries */
+struct log_bucket {
+	int disk_block;
+	int count;
+};
+
+struct log_shares {
+	int block;
+	int shares;
+};
+
+/* Readahead starts at READAHEAD_MIN blocks once reads turn sequential and doubles
+ * with each further sequential read, up to READAHEAD_MAX bytes */
+#define READAHEAD_MIN 4
+#define READAHEAD_MAX (256 * 1024)
+
+/* Compressed files are stored in chunks of CHUNK_BLOCKS file blocks, chunk i in extent i of
+ * the inode. A chunk that compresses into fewer blocks than it spans is stored as a chunk_header
+ * and the compressed data, any other is stored as it is, so an extent as long as its chunk
+ * holds the chunk as it is and a shorter one holds it compressed. */
+#define CHUNK_BLOCKS 16
+#define CHUNK_SIZE (CHUNK_BLOCKS * fs->block_size)
+
+struct chunk_header {
+	int length;		/* bytes of compressed data after the header */
 };
 
+/* Links of the dedup index chains */
+#define DEDUP_END -1
+#define DEDUP_UNINDEXED -2
+/* Most references past the first one block can have */
+#define MAX_SHARES UINT16_MAX
+/* Blocks with a matching hash dedup_share compares at most */
+#define DEDUP_CANDIDATES 8
+
 /* File descriptor information */
 struct file_descriptor {
 	int inode_index;
 	int file_pointer;
+	/* Block a read continuing the last one starts in, blocks to read ahead
+	 * of such a read, and the block readahead has reached */
+	int readahead_next;
+	int readahead_window;
+	int readahead_end;
+	/* The fields above change with the inode held exclusively, or held shared and this held,
+	 * so reads through one descriptor each move its pointer past what they read */
+	pthread_mutex_t lock;
 };
 
-/* Global variables */
-static struct file_descriptor file_descriptors[MAX_FILE_DESCRIPTORS];
-struct super_block disk_super_block;
-struct inode inode_table[MAX_FILES];
-struct directory_file directory[MAX_FILES];
+/* Counters of one thread, only that thread adds to them so no lock is needed,
+ * fs_stats sums the shards of every thread that has used the file system */
+struct stats_shard {
+	struct stats_shard *next;
+	/* Thread the shard belongs to, the address of its thread_key */
+	const char *thread;
+	struct fs_stats stats;
+};
 
-/* Make the file system */
-int make_fs(const char *disk_name) {
-	/* Make the disk */
-	if (make_disk(disk_name) != 0) {
-		fprintf(stderr, "make_fs: cannot make disk\n");
-		return -1;
-	}
+/* A mounted file system, nothing in it is shared with other instances */
+struct fs_instance {
+	/* Disk the file system is on, with its asynchronous engine and block cache */
+	struct disk *disk;
+	struct async *async;
+	struct cache *cache;
 
-	/* Open the disk */
-	if (open_disk(disk_name) != 0) {
-		fprintf(stderr, "make_fs: cannot open disk\n");
-		return -1;
-	}
+	struct file_descriptor file_descriptors[MAX_FILE_DESCRIPTORS];
+	struct super_block disk_super_block;
 
-	/* Set up super block */
-	disk_super_block.is_mounted = false;
-	/* Super block is stored at disk block 0, directory at disk block 1 */
-	disk_super_block.directory_offset = 1;
-	/* Get size of directory */
-	disk_super_block.directory_size = (sizeof(struct directory_file) * MAX_FILES) / BLOCK_SIZE;
-	/* Inode table starts after directory */
-	disk_super_block.inode_table_offset = disk_super_block.directory_offset + disk_super_block.directory_size;
-	/* Inode size is same as number of files */
-	disk_super_block.inode_table_size = MAX_FILES;
-	/* Each inode needs its own block due to size */
-	disk_super_block.data_offset = disk_super_block.inode_table_offset + disk_super_block.inode_table_size;
-	/* Data size is disk size minus blocks need for metadata */
-	disk_super_block.data_size = DISK_BLOCKS - disk_super_block.data_offset;
-	/* Set usage bitmask to zero */
-	for (int i = 0; i < sizeof(disk_super_block.usage_bitmap); i++) {
-		disk_super_block.usage_bitmap[i] = 0;
-	}
+	/* Block size of the disk in use, from its super block */
+	int block_size;
+
+	/* One bit per disk block, set when the block is in use, held in memory while mounted */
+	uint64_t *usage_bitmap;
+
+	/* Share table: for each disk block the references to it past the first, files only share
+	 * blocks through dedup, held in memory while mounted and guarded by alloc_lock */
+	uint16_t *share_table;
+
+	/* Metadata changed since it was last written: the super block and each block of the usage bitmap
+	 * and of the share table */
+	bool super_dirty;
+	bool *bitmap_dirty;
+	bool *share_dirty;
+
+	/* Dedup index of the data blocks written by files that dedup, by a hash of their contents,
+	 * guarded by alloc_lock and set up on first use. Blocks whose hashes fall in a bucket are
+	 * chained through dedup_next, which is DEDUP_UNINDEXED for blocks not in the index. */
+	uint64_t *dedup_hashes;
+	int *dedup_next;
+	int *dedup_buckets;
+	int dedup_mask;
+	/* Set once any block is shared or indexed, before that writes need not look */
+	bool dedup_used;
+
+	/* Freed blocks whose contents have not been discarded on disk yet, they are discarded
+	 * once a commit makes their freeing durable, allocating a block again takes it off this bitmap */
+	uint64_t *discard_bitmap;
+	int discard_pending;
+
+	struct inode inode_table[MAX_FILES];
+
+	/* Inodes read in or created since mount, so unmount only visits those */
+	int loaded_inodes[MAX_FILES];
+	int loaded_count;
+
+	/* Records not committed yet, after room for the transaction header */
+	char *log_buffer;
+	int log_length;
+	int log_space;
+	/* Records were lost for want of memory, so the next commit is a checkpoint */
+	bool log_overflow;
+	/* Next log block to write, and the sequence number of the next transaction */
+	int log_position;
+	uint32_t log_sequence;
+	/* Set while replaying, so replayed changes are not logged again */
+	bool log_replaying;
+	/* Inodes changed since the last commit, logged as they are at the commit */
+	int log_inodes[MAX_FILES];
+	int log_inode_count;
+
+	/* Locking, always taken in this order:
+	 * fs_lock is held shared by operations that change anything, and exclusively by
+	 * commits and checkpoints so they see no operation half done; reads do not take it.
+	 * dir_lock guards the directory and its inode, then come the per-inode locks and after
+	 * each the locks of the descriptors open on it.
+	 * alloc_lock guards the usage bitmap, the inode bitmap and the allocator state in the
+	 * super block, log_lock the records and the list of changed inodes, load_lock the list
+	 * of loaded inodes, and fd_lock which descriptors are in use and the open counts.
+	 * Mounting and unmounting must not race with anything else. */
+	pthread_rwlock_t fs_lock;
+	pthread_rwlock_t dir_lock;
+	pthread_mutex_t alloc_lock;
+	pthread_mutex_t log_lock;
+	pthread_mutex_t load_lock;
+	pthread_mutex_t fd_lock;
 
-	/* Set bits that are used for metadata to 1 */
-	for (int i = 0; i < disk_super_block.data_offset; i++) {
-		disk_super_block.usage_bitmap[i / 8] |= (1 << (i % 8));
+	/* Group commit: a sync request is covered by the first commit that starts after it,
+	 * so requests arriving while one commit runs share the next */
+	pthread_mutex_t sync_lock;
+	pthread_cond_t sync_done;
+	unsigned long sync_requested;	/* requests made so far */
+	unsigned long sync_committed;	/* requests covered by finished commits */
+	bool sync_running;
+	int sync_status;			/* result of the last commit */
+
+	/* Per-thread counters, shards are only ever added, under stats_lock, so they can be
+	 * walked without it. The id is never reused, unlike the instance's address. */
+	unsigned long stats_id;
+	struct stats_shard *stats_shards;
+	pthread_mutex_t stats_lock;
+
+	/* Searches of the usage bitmap, guarded by alloc_lock like the bitmap */
+	unsigned long allocations;
+	unsigned long alloc_words;
+	unsigned long alloc_scan[FS_HISTOGRAM_BUCKETS];
+	/* Bitmap words looked at by the current search */
+	int alloc_scanned;
+};
+
+/* Source of instance stats ids, 0 is never handed out */
+static unsigned long next_stats_id = 0;
+
+/* Shard the thread last added to, and the id of the instance it belongs to */
+static __thread unsigned long shard_owner = 0;
+static __thread struct stats_shard *shard_cache = NULL;
+/* Its address tells threads apart */
+static __thread char thread_key;
+/* State of the xorshift generator picking which of the thread's calls are timed */
+static __thread uint32_t sample_state = 2463534242u;
+
+/* Drop an inode's in-memory extent list, and the chunk decompressed from them or its inline contents */
+static void inode_release_extents(struct inode *inode) {
+	free(inode->inline_data);
+	inode->inline_data = NULL;
+	free(inode->chunk_data);
+	inode->chunk_data = NULL;
+	inode->chunk_index = -1;
+	free(inode->extents);
+	inode->extents = NULL;
+	inode->extent_count = 0;
+	inode->extent_space = 0;
+	free(inode->index_blocks);
+	inode->index_blocks = NULL;
+	inode->index_count = 0;
+	inode->double_indirect = 0;
+}
+
+/* Number of index blocks needed to hold an inode's extents past the direct ones */
+static int index_blocks_needed(struct fs_instance *fs, int extent_count) {
+	if (extent_count <= DIRECT_EXTENTS) {
+		return 0;
 	}
+	return (extent_count - DIRECT_EXTENTS + INDIRECT_EXTENTS - 1) / INDIRECT_EXTENTS;
+}
 
-	/* Write super block to first block on disk */
-	char *block = calloc(1, BLOCK_SIZE);
-	memcpy((void *) block, (void *) &disk_super_block, sizeof(struct super_block)); 
-	block_write(0, block);
+/* Fill an inode's record in the inode table from the in-memory inode and write out its index blocks */
+static void inode_store(struct fs_instance *fs, const struct inode *inode, struct disk_inode *disk_inode) {
+	char index[fs->block_size];
 
-	/* Set up file directory */
+	memset(disk_inode, 0, sizeof(struct disk_inode));
+	disk_inode->ref_count = inode->ref_count;
+	disk_inode->file_size = inode->file_size;
+	disk_inode->flags = inode->flags;
+	disk_inode->extent_count = inode->extent_count;
 
-	/* Set each directory file entry index to -1 to indicate unused file */
-	for (int i  = 0; i < MAX_FILES; i++) {
-		directory[i].inode_index = -1;
+	/* Inline files have no extents, their contents take the map's place */
+	if (inode->flags & INODE_INLINE) {
+		memcpy(disk_inode->contents.data, inode->inline_data, inode->file_size);
+		return;
 	}
-	
-	/* Write file directory to disk */
-	memcpy((void *) block, (void *) &directory, sizeof(struct directory_file) * MAX_FILES);
-	block_write(disk_super_block.directory_offset, block);
 
-	/* Set up inode table */
+	int direct = (inode->extent_count < DIRECT_EXTENTS) ? inode->extent_count : DIRECT_EXTENTS;
+	memcpy(disk_inode->contents.map.extents, inode->extents, sizeof(struct extent) * direct);
+	if (inode->index_count > 0) {
+		disk_inode->contents.map.indirect = inode->index_blocks[0];
+	}
+	disk_inode->contents.map.double_indirect = inode->double_indirect;
 
-	/* Set inodes in inode table to unused indication values */
-	for (int i = 0; i < MAX_FILES; i++) {
-		inode_table[i].ref_count = 0;
-		inode_table[i].file_size = 0;
-		for (int j = 0; j < (MAX_FILE_SIZE / BLOCK_SIZE); j++) {
-			inode_table[i].blocks[j] = -1;
+	/* Each index block holds the next INDIRECT_EXTENTS extents */
+	for (int i = 0; i < inode->index_count; i++) {
+		int first = DIRECT_EXTENTS + i * INDIRECT_EXTENTS;
+		int count = inode->extent_count - first;
+		if (count > INDIRECT_EXTENTS) {
+			count = INDIRECT_EXTENTS;
 		}
+		memset(index, 0, fs->block_size);
+		memcpy(index, &inode->extents[first], sizeof(struct extent) * count);
+		cache_write(fs->cache, inode->index_blocks[i], index);
 	}
 
-	/* Write inodes to disk */
-	for (int i = 0; i < MAX_FILES; i++) {
-		memcpy((void *) block, (void *) &inode_table[i], sizeof(struct inode));
-		block_write(disk_super_block.inode_table_offset + i, block);
+	/* Double indirect block lists every index block after the first */
+	if (inode->double_indirect != 0) {
+		memset(index, 0, fs->block_size);
+		memcpy(index, &inode->index_blocks[1], sizeof(int) * (inode->index_count - 1));
+		cache_write(fs->cache, inode->double_indirect, index);
+	}
+}
+
+/* Set up the in-memory inode from its record, reading in its index blocks for the first limit extents */
+static int inode_load(struct fs_instance *fs, struct inode *inode, const struct disk_inode *disk_inode, int limit) {
+	char index[fs->block_size];
+
+	inode_release_extents(inode);
+	inode->ref_count = disk_inode->ref_count;
+	inode->file_size = disk_inode->file_size;
+	inode->flags = disk_inode->flags;
+	if (inode->flags & INODE_INLINE) {
+		inode->inline_data = malloc(INLINE_DATA);
+		if (!inode->inline_data) {
+			fprintf(stderr, "inode_load: failed to allocate\n");
+			return -1;
+		}
+		memcpy(inode->inline_data, disk_inode->contents.data, INLINE_DATA);
+		return 0;
+	}
+	if (disk_inode->extent_count == 0 || limit == 0) {
+		return 0;
 	}
 
-	/* Close the disk */
-	if (close_disk(disk_name) != 0) {
-		fprintf(stderr, "make_fs: cannot close disk\n");
+	int count = (disk_inode->extent_count < limit) ? disk_inode->extent_count : limit;
+	int index_count = index_blocks_needed(fs, count);
+	inode->extents = malloc(sizeof(struct extent) * count);
+	inode->index_blocks = malloc(sizeof(int) * (index_count + 1));
+	if (!inode->extents || !inode->index_blocks) {
+		fprintf(stderr, "inode_load: failed to allocate\n");
+		inode_release_extents(inode);
 		return -1;
 	}
+	inode->extent_count = inode->extent_space = count;
+
+	/* Direct extents, then the index blocks in order */
+	int direct = (count < DIRECT_EXTENTS) ? count : DIRECT_EXTENTS;
+	memcpy(inode->extents, disk_inode->contents.map.extents, sizeof(struct extent) * direct);
+	if (index_count > 0) {
+		inode->index_blocks[0] = disk_inode->contents.map.indirect;
+	}
+	if (index_count > 1) {
+		inode->double_indirect = disk_inode->contents.map.double_indirect;
+		if (cache_read(fs->cache, inode->double_indirect, index) != 0) {
+			inode_release_extents(inode);
+			return -1;
+		}
+		memcpy(&inode->index_blocks[1], index, sizeof(int) * (index_count - 1));
+	}
+	inode->index_count = index_count;
+
+	for (int i = 0; i < index_count; i++) {
+		int first = DIRECT_EXTENTS + i * INDIRECT_EXTENTS;
+		int length = (count - first < INDIRECT_EXTENTS) ? count - first : INDIRECT_EXTENTS;
+		if (cache_read(fs->cache, inode->index_blocks[i], index) != 0) {
+			inode_release_extents(inode);
+			return -1;
+		}
+		memcpy(&inode->extents[first], index, sizeof(struct extent) * length);
+	}
 
 	return 0;
 }
 
-/* Mount the file system onto the disk */
-int mount_fs(const char *disk_name) {
-	/* Open disk */
-	if (open_disk(disk_name) != 0) {
-		fprintf(stderr, "mount_fs: cannot open disk\n");
-		return -1;
-	}
-	
-	if (disk_super_block.is_mounted == true) {
-		fprintf(stderr, "mount_fs: disk already mounted\n");
-		return -1;
+/* Note that an inode is held in memory, with load_lock held */
+static void inode_add_loaded(struct fs_instance *fs, int inode_index) {
+	if (!fs->inode_table[inode_index].loaded) {
+		fs->loaded_inodes[fs->loaded_count++] = inode_index;
+		__atomic_store_n(&fs->inode_table[inode_index].loaded, true, __ATOMIC_RELEASE);
 	}
+}
 
-	/* Load super block into global variable */
-	char *block = calloc(1, BLOCK_SIZE);
-	block_read(0, block);
-	memcpy((void *) &disk_super_block, (void *) block, sizeof(struct super_block));
-
-	/* Load directory into global variable */
-	block_read(disk_super_block.directory_offset, block);
-	memcpy((void *) &directory, (void *) block, sizeof(struct directory_file) * MAX_FILES);
+/* Note that an inode is held in memory */
+static void inode_set_loaded(struct fs_instance *fs, int inode_index) {
+	pthread_mutex_lock(&fs->load_lock);
+	inode_add_loaded(fs, inode_index);
+	pthread_mutex_unlock(&fs->load_lock);
+}
 
-	/* Load inodes into global variable */
-	for (int i = 0; i < MAX_FILES; i++) {
-		block_read(disk_super_block.inode_table_offset + i, block);
-		memcpy((void *) &inode_table[i], (void *) block, sizeof(struct inode));
+/* Get an inode, reading it in from the inode table on first use */
+static struct inode *inode_get(struct fs_instance *fs, int inode_index) {
+	struct inode *inode = &fs->inode_table[inode_index];
+	if (__atomic_load_n(&inode->loaded, __ATOMIC_ACQUIRE)) {
+		return inode;
 	}
 
-	/* Set up file descriptors */
-	for (int i = 0; i < MAX_FILE_DESCRIPTORS; i++) {
-		/* Set file descriptor variables as empty */
-		file_descriptors[i].inode_index = -1;
-		file_descriptors[i].file_pointer = -1;
+	/* Another thread may have read it in meanwhile */
+	pthread_mutex_lock(&fs->load_lock);
+	if (inode->loaded) {
+		pthread_mutex_unlock(&fs->load_lock);
+		return inode;
 	}
 
-	/* Indicate disk is mounted */
-	disk_super_block.is_mounted = true;
+	char block[fs->block_size];
+	const struct disk_inode *disk_inodes = (const struct disk_inode *) block;
+	if (cache_read(fs->cache, fs->disk_super_block.inode_table_offset + inode_index / INODES_PER_BLOCK, block) != 0) {
+		fprintf(stderr, "inode_get: cannot read inode table\n");
+		pthread_mutex_unlock(&fs->load_lock);
+		return NULL;
+	}
+	if (inode_load(fs, inode, &disk_inodes[inode_index % INODES_PER_BLOCK], INT_MAX) != 0) {
+		pthread_mutex_unlock(&fs->load_lock);
+		return NULL;
+	}
+	inode->dirty = false;
+	inode_add_loaded(fs, inode_index);
+	pthread_mutex_unlock(&fs->load_lock);
 
-	/* Free allocated variables */
-	free(block);
+	return inode;
+}
 
-	return 0;
+/* Order inode numbers */
+static int compare_inodes(const void *a, const void *b) {
+	return *(const int *) a - *(const int *) b;
 }
 
-int umount_fs(const char *disk_name) {
-		
-	if (disk_super_block.is_mounted == false) {
-		fprintf(stderr, "unmount_fs: to file system to dismount\n");
-		return -1;
-	}
+/* Write back the inode table blocks holding changed inodes, dropping every loaded inode if release is set */
+static void inode_table_sync(struct fs_instance *fs, bool release) {
+	char block[fs->block_size];
+	struct disk_inode *disk_inodes = (struct disk_inode *) block;
 
-	/* Indicate disk is unmounted */
-	disk_super_block.is_mounted = false;
+	/* Loaded inodes sharing a table block end up next to each other */
+	pthread_mutex_lock(&fs->load_lock);
+	qsort(fs->loaded_inodes, fs->loaded_count, sizeof(int), compare_inodes);
 
-	/* Write super block to first block on disk */
-	char *block = calloc(1, BLOCK_SIZE);
-	memcpy((void *) block, (void *) &disk_super_block, sizeof(struct super_block));
-	block_write(0, block);
+	for (int first = 0; first < fs->loaded_count; ) {
+		int table_index = fs->loaded_inodes[first] / INODES_PER_BLOCK;
+		int last = first;
+		bool dirty = false;
+		while (last < fs->loaded_count && fs->loaded_inodes[last] / INODES_PER_BLOCK == table_index) {
+			dirty |= fs->inode_table[fs->loaded_inodes[last]].dirty;
+			last++;
+		}
+
+		/* Inodes that were never loaded keep their records from disk */
+		int table_block = fs->disk_super_block.inode_table_offset + table_index;
+		if (dirty && cache_read(fs->cache, table_block, block) == 0) {
+			for (int i = first; i < last; i++) {
+				if (fs->inode_table[fs->loaded_inodes[i]].dirty) {
+					inode_store(fs, &fs->inode_table[fs->loaded_inodes[i]], &disk_inodes[fs->loaded_inodes[i] % INODES_PER_BLOCK]);
+				}
+			}
+			cache_write(fs->cache, table_block, block);
+		}
 
-	/* Write file directory to disk */
-	memcpy((void *) block, (void *) &directory, sizeof(struct directory_file) * MAX_FILES);
-	block_write(disk_super_block.directory_offset, block);
+		for (int i = first; i < last; i++) {
+			struct inode *inode = &fs->inode_table[fs->loaded_inodes[i]];
+			if (release) {
+				inode_release_extents(inode);
+				inode->open_count = 0;
+				inode->loaded = false;
+				inode->log_pending = false;
+			}
+			inode->dirty = false;
+		}
+		first = last;
+	}
+	if (release) {
+		fs->loaded_count = 0;
+	}
+	pthread_mutex_unlock(&fs->load_lock);
+}
 
-	/* Write inodes to disk */
-	for (int i = 0; i < MAX_FILES; i++) {
-		memcpy((void *) block, (void *) &inode_table[i], sizeof(struct inode));
-		block_write(disk_super_block.inode_table_offset + i, block);
+/* FNV-1a hash of a file name */
+static unsigned int hash_name(const char *name) {
+	unsigned int hash = 2166136261u;
+	while (*name) {
+		hash = (hash ^ (unsigned char) *name++) * 16777619u;
 	}
+	return hash;
+}
 
-	/* Close the disk */
-	if (close_disk(disk_name) != 0) {
-		fprintf(stderr, "make_fs: cannot close disk\n");
-		return -1;
+/* Move a table kept in memory, the usage bitmap or the share table, between memory and its size blocks
+ * on disk from offset on, only writing changed blocks once mounted */
+static int table_transfer(struct fs_instance *fs, bool write, void *table, int offset, int size, bool *dirty) {
+	for (int i = 0; i < size; i++) {
+		char *part = (char *) table + (size_t) i * fs->block_size;
+		int ret;
+		if (write && dirty && !dirty[i]) {
+			continue;
+		}
+		if (write) {
+			ret = cache_write(fs->cache, offset + i, part);
+		} else {
+			ret = cache_read(fs->cache, offset + i, part);
+		}
+		if (ret != 0) {
+			return -1;
+		}
+		if (dirty) {
+			dirty[i] = false;
+		}
 	}
 
 	return 0;
 }
 
-int fs_open(const char *name) {
-	/* Confirm disk is mounted */
-	if (disk_super_block.is_mounted == false) {
-		fprintf(stderr, "fs_open: disk not mounted\n");
-		return -1;
-	}
-	/* Find file name in directory */
-	int inode_index = -1;
-	for (int i = 0; i < MAX_FILES; i++) {
-		if (strcmp(directory[i].name, name) == 0) {
-			inode_index = directory[i].inode_index;
+/* Move the block usage bitmap between memory and disk */
+static int bitmap_transfer(struct fs_instance *fs, bool write) {
+	return table_transfer(fs, write, fs->usage_bitmap, fs->disk_super_block.bitmap_offset, fs->disk_super_block.bitmap_size, fs->bitmap_dirty);
+}
+
+/* Move the share table between memory and disk */
+static int share_transfer(struct fs_instance *fs, bool write) {
+	return table_transfer(fs, write, fs->share_table, fs->disk_super_block.share_offset, fs->disk_super_block.share_size, fs->share_dirty);
+}
+
+/* Discard every run of freed blocks still waiting for it, dropping cached copies first */
+static void discard_flush(struct fs_instance *fs) {
+	const int words = (fs->disk_super_block.block_count + 63) / 64;
+
+	for (int word = 0; fs->discard_bitmap && word < words && fs->discard_pending > 0; word++) {
+		while (fs->discard_bitmap[word]) {
+			int start = word * 64 + __builtin_ctzll(fs->discard_bitmap[word]);
+			int end = start;
+			while (end < fs->disk_super_block.block_count && (fs->discard_bitmap[end / 64] >> (end % 64)) & 1) {
+				fs->discard_bitmap[end / 64] &= ~(UINT64_C(1) << (end % 64));
+				end++;
+			}
+			fs->discard_pending -= end - start;
+			cache_discard(fs->cache, start, end - start);
 		}
 	}
+}
 
-	/* Check to see that inode was found */
-	if (inode_index == -1) {
-		fprintf(stderr, "fs_open: file could not be found\n");
-		return -1;
+/* Make room for a record with length bytes of payload, NULL if there is no log to keep it in
+ * The caller holds log_lock while it fills the record in. */
+static void *log_reserve(struct fs_instance *fs, int type, int length) {
+	if (fs->log_buffer == NULL || fs->log_replaying) {
+		return NULL;
 	}
 
-	/* Find valid file descriptor */
-	int file_descriptor_index = -1;
-	for (int i = 0; i < MAX_FILE_DESCRIPTORS; i++) {
-		if (file_descriptors[i].inode_index  == -1) {
-			// Found free file descriptor
-			file_descriptors[i].inode_index = inode_index;
-			file_descriptors[i].file_pointer = 0;
-			inode_table[inode_index].ref_count++;
-			file_descriptor_index = i;
-			break;
+	int needed = fs->log_length + (int) sizeof(struct log_record) + length;
+	if (needed > fs->log_space) {
+		int space = fs->log_space * 2;
+		while (space < needed) {
+			space *= 2;
+		}
+		char *buffer = realloc(fs->log_buffer, space);
+		if (!buffer) {
+			fprintf(stderr, "log_reserve: failed to allocate\n");
+			fs->log_overflow = true;
+			return NULL;
 		}
+		fs->log_buffer = buffer;
+		fs->log_space = space;
 	}
 
-	/* Check to see file descriptor was found */
-	if (file_descriptor_index == -1) {
-		fprintf(stderr, "fs_open: no free file descriptors\n");
-		return -1;
-	}
+	struct log_record *record = (struct log_record *) (fs->log_buffer + fs->log_length);
+	record->type = type;
+	record->length = length;
+	fs->log_length = needed;
 
-	return file_descriptor_index;
+	return record + 1;
 }
 
-/* Close the file system*/
-int fs_close(int fildes) {
-	/* Check fildes bounds and existance */
-	if ((fildes < 0) || (fildes > (MAX_FILE_DESCRIPTORS - 1)) || file_descriptors[fildes].inode_index == -1) {
-		fprintf(stderr, "fs_close: file not found\n");
-		return -1;
+/* Log a run of blocks turning used or free */
+static void log_blocks(struct fs_instance *fs, int start, int length, bool used) {
+	struct log_blocks *record;
+	pthread_mutex_lock(&fs->log_lock);
+	if (length > 0 && (record = log_reserve(fs, LOG_BLOCKS, sizeof(struct log_blocks))) != NULL) {
+		record->start = start;
+		record->length = length;
+		record->used = used;
 	}
-	
-	if (disk_super_block.is_mounted == false) {
-		fprintf(stderr, "fs_close: disk not mounted\n");
-		return -1;
+	pthread_mutex_unlock(&fs->log_lock);
+}
+
+/* Log the new contents of one directory entry */
+static void log_entry(struct fs_instance *fs, int disk_block, int entry, const struct directory_file *file) {
+	pthread_mutex_lock(&fs->log_lock);
+	struct log_entry *record = log_reserve(fs, LOG_ENTRY, sizeof(struct log_entry));
+	if (record != NULL) {
+		record->disk_block = disk_block;
+		record->entry = entry;
+		record->file = *file;
 	}
+	pthread_mutex_unlock(&fs->log_lock);
+}
 
-	/* Decrement the file reference counter */
-	inode_table[file_descriptors[fildes].inode_index].ref_count--;
+/* Set the share count of a block and log it, with alloc_lock held */
+static void set_shares(struct fs_instance *fs, int block, int shares) {
+	fs->share_table[block] = shares;
+	if (fs->share_dirty) {
+		fs->share_dirty[(size_t) block * sizeof(uint16_t) / fs->block_size] = true;
+	}
 
-	/* Set file descriptor as free */
-	file_descriptors[fildes].inode_index = -1;
-	file_descriptors[fildes].file_pointer = -1;
+	pthread_mutex_lock(&fs->log_lock);
+	struct log_shares *record = log_reserve(fs, LOG_SHARES, sizeof(struct log_shares));
+	if (record != NULL) {
+		record->block = block;
+		record->shares = shares;
+	}
+	pthread_mutex_unlock(&fs->log_lock);
+}
 
-	return 0;
+/* Log a directory bucket rewritten with count entries at its start */
+static void log_bucket(struct fs_instance *fs, int disk_block, const char *block, int count) {
+	pthread_mutex_lock(&fs->log_lock);
+	struct log_bucket *record = log_reserve(fs, LOG_BUCKET, sizeof(struct log_bucket) + sizeof(struct directory_file) * count);
+	if (record != NULL) {
+		record->disk_block = disk_block;
+		record->count = count;
+		memcpy(record + 1, block, sizeof(struct directory_file) * count);
+	}
+	pthread_mutex_unlock(&fs->log_lock);
+}
+
+/* Note that an inode changed, its extents from first_extent on included, with the inode held exclusively */
+static void inode_changed(struct fs_instance *fs, struct inode *inode, int first_extent) {
+	inode->dirty = true;
+	if (fs->log_replaying) {
+		return;
+	}
 
+	if (!inode->log_pending) {
+		inode->log_pending = true;
+		inode->log_extent = first_extent;
+		pthread_mutex_lock(&fs->log_lock);
+		fs->log_inodes[fs->log_inode_count++] = inode - fs->inode_table;
+		pthread_mutex_unlock(&fs->log_lock);
+	} else if (first_extent < inode->log_extent) {
+		inode->log_extent = first_extent;
+	}
 }
 
-/* Create a new file */
-int fs_create(const char *name) {
-	/* Check file name length */
-	if (strlen(name) > MAX_FILE_NAME) {
-		fprintf(stderr, "fs_create: file name too long\n");
-		return -1;
+/* Log every inode changed since the last commit as it is now, with fs_lock held exclusively */
+static void log_inode_records(struct fs_instance *fs) {
+	pthread_mutex_lock(&fs->log_lock);
+	for (int i = 0; i < fs->log_inode_count; i++) {
+		struct inode *inode = &fs->inode_table[fs->log_inodes[i]];
+		int first = (inode->log_extent < inode->extent_count) ? inode->log_extent : inode->extent_count;
+		int extents = inode->extent_count - first;
+		int contents = (inode->flags & INODE_INLINE) ? (inode->file_size + sizeof(int) - 1) / sizeof(int) * sizeof(int) : 0;
+		struct log_inode *record = log_reserve(fs, LOG_INODE, sizeof(struct log_inode) + sizeof(int) * inode->index_count + sizeof(struct extent) * extents + contents);
+		if (record != NULL) {
+			record->inode_index = fs->log_inodes[i];
+			record->ref_count = inode->ref_count;
+			record->file_size = inode->file_size;
+			record->flags = inode->flags;
+			record->extent_count = inode->extent_count;
+			record->first_extent = first;
+			record->index_count = inode->index_count;
+			record->double_indirect = inode->double_indirect;
+			int *index_blocks = (int *) (record + 1);
+			memcpy(index_blocks, inode->index_blocks, sizeof(int) * inode->index_count);
+			memcpy(index_blocks + inode->index_count, inode->extents + first, sizeof(struct extent) * extents);
+			if (contents > 0) {
+				memset(index_blocks, 0, contents);
+				memcpy(index_blocks, inode->inline_data, inode->file_size);
+			}
+		}
+		inode->log_pending = false;
 	}
+	fs->log_inode_count = 0;
+	pthread_mutex_unlock(&fs->log_lock);
+}
 
-	/* Check that disk is mounted */
-	if (disk_super_block.is_mounted == false) {
-		fprintf(stderr, "fs_create: disk not mounted\n");
-		return -1;
+/* Mark a range of blocks used or free in the usage bitmap, a word at a time, with alloc_lock held */
+static void mark_blocks(struct fs_instance *fs, int start, int length, bool used) {
+	log_blocks(fs, start, length, used);
+
+	while (length > 0) {
+		int bit = start % 64;
+		int bits = (64 - bit < length) ? 64 - bit : length;
+		uint64_t mask = (bits == 64) ? ~UINT64_C(0) : ((UINT64_C(1) << bits) - 1) << bit;
+
+		if (used) {
+			fs->usage_bitmap[start / 64] |= mask;
+		} else {
+			fs->usage_bitmap[start / 64] &= ~mask;
+		}
+		if (fs->bitmap_dirty) {
+			fs->bitmap_dirty[(size_t) (start / 64) * sizeof(uint64_t) / fs->block_size] = true;
+		}
+
+		/* Blocks in use again must not be discarded, free ones wait for it */
+		if (fs->discard_bitmap && used) {
+			fs->discard_pending -= __builtin_popcountll(fs->discard_bitmap[start / 64] & mask);
+			fs->discard_bitmap[start / 64] &= ~mask;
+		} else if (fs->discard_bitmap) {
+			fs->discard_pending += __builtin_popcountll(~fs->discard_bitmap[start / 64] & mask);
+			fs->discard_bitmap[start / 64] |= mask;
+		}
+		start += bits;
+		length -= bits;
 	}
 
-	/* Check if file name already exists */
-	for (int i = 0; i < MAX_FILES; i++) {
-		if (strcmp(directory[i].name, name) == 0) {
-			fprintf(stderr, "fs_create: file name already exists\n");
+	/* Free block count and cursor live in the super block */
+	fs->super_dirty = true;
+}
+
+/* Write the super block into the cache */
+static int super_write(struct fs_instance *fs) {
+	char block[fs->block_size];
+	memset(block, 0, fs->block_size);
+	memcpy(block, &fs->disk_super_block, sizeof(struct super_block));
+	return cache_write(fs->cache, 0, block);
+}
+
+/* Write the super block, usage bitmap and share table blocks and inodes changed since they were last written into the cache */
+static int metadata_write(struct fs_instance *fs, bool release) {
+	if (fs->super_dirty) {
+		if (super_write(fs) != 0) {
 			return -1;
 		}
+		fs->super_dirty = false;
 	}
 
-	/* Check that file system is created */
-	if (disk_super_block.is_mounted == false) {
-		fprintf(stderr, "fs_create: disk not mounted\n");
+	inode_table_sync(fs, release);
+
+	if (bitmap_transfer(fs, true) != 0) {
 		return -1;
 	}
+	return share_transfer(fs, true);
+}
+
+/* FNV-1a hash of a transaction past its checksum, the header fields after it and the records */
+static uint32_t log_checksum(const char *transaction) {
+	const struct log_header *header = (const struct log_header *) transaction;
+	int length = (int) (sizeof(struct log_header) - LOG_CHECKED) + header->length;
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < length; i++) {
+		hash = (hash ^ (unsigned char) transaction[LOG_CHECKED + i]) * 16777619u;
+	}
+	return hash;
+}
 
-	/* Find open file position */
-	int directory_index = -1;
-	for (int i = 0; i < MAX_FILES; i++) {
-		if (directory[i].inode_index == -1) {
-			directory_index = i;
-			break;
-		}
+/* Write the records gathered since the last commit to the log as one transaction, not synced yet
+ * Fails when they do not fit in the rest of the log, leaving them for a checkpoint. */
+static int log_write(struct fs_instance *fs) {
+	log_inode_records(fs);
+	if (fs->log_length == sizeof(struct log_header)) {
+		return 0;
 	}
 
-	/* Check that open directory file exists */
-	if (directory_index == -1) {
-		fprintf(stderr, "fs_create: too many files in directory\n");
+	int blocks = (fs->log_length + fs->block_size - 1) / fs->block_size;
+	if (fs->log_overflow || blocks > fs->disk_super_block.log_size - fs->log_position) {
 		return -1;
 	}
 
-	/* Find open inode table entry */
-	int inode_index = -1;
-	for (int i = 0; i < MAX_FILES; i ++) {
-		if (inode_table[i].ref_count == 0) {
-			inode_index = i;
+	/* Pad the transaction out to whole blocks */
+	if (blocks * fs->block_size > fs->log_space) {
+		char *buffer = realloc(fs->log_buffer, blocks * fs->block_size);
+		if (!buffer) {
+			fprintf(stderr, "log_write: failed to allocate\n");
+			return -1;
 		}
+		fs->log_buffer = buffer;
+		fs->log_space = blocks * fs->block_size;
 	}
+	memset(fs->log_buffer + fs->log_length, 0, blocks * fs->block_size - fs->log_length);
 
-	/* Check that open inode exists */
-	if (inode_index == -1) {
-		fprintf(stderr, "fs_create: no free inodes\n");
-		return -1;
+	struct log_header *header = (struct log_header *) fs->log_buffer;
+	header->magic = LOG_MAGIC;
+	header->sequence = fs->log_sequence;
+	header->length = fs->log_length - sizeof(struct log_header);
+	header->free_blocks = fs->disk_super_block.free_blocks;
+	header->next_free = fs->disk_super_block.next_free;
+	header->checksum = log_checksum(fs->log_buffer);
+
+	/* The log is not cached, its blocks go straight to disk */
+	int disk_blocks[VECTOR_BLOCKS];
+	const void *bufs[VECTOR_BLOCKS];
+	for (int base = 0; base < blocks; base += VECTOR_BLOCKS) {
+		int batch = (blocks - base < VECTOR_BLOCKS) ? blocks - base : VECTOR_BLOCKS;
+		for (int i = 0; i < batch; i++) {
+			disk_blocks[i] = fs->disk_super_block.log_offset + fs->log_position + base + i;
+			bufs[i] = fs->log_buffer + (size_t) (base + i) * fs->block_size;
+		}
+		if (disk_writev(fs->disk, batch, disk_blocks, bufs) != 0) {
+			fprintf(stderr, "log_write: cannot write log\n");
+			return -1;
+		}
 	}
 
-	/* Create file */
-	strcpy(directory[directory_index].name, name);
-	directory[directory_index].inode_index = inode_index;
-	inode_table[inode_index].ref_count++;
-	
+	fs->log_position += blocks;
+	fs->log_sequence++;
+	pthread_mutex_lock(&fs->log_lock);
+	fs->log_length = sizeof(struct log_header);
+	pthread_mutex_unlock(&fs->log_lock);
+
 	return 0;
 }
 
-/* Delete a file */
-int fs_delete(const char *name) {
-	/* Check that disk is mounted */
-	if (disk_super_block.is_mounted == false) {
-		fprintf(stderr, "fs_delete: disk not mounted\n");
+/* Write all metadata in place and start the log over
+ * What changed is logged first, so a crash part way through is replayed from the log.
+ * Changes too large for the rest of the log are written in place without that cover. */
+static int checkpoint(struct fs_instance *fs, bool release) {
+	bool logged = (log_write(fs) == 0);
+	if (cache_flush(fs->cache) != 0 || disk_sync(fs->disk) != 0) {
 		return -1;
 	}
+	cache_release_ordered(fs->cache);
 
-	/* Find directory and inode index */
-	int inode_index = -1;
-	int directory_index = -1;
-	for (int i = 0; i < MAX_FILES; i++) {
-		if (strcmp(directory[i].name, name) == 0) {
-			inode_index = directory[i].inode_index;
-			directory_index = i;
+	/* Transactions already in the log must not be replayed over metadata newer than they are,
+	 * so the super block skips them, and any part of this one written, before it goes in place */
+	if (!logged) {
+		fs->log_sequence++;
+		fs->disk_super_block.log_sequence = fs->log_sequence;
+		if (super_write(fs) != 0 || cache_flush(fs->cache) != 0 || disk_sync(fs->disk) != 0) {
+			return -1;
 		}
 	}
 
-	/* Check that directory entry exists */
-	if (directory_index == -1) {
-		fprintf(stderr, "fs_delete: file not found\n");
+	if (metadata_write(fs, release) != 0 || cache_flush(fs->cache) != 0 || disk_sync(fs->disk) != 0) {
 		return -1;
 	}
 
-	/* Check that inode exists */
-	if (inode_index == -1) {
-		fprintf(stderr, "fs_delete: file not found\n");
+	/* Only once everything is in place may the super block skip the log */
+	fs->disk_super_block.log_sequence = fs->log_sequence;
+	if (super_write(fs) != 0 || cache_flush(fs->cache) != 0 || disk_sync(fs->disk) != 0) {
 		return -1;
 	}
+	fs->log_position = 0;
+	pthread_mutex_lock(&fs->log_lock);
+	fs->log_length = sizeof(struct log_header);
+	fs->log_inode_count = 0;
+	fs->log_overflow = false;
+	pthread_mutex_unlock(&fs->log_lock);
 
-	/* Check that there are no file descriptors pointing to file */
-	if (inode_table[inode_index].ref_count > 1) {
-		fprintf(stderr, "fs_delete: file is open\n");
+	/* Blocks freed before the checkpoint are no longer referenced on disk */
+	discard_flush(fs);
+
+	return 0;
+}
+
+/* Commit the records gathered so far together with the file data written so far, with fs_lock held exclusively */
+static int log_commit(struct fs_instance *fs) {
+	if (log_write(fs) != 0) {
+		return checkpoint(fs, false);
+	}
+	if (cache_flush(fs->cache) != 0 || disk_sync(fs->disk) != 0) {
 		return -1;
 	}
 
-	/* Free data blocks */
-	char *block = calloc(1, BLOCK_SIZE);
-	for (int i = 0; i < (MAX_FILE_SIZE / BLOCK_SIZE); i++) {
-		if (inode_table[inode_index].blocks[i] != -1) {
-			/* Clear block data */
-			block_write(inode_table[inode_index].blocks[i], block);
-			/* Set usage bitmap at block location to unused */
-			int block_location = inode_table[inode_index].blocks[i];
-			disk_super_block.usage_bitmap[block_location / 8] &= ~(1 << (block_location % 8));
-			/* Set inode block as unused */
-			inode_table[inode_index].blocks[i] = -1;
-		}
-	}
+	/* The records are durable, so the metadata they describe may follow */
+	cache_release_ordered(fs->cache);
 
-	/* Clear directory entry */
-	directory[directory_index].inode_index = -1;
-	strcpy(directory[directory_index].name, "");
+	/* Blocks freed before the commit are no longer referenced on disk */
+	discard_flush(fs);
 
-	/* Clear inode entry */
-	inode_table[inode_index].ref_count = 0;
-	inode_table[inode_index].file_size = 0;
+	if (fs->log_position > fs->disk_super_block.log_size / 2) {
+		return checkpoint(fs, false);
+	}
 
 	return 0;
 }
 
-/* Read from a file */
-int fs_read(int fildes, void *buf, size_t nbyte) {
-	/* Check that disk is mounted */
-	if (disk_super_block.is_mounted == false) {
-		fprintf(stderr, "fs_read: disk not mounted\n");
+/* Bytes the records gathered so far take up, counting inodes as their smallest record */
+static long log_pending(struct fs_instance *fs) {
+	pthread_mutex_lock(&fs->log_lock);
+	long pending = fs->log_length + fs->log_inode_count * (long) sizeof(struct log_inode);
+	pthread_mutex_unlock(&fs->log_lock);
+	return pending;
+}
+
+/* Commit once enough records have built up, between operations, with fs_lock not held */
+static void log_batch(struct fs_instance *fs) {
+	long batch = (long) fs->disk_super_block.log_size * fs->block_size / 4;
+	if (batch > LOG_BATCH) {
+		batch = LOG_BATCH;
+	}
+
+	/* Several threads may see the log full, the first one commits it */
+	if (log_pending(fs) >= batch) {
+		pthread_rwlock_wrlock(&fs->fs_lock);
+		if (log_pending(fs) >= batch) {
+			log_commit(fs);
+		}
+		pthread_rwlock_unlock(&fs->fs_lock);
+	}
+}
+
+/* Apply a logged inode of length bytes on top of what the inode table holds */
+static int log_apply_inode(struct fs_instance *fs, const struct log_inode *record, int length) {
+	if (length < (int) sizeof(struct log_inode) || record->inode_index < 0 || record->inode_index >= MAX_FILES) {
 		return -1;
 	}
 
-	/* Check fildes bounds and existance */
-	if ((fildes < 0) || (fildes > (MAX_FILE_DESCRIPTORS - 1)) || file_descriptors[fildes].inode_index == -1) {
-		fprintf(stderr, "fs_read: file not found\n");
+	/* The index blocks, extents and inline contents it lists must all be there */
+	if (record->extent_count < 0 || record->extent_count > MAX_EXTENTS ||
+	    record->first_extent < 0 || record->first_extent > record->extent_count ||
+	    record->index_count < 0 || record->index_count > DOUBLE_INDIRECT_BLOCKS + 1 || record->file_size < 0) {
 		return -1;
 	}
+	long needed = sizeof(struct log_inode) + sizeof(int) * (long) record->index_count +
+		      sizeof(struct extent) * (long) (record->extent_count - record->first_extent);
+	if (record->flags & INODE_INLINE) {
+		needed += record->file_size;
+	}
+	if (needed > length) {
+		return -1;
+	}
+	struct inode *inode = &fs->inode_table[record->inode_index];
 
-	/* Check reading boundaries */
-	int inode_index = file_descriptors[fildes].inode_index;
-	if (file_descriptors[fildes].file_pointer + nbyte > inode_table[inode_index].file_size) {
-		nbyte = inode_table[inode_index].file_size - file_descriptors[fildes].file_pointer;
+	/* Only the extents before the first logged one are as the inode table has them */
+	if (!inode->loaded) {
+		char block[fs->block_size];
+		const struct disk_inode *disk_inodes = (const struct disk_inode *) block;
+		if (cache_read(fs->cache, fs->disk_super_block.inode_table_offset + record->inode_index / INODES_PER_BLOCK, block) != 0 ||
+		    inode_load(fs, inode, &disk_inodes[record->inode_index % INODES_PER_BLOCK], record->first_extent) != 0) {
+			return -1;
+		}
+		inode_set_loaded(fs, record->inode_index);
+	}
+
+	/* The record has the index blocks and the remaining extents */
+	if (record->extent_count > inode->extent_space) {
+		struct extent *extents = realloc(inode->extents, sizeof(struct extent) * record->extent_count);
+		if (!extents) {
+			return -1;
+		}
+		inode->extents = extents;
+		inode->extent_space = record->extent_count;
+	}
+	int *index_blocks = realloc(inode->index_blocks, sizeof(int) * (record->index_count + 1));
+	if (!index_blocks) {
+		return -1;
+	}
+	inode->index_blocks = index_blocks;
+
+	const int *logged = (const int *) (record + 1);
+	memcpy(inode->index_blocks, logged, sizeof(int) * record->index_count);
+	memcpy(inode->extents + record->first_extent, logged + record->index_count,
+	       sizeof(struct extent) * (record->extent_count - record->first_extent));
+	inode->ref_count = record->ref_count;
+	inode->file_size = record->file_size;
+	inode->flags = record->flags;
+	inode->extent_count = record->extent_count;
+	inode->index_count = record->index_count;
+	inode->double_indirect = record->double_indirect;
+
+	/* Inline contents follow in place of the extents */
+	if ((record->flags & INODE_INLINE) && record->file_size > INLINE_DATA) {
+		return -1;
 	}
+	if ((record->flags & INODE_INLINE) && !inode->inline_data) {
+		inode->inline_data = malloc(INLINE_DATA);
+		if (!inode->inline_data) {
+			return -1;
+		}
+	} else if (!(record->flags & INODE_INLINE)) {
+		free(inode->inline_data);
+		inode->inline_data = NULL;
+	}
+	if (inode->inline_data) {
+		memset(inode->inline_data, 0, INLINE_DATA);
+		memcpy(inode->inline_data, logged, record->file_size);
+	}
+	inode_changed(fs, inode, 0);
+
+	/* The inode bitmap follows whether the inode is in use */
+	uint64_t bit = UINT64_C(1) << (record->inode_index % 64);
+	if (inode->ref_count > 0) {
+		fs->disk_super_block.inode_bitmap[record->inode_index / 64] |= bit;
+	} else {
+		fs->disk_super_block.inode_bitmap[record->inode_index / 64] &= ~bit;
+	}
+	fs->super_dirty = true;
+
+	return 0;
+}
 
-	/* Get initial file offset for reading */
-	int file_offset = file_descriptors[fildes].file_pointer % BLOCK_SIZE;
-	int file_block = file_descriptors[fildes].file_pointer / BLOCK_SIZE;
+/* Apply the records of one transaction */
+static int log_apply(struct fs_instance *fs, const char *records, int length) {
+	char block[fs->block_size];
 
-	char *block = calloc(1, BLOCK_SIZE);
-	block_read(inode_table[inode_index].blocks[file_block], block);
+	for (int offset = 0; offset < length; ) {
+		/* Records must lie wholly inside the transaction */
+		const struct log_record *record = (const struct log_record *) (records + offset);
+		if (length - offset < (int) sizeof(struct log_record) || record->length < 0 ||
+		    record->length > length - offset - (int) sizeof(struct log_record)) {
+			return -1;
+		}
+		const void *payload = record + 1;
+		offset += sizeof(struct log_record) + record->length;
 
-	/* Allocate buffer to hold data in */
-	char * buffer = malloc(nbyte);
-	/* Loop through file byte by byte, copying into buf */
-	int j = 0;
-	for (int i = 0; i < nbyte; i++) {
-		buffer[i] = block[file_offset + j];
-		j++;
-		if (file_offset + j >= BLOCK_SIZE) {
-			/* Set block indexes back to zero */
-			file_offset = 0;
-			j = 0;
-			/* Get next block */
-			file_block++;
-			block_read(inode_table[inode_index].blocks[file_block], block);
+		if (record->type == LOG_BLOCKS) {
+			const struct log_blocks *blocks = payload;
+			if (record->length < (int) sizeof(struct log_blocks) || blocks->start < 0 || blocks->length < 0 ||
+			    blocks->length > fs->disk_super_block.block_count - blocks->start) {
+				return -1;
+			}
+			mark_blocks(fs, blocks->start, blocks->length, blocks->used);
+		} else if (record->type == LOG_INODE) {
+			if (log_apply_inode(fs, payload, record->length) != 0) {
+				return -1;
+			}
+		} else if (record->type == LOG_ENTRY) {
+			/* Directory buckets are data blocks of the directory */
+			const struct log_entry *entry = payload;
+			if (record->length < (int) sizeof(struct log_entry) || entry->entry < 0 || entry->entry >= DIRECTORY_ENTRIES ||
+			    entry->disk_block < fs->disk_super_block.data_offset || entry->disk_block >= fs->disk_super_block.block_count) {
+				return -1;
+			}
+			if (cache_read(fs->cache, entry->disk_block, block) != 0) {
+				return -1;
+			}
+			((struct directory_file *) block)[entry->entry] = entry->file;
+			if (cache_write(fs->cache, entry->disk_block, block) != 0) {
+				return -1;
+			}
+		} else if (record->type == LOG_BUCKET) {
+			const struct log_bucket *bucket = payload;
+			if (record->length < (int) sizeof(struct log_bucket) || bucket->count < 0 || bucket->count > DIRECTORY_ENTRIES ||
+			    record->length < (int) (sizeof(struct log_bucket) + sizeof(struct directory_file) * bucket->count) ||
+			    bucket->disk_block < fs->disk_super_block.data_offset || bucket->disk_block >= fs->disk_super_block.block_count) {
+				return -1;
+			}
+			memset(block, 0, fs->block_size);
+			memcpy(block, bucket + 1, sizeof(struct directory_file) * bucket->count);
+			if (cache_write(fs->cache, bucket->disk_block, block) != 0) {
+				return -1;
+			}
+		} else if (record->type == LOG_SHARES) {
+			const struct log_shares *shares = payload;
+			if (record->length < (int) sizeof(struct log_shares) || shares->block < 0 || shares->block >= fs->disk_super_block.block_count ||
+			    (long) shares->block * (long) sizeof(uint16_t) >= (long) fs->disk_super_block.share_size * fs->block_size ||
+			    shares->shares < 0 || shares->shares > MAX_SHARES) {
+				return -1;
+			}
+			set_shares(fs, shares->block, shares->shares);
+		} else {
+			return -1;
 		}
 	}
 
-	/* Copy buffer into buf */
-	memcpy(buf, (void *) (buffer), nbyte);
+	return 0;
+}
 
-	/* Adjust file pointer */
-	file_descriptors[fildes].file_pointer += nbyte;
+/* Replay the transactions committed since the last checkpoint, then checkpoint if there were any */
+static int log_replay(struct fs_instance *fs) {
+	char *buffer = malloc(fs->block_size);
+	int replayed = 0;
 
-	/* Free allocated variables */
-	free(block);
+	fs->log_position = 0;
+	fs->log_sequence = fs->disk_super_block.log_sequence;
+	while (buffer && fs->log_position < fs->disk_super_block.log_size) {
+		/* The log ends at the first block that is not the next transaction */
+		const struct log_header *header = (const struct log_header *) buffer;
+		if (disk_read(fs->disk, fs->disk_super_block.log_offset + fs->log_position, buffer) != 0) {
+			break;
+		}
+		if (header->magic != LOG_MAGIC || header->sequence != fs->log_sequence || header->length < 0 ||
+		    header->length > (fs->disk_super_block.log_size - fs->log_position) * fs->block_size) {
+			break;
+		}
+
+		/* Read in the rest, a torn write leaves the checksum wrong */
+		int blocks = (sizeof(struct log_header) + header->length + fs->block_size - 1) / fs->block_size;
+		char *transaction = realloc(buffer, (size_t) blocks * fs->block_size);
+		if (!transaction) {
+			break;
+		}
+		buffer = transaction;
+		header = (const struct log_header *) buffer;
+		for (int i = 1; i < blocks; i++) {
+			if (disk_read(fs->disk, fs->disk_super_block.log_offset + fs->log_position + i, buffer + (size_t) i * fs->block_size) != 0) {
+				break;
+			}
+		}
+		if (log_checksum(buffer) != header->checksum) {
+			break;
+		}
+
+		/* The allocator state must be one the disk can be in */
+		int ret = -1;
+		if (header->free_blocks >= 0 && header->free_blocks <= fs->disk_super_block.block_count - fs->disk_super_block.data_offset &&
+		    header->next_free >= fs->disk_super_block.data_offset && header->next_free < fs->disk_super_block.block_count) {
+			fs->log_replaying = true;
+			ret = log_apply(fs, buffer + sizeof(struct log_header), header->length);
+			fs->log_replaying = false;
+		}
+		if (ret != 0) {
+			fprintf(stderr, "log_replay: bad log record\n");
+			free(buffer);
+			return -1;
+		}
+		fs->disk_super_block.free_blocks = header->free_blocks;
+		fs->disk_super_block.next_free = header->next_free;
+
+		fs->log_position += blocks;
+		fs->log_sequence++;
+		replayed++;
+	}
 	free(buffer);
 
-	return nbyte;
+	return (replayed > 0) ? checkpoint(fs, false) : 0;
 }
 
-/* Write to a file */
-int fs_write(int fildes, void *buf, size_t nbyte) {
-	/* Check that disk is mounted */
-	if (disk_super_block.is_mounted == false) {
-		fprintf(stderr, "fs_write: disk not mounted\n");
+/* Make the file system */
+int make_fs(const char *disk_name) {
+	return make_fs_geometry(disk_name, DISK_BLOCKS, BLOCK_SIZE);
+}
+
+/* Set up an empty instance with its locks ready, nothing is opened yet */
+static struct fs_instance *instance_new(void) {
+	struct fs_instance *fs = calloc(1, sizeof(struct fs_instance));
+	if (!fs) {
+		fprintf(stderr, "mount_fs: failed to allocate\n");
+		return NULL;
+	}
+
+	pthread_rwlock_init(&fs->fs_lock, NULL);
+	pthread_rwlock_init(&fs->dir_lock, NULL);
+	pthread_mutex_init(&fs->alloc_lock, NULL);
+	pthread_mutex_init(&fs->log_lock, NULL);
+	pthread_mutex_init(&fs->load_lock, NULL);
+	pthread_mutex_init(&fs->fd_lock, NULL);
+	pthread_mutex_init(&fs->sync_lock, NULL);
+	pthread_cond_init(&fs->sync_done, NULL);
+	pthread_mutex_init(&fs->stats_lock, NULL);
+	for (int i = 0; i < MAX_FILE_DESCRIPTORS; i++) {
+		pthread_mutex_init(&fs->file_descriptors[i].lock, NULL);
+	}
+	for (int i = 0; i < MAX_FILES; i++) {
+		pthread_rwlock_init(&fs->inode_table[i].lock, NULL);
+		pthread_mutex_init(&fs->inode_table[i].chunk_lock, NULL);
+		fs->inode_table[i].chunk_index = -1;
+	}
+	fs->stats_id = __atomic_add_fetch(&next_stats_id, 1, __ATOMIC_RELAXED);
+
+	return fs;
+}
+
+/* Tear down the locks of an instance and free it, what it had open is closed by the caller */
+static void instance_free(struct fs_instance *fs) {
+	while (fs->stats_shards) {
+		struct stats_shard *shard = fs->stats_shards;
+		fs->stats_shards = shard->next;
+		free(shard);
+	}
+	for (int i = 0; i < MAX_FILES; i++) {
+		pthread_rwlock_destroy(&fs->inode_table[i].lock);
+		pthread_mutex_destroy(&fs->inode_table[i].chunk_lock);
+	}
+	for (int i = 0; i < MAX_FILE_DESCRIPTORS; i++) {
+		pthread_mutex_destroy(&fs->file_descriptors[i].lock);
+	}
+	pthread_mutex_destroy(&fs->stats_lock);
+	pthread_cond_destroy(&fs->sync_done);
+	pthread_mutex_destroy(&fs->sync_lock);
+	pthread_mutex_destroy(&fs->fd_lock);
+	pthread_mutex_destroy(&fs->load_lock);
+	pthread_mutex_destroy(&fs->log_lock);
+	pthread_mutex_destroy(&fs->alloc_lock);
+	pthread_rwlock_destroy(&fs->dir_lock);
+	pthread_rwlock_destroy(&fs->fs_lock);
+	free(fs);
+}
+
+/* Make the file system on a new disk of count blocks of size bytes */
+int make_fs_geometry(const char *disk_name, int count, int size) {
+	/* Make the disk */
+	if (make_disk_geometry(disk_name, count, size) != 0) {
+		fprintf(stderr, "make_fs: cannot make disk\n");
 		return -1;
 	}
 
-	/* Check file descriptors bounds and existence */
-	if ((fildes < 0) || (fildes > (MAX_FILE_DESCRIPTORS - 1)) || file_descriptors[fildes].inode_index == -1) {
-		fprintf(stderr, "fs_write: file not found\n");
+	/* Lay the file system out through an instance of its own, it is never mounted */
+	struct fs_instance *fs = instance_new();
+	if (!fs) {
+		return -1;
+	}
+
+	/* Open the disk */
+	if ((fs->disk = disk_open(disk_name)) == NULL) {
+		fprintf(stderr, "make_fs: cannot open disk\n");
+		instance_free(fs);
+		return -1;
+	}
+	if (disk_set_block_size(fs->disk, size) != 0) {
+		disk_close(fs->disk);
+		instance_free(fs);
 		return -1;
 	}
+	fs->block_size = size;
 
-	int inode_index = file_descriptors[fildes].inode_index;
+	/* Set up super block */
+	fs->disk_super_block.magic = FS_MAGIC;
+	fs->disk_super_block.block_size = size;
+	fs->disk_super_block.block_count = count;
+	fs->disk_super_block.is_mounted = false;
+	/* Super block is stored at disk block 0, usage bitmap starts at disk block 1 */
+	fs->disk_super_block.bitmap_offset = 1;
+	fs->disk_super_block.bitmap_size = ((count + 63) / 64 * sizeof(uint64_t) + size - 1) / size;
+	/* Share table follows, a 16-bit count per block */
+	fs->disk_super_block.share_offset = fs->disk_super_block.bitmap_offset + fs->disk_super_block.bitmap_size;
+	fs->disk_super_block.share_size = (count * (int) sizeof(uint16_t) + size - 1) / size;
+	/* Inode table starts after the share table */
+	fs->disk_super_block.inode_table_offset = fs->disk_super_block.share_offset + fs->disk_super_block.share_size;
+	/* Inodes are packed several to a block */
+	fs->disk_super_block.inode_table_size = (MAX_FILES + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+	/* Metadata log follows the inode table, a small fraction of the disk */
+	fs->disk_super_block.log_offset = fs->disk_super_block.inode_table_offset + fs->disk_super_block.inode_table_size;
+	fs->disk_super_block.log_size = (count / LOG_FRACTION > LOG_MIN_BLOCKS) ? count / LOG_FRACTION : LOG_MIN_BLOCKS;
+	fs->disk_super_block.log_sequence = 1;
+	/* Data blocks follow the log */
+	fs->disk_super_block.data_offset = fs->disk_super_block.log_offset + fs->disk_super_block.log_size;
+	/* Data size is disk size minus blocks need for metadata */
+	fs->disk_super_block.data_size = count - fs->disk_super_block.data_offset;
 
-	/* Check for write overflow and correct */
-	if (file_descriptors[fildes].file_pointer + nbyte > MAX_FILE_SIZE) {
-		nbyte = MAX_FILE_SIZE - file_descriptors[fildes].file_pointer;
-		if (nbyte <= 0) {
-			fprintf(stderr, "fs_write: file size exceeded\n");
-			return -1;
-		}
+	if (fs->disk_super_block.data_size <= 0) {
+		fprintf(stderr, "make_fs: disk too small\n");
+		disk_close(fs->disk);
+		instance_free(fs);
+		return -1;
+	}
+
+	/* Set usage bitmask to zero */
+	fs->usage_bitmap = calloc(fs->disk_super_block.bitmap_size, size);
+	char *block = calloc(1, fs->block_size);
+	if (!fs->usage_bitmap || !block) {
+		fprintf(stderr, "make_fs: failed to allocate\n");
+		free(fs->usage_bitmap);
+		free(block);
+		disk_close(fs->disk);
+		instance_free(fs);
+		return -1;
+	}
+
+	/* Set bits that are used for metadata to 1, and those past the end of the disk */
+	for (int i = 0; i < fs->disk_super_block.data_offset; i++) {
+		fs->usage_bitmap[i / 64] |= (UINT64_C(1) << (i % 64));
+	}
+	for (int i = count; i % 64 != 0; i++) {
+		fs->usage_bitmap[i / 64] |= (UINT64_C(1) << (i % 64));
 	}
 
-	/* Get initial file offset for writing */
-	int file_offset = file_descriptors[fildes].file_pointer % BLOCK_SIZE;
-	int file_block = file_descriptors[fildes].file_pointer / BLOCK_SIZE;
+	/* Only the directory's inode is in use, its blocks are allocated as it fills */
+	memset(fs->disk_super_block.inode_bitmap, 0, sizeof(fs->disk_super_block.inode_bitmap));
+	fs->disk_super_block.inode_bitmap[0] = UINT64_C(1) << DIRECTORY_INODE;
 
-	/* Check to see if file block is on disk */
-	if (inode_table[inode_index].blocks[file_block] == -1) {
-		/* Find free block on disk */
-		int free_block = -1;
-		for (int i = disk_super_block.data_offset; i < DISK_BLOCKS; i++) {
-			if (!(disk_super_block.usage_bitmap[i / 8] & (1 << (i % 8)))) {
-				free_block = i;
+	/* All data blocks start out free, allocation starts at the first one */
+	fs->disk_super_block.free_blocks = fs->disk_super_block.data_size;
+	fs->disk_super_block.next_free = fs->disk_super_block.data_offset;
 
-				/* Indicate block is now used */
-				disk_super_block.usage_bitmap[i / 8] |= (1 << (i % 8));
-				break;
-			}
-		}
-		inode_table[inode_index].blocks[file_block] = free_block;
+	/* Write super block to first block on disk, then the usage bitmap */
+	memcpy((void *) block, (void *) &fs->disk_super_block, sizeof(struct super_block)); 
+	disk_write(fs->disk, 0, block);
+	for (int i = 0; i < fs->disk_super_block.bitmap_size; i++) {
+		disk_write(fs->disk, fs->disk_super_block.bitmap_offset + i, (char *) fs->usage_bitmap + (size_t) i * size);
 	}
+	free(fs->usage_bitmap);
+	fs->usage_bitmap = NULL;
 
-	/* Update file size */
-	if (file_descriptors[fildes].file_pointer + nbyte > inode_table[inode_index].file_size) {
-		inode_table[inode_index].file_size = file_descriptors[fildes].file_pointer + nbyte;
+	/* No block is shared yet */
+	memset(block, 0, fs->block_size);
+	for (int i = 0; i < fs->disk_super_block.share_size; i++) {
+		disk_write(fs->disk, fs->disk_super_block.share_offset + i, block);
+	}
+
+	/* Set up inode table */
+
+	/* Set inodes in inode table to unused indication values */
+	for (int i = 0; i < MAX_FILES; i++) {
+		fs->inode_table[i].ref_count = 0;
+		fs->inode_table[i].file_size = 0;
+		fs->inode_table[i].open_count = 0;
+		fs->inode_table[i].loaded = false;
+		fs->inode_table[i].dirty = false;
+		fs->inode_table[i].log_pending = false;
+		inode_release_extents(&fs->inode_table[i]);
 	}
+	fs->loaded_count = 0;
+	fs->inode_table[DIRECTORY_INODE].ref_count = 1;
+
+	/* Write inodes to disk, INODES_PER_BLOCK to a block */
+	struct disk_inode *disk_inodes = (struct disk_inode *) block;
+	for (int i = 0; i < fs->disk_super_block.inode_table_size; i++) {
+		memset(block, 0, fs->block_size);
+		for (int j = 0; j < INODES_PER_BLOCK && i * INODES_PER_BLOCK + j < MAX_FILES; j++) {
+			inode_store(fs, &fs->inode_table[i * INODES_PER_BLOCK + j], &disk_inodes[j]);
+		}
+		disk_write(fs->disk, fs->disk_super_block.inode_table_offset + i, block);
+	}
+
+	/* The log starts out empty, whatever the image held before */
+	memset(block, 0, fs->block_size);
+	disk_write(fs->disk, fs->disk_super_block.log_offset, block);
+	free(block);
 
-	/* Check if free blocks are available */
-	if (inode_table[inode_index].blocks[file_block] == -1) {
-		fprintf(stderr, "fs_write: disk full\n");
+	/* Close the disk */
+	int closed = disk_close(fs->disk);
+	instance_free(fs);
+	if (closed != 0) {
+		fprintf(stderr, "make_fs: cannot close disk\n");
 		return -1;
 	}
 
-	/* Get block of data that first needs to be written and read data */
-	char *block = calloc(1, BLOCK_SIZE);
-	block_read(inode_table[inode_index].blocks[file_block], block);
+	return 0;
+}
 
-	/* Allocate buffer to hold data in */
-	char * buffer = malloc(nbyte);
-	memcpy(buffer, buf, nbyte);
+/* Mount the file system on a disk as a new instance, NULL if it cannot be mounted */
+struct fs_instance *fsi_mount(const char *disk_name) {
+	struct fs_instance *fs = instance_new();
+	if (!fs) {
+		return NULL;
+	}
 
-	/* Write new data to block */
-	int j = 0;
-	for (int i = file_offset; (i < BLOCK_SIZE) && (j < nbyte); i++) {
-		block[i] = buffer[j];
-		j++;
+	/* Open disk */
+	if ((fs->disk = disk_open(disk_name)) == NULL) {
+		fprintf(stderr, "mount_fs: cannot open disk\n");
+		instance_free(fs);
+		return NULL;
 	}
-	block_write(inode_table[inode_index].blocks[file_block], block);
 
-	/* Loop though remaining required blocks for writing */
-	for (int i = file_block + 1; i < (file_descriptors[fildes].file_pointer + nbyte) / BLOCK_SIZE + 1; i++) {
-		/* Check to see if file block is on disk */
-		if (inode_table[inode_index].blocks[i] == -1) {
-			/* Find free block on disk */
-			int free_block = -1;
-			for (int k = disk_super_block.data_offset; k < DISK_BLOCKS; k++) {
-				if (!(disk_super_block.usage_bitmap[k / 8] & (1 << (k % 8)))) {
-					free_block = k;
-					/* Indicate block is used */
-					disk_super_block.usage_bitmap[k / 8] |= (1 << (k % 8));
-					break;
-				}
-			}
-			inode_table[inode_index].blocks[i] = free_block;
-		}
+	/* Load super block into global variable, it sits at the start of block 0 whatever the block size */
+	char *block = calloc(1, disk_get_block_size(fs->disk));
+	if (!block || disk_read(fs->disk, 0, block) != 0) {
+		fprintf(stderr, "mount_fs: cannot read super block\n");
+		free(block);
+		disk_close(fs->disk);
+		instance_free(fs);
+		return NULL;
+	}
+	memcpy((void *) &fs->disk_super_block, (void *) block, sizeof(struct super_block));
+	free(block);
 
-		/* Check if free blocks are available */
-		if (inode_table[inode_index].blocks[i] == -1) {
-			fprintf(stderr, "fs_write: disk full\n");
-			return -1;
-		}
+	/* Refuse disks not made by make_fs with this layout, or cut short since */
+	if (fs->disk_super_block.magic != FS_MAGIC) {
+		fprintf(stderr, "mount_fs: not a file system disk\n");
+		disk_close(fs->disk);
+		instance_free(fs);
+		return NULL;
+	}
+	if (disk_set_block_size(fs->disk, fs->disk_super_block.block_size) != 0 || disk_get_block_count(fs->disk) < fs->disk_super_block.block_count) {
+		fprintf(stderr, "mount_fs: disk does not match its geometry\n");
+		disk_close(fs->disk);
+		instance_free(fs);
+		return NULL;
+	}
+	fs->block_size = fs->disk_super_block.block_size;
 
-		/* Read next block */
-		block_read(inode_table[inode_index].blocks[i], block);
-		/* Copy from buffer into block */
-		for (int k = 0; (k < BLOCK_SIZE) && (j < nbyte); k++) {
-			block[k] = buffer[j];
-			j++;
-		}
+	/* Start the asynchronous engine used for multi-block transfers */
+	if ((fs->async = async_init(fs->disk, ASYNC_DEPTH)) == NULL) {
+		fprintf(stderr, "mount_fs: cannot start asynchronous I/O\n");
+		disk_close(fs->disk);
+		instance_free(fs);
+		return NULL;
+	}
 
-		/* Write back block to disk */
-		block_write(inode_table[inode_index].blocks[i], block);
+	/* Set up block cache in front of the disk, the same size in bytes whatever the block size */
+	if ((fs->cache = cache_init(fs->disk, fs->async, (int) ((long) CACHE_BLOCKS * BLOCK_SIZE / fs->block_size))) == NULL) {
+		fprintf(stderr, "mount_fs: cannot set up block cache\n");
+		async_shutdown(fs->async);
+		disk_close(fs->disk);
+		instance_free(fs);
+		return NULL;
 	}
 
-	/* Increment file pointer */
-	file_descriptors[fildes].file_pointer += nbyte;
+	/* Load the usage bitmap */
+	fs->usage_bitmap = malloc((size_t) fs->disk_super_block.bitmap_size * fs->block_size);
+	if (!fs->usage_bitmap || bitmap_transfer(fs, false) != 0) {
+		fprintf(stderr, "mount_fs: cannot read usage bitmap\n");
+		free(fs->usage_bitmap);
+		fs->usage_bitmap = NULL;
+		cache_destroy(fs->cache);
+		async_shutdown(fs->async);
+		disk_close(fs->disk);
+		instance_free(fs);
+		return NULL;
+	}
 
-	return nbyte;
-}
+	/* Load the share table */
+	fs->share_table = malloc((size_t) fs->disk_super_block.share_size * fs->block_size);
+	if (!fs->share_table || share_transfer(fs, false) != 0) {
+		fprintf(stderr, "mount_fs: cannot read share table\n");
+		free(fs->share_table);
+		fs->share_table = NULL;
+		free(fs->usage_bitmap);
+		fs->usage_bitmap = NULL;
+		cache_destroy(fs->cache);
+		async_shutdown(fs->async);
+		disk_close(fs->disk);
+		instance_free(fs);
+		return NULL;
+	}
 
-int fs_get_filesize(int fildes) {
-	/* Check that file descriptor is set to file */
-	if (file_descriptors[fildes].inode_index == -1) {
-		fprintf(stderr, "fs_get_filesize: file not found\n");
-		return -1;
+	/* Nothing freed yet, so nothing to discard, and nothing changed to write back */
+	fs->discard_bitmap = calloc((fs->disk_super_block.block_count + 63) / 64, sizeof(uint64_t));
+	fs->discard_pending = 0;
+	fs->bitmap_dirty = calloc(fs->disk_super_block.bitmap_size, sizeof(bool));
+	fs->share_dirty = calloc(fs->disk_super_block.share_size, sizeof(bool));
+	fs->super_dirty = false;
+	if (!fs->discard_bitmap || !fs->bitmap_dirty || !fs->share_dirty) {
+		fprintf(stderr, "mount_fs: failed to allocate\n");
+		free(fs->usage_bitmap);
+		fs->usage_bitmap = NULL;
+		free(fs->bitmap_dirty);
+		fs->bitmap_dirty = NULL;
+		free(fs->share_table);
+		fs->share_table = NULL;
+		free(fs->share_dirty);
+		fs->share_dirty = NULL;
+		free(fs->discard_bitmap);
+		fs->discard_bitmap = NULL;
+		cache_destroy(fs->cache);
+		async_shutdown(fs->async);
+		disk_close(fs->disk);
+		instance_free(fs);
+		return NULL;
 	}
 
-	/* Return size of file */
-	return inode_table[file_descriptors[fildes].inode_index].file_size;
-}
+	/* Bring the metadata up to date with what was committed to the log */
+	fs->log_space = fs->block_size;
+	fs->log_buffer = malloc(fs->log_space);
+	fs->log_length = sizeof(struct log_header);
+	fs->log_inode_count = 0;
+	fs->log_overflow = false;
+	if (!fs->log_buffer || log_replay(fs) != 0) {
+		fprintf(stderr, "mount_fs: cannot replay log\n");
+		free(fs->log_buffer);
+		fs->log_buffer = NULL;
+		free(fs->usage_bitmap);
+		fs->usage_bitmap = NULL;
+		free(fs->bitmap_dirty);
+		fs->bitmap_dirty = NULL;
+		free(fs->share_table);
+		fs->share_table = NULL;
+		free(fs->share_dirty);
+		fs->share_dirty = NULL;
+		free(fs->discard_bitmap);
+		fs->discard_bitmap = NULL;
+		cache_destroy(fs->cache);
+		async_shutdown(fs->async);
+		disk_close(fs->disk);
+		instance_free(fs);
+		return NULL;
+	}
 
-int fs_listfiles(char ***files) {
-	/* Loop through directory and find file names */
-        *files = (char **) malloc((MAX_FILES + 1) * sizeof(char *));
-	int name_index = 0;
-	for (int i = 0; i < MAX_FILES; i++) {
-		if (directory[i].inode_index != -1) {
-			(*files)[name_index] = (char *) malloc(sizeof(directory[i].name));
-			strcpy((*files)[name_index], directory[i].name);
-			name_index++;
+	/* Writes only need to look out for shared blocks once there are any */
+	for (int i = 0; i < fs->disk_super_block.block_count; i++) {
+		if (fs->share_table[i] > 0) {
+			fs->dedup_used = true;
+			break;
 		}
 	}
 
-	/* Set last name to NULL */
-	(*files)[name_index] = NULL;
-	return 0;
+	/* Inodes, the directory's included, are read in on first use */
+
+	/* Set up file descriptors */
+	for (int i = 0; i < MAX_FILE_DESCRIPTORS; i++) {
+		/* Set file descriptor variables as empty */
+		fs->file_descriptors[i].inode_index = -1;
+		fs->file_descriptors[i].file_pointer = -1;
+	}
+
+	/* Indicate disk is mounted */
+	fs->disk_super_block.is_mounted = true;
+
+	return fs;
 }
 
-/* Seek to a specific offset in a file */
-int fs_lseek(int fildes, off_t offset) {
-	/* Check file descriptor bounds and existance */
-	if ((fildes < 0) || (fildes > (MAX_FILE_DESCRIPTORS - 1)) || file_descriptors[fildes].inode_index == -1) {
-		fprintf(stderr, "fs_lseek: file not found\n");
+/* Unmount the file system of an instance and free it */
+int fsi_umount(struct fs_instance *fs) {
+	if (fs == NULL) {
+		fprintf(stderr, "unmount_fs: to file system to dismount\n");
 		return -1;
 	}
 
-	/* Check offset bounds */
-	if ((offset < 0) || (offset > (inode_table[file_descriptors[fildes].inode_index].file_size - 1))) {
-		fprintf(stderr, "fs_lseek: offset out of bounds\n");
+	/* Indicate disk is unmounted */
+	fs->disk_super_block.is_mounted = false;
+	fs->super_dirty = true;
+
+	/* Write changed metadata in place and leave the log empty */
+	int ret = 0;
+	if (checkpoint(fs, true) != 0) {
+		fprintf(stderr, "umount_fs: cannot write back metadata\n");
+		ret = -1;
+	}
+	free(fs->usage_bitmap);
+	fs->usage_bitmap = NULL;
+	free(fs->bitmap_dirty);
+	fs->bitmap_dirty = NULL;
+	free(fs->share_table);
+	fs->share_table = NULL;
+	free(fs->share_dirty);
+	fs->share_dirty = NULL;
+	free(fs->dedup_hashes);
+	fs->dedup_hashes = NULL;
+	free(fs->dedup_next);
+	fs->dedup_next = NULL;
+	free(fs->dedup_buckets);
+	fs->dedup_buckets = NULL;
+	free(fs->discard_bitmap);
+	fs->discard_bitmap = NULL;
+	free(fs->log_buffer);
+	fs->log_buffer = NULL;
+
+	/* Write back cached blocks and tear down the cache */
+	if (cache_destroy(fs->cache) != 0) {
+		fprintf(stderr, "umount_fs: cannot flush block cache\n");
+		ret = -1;
+	}
+	async_shutdown(fs->async);
+
+	/* Close the disk */
+	int closed = disk_close(fs->disk);
+	instance_free(fs);
+	if (closed != 0) {
+		fprintf(stderr, "umount_fs: cannot close disk\n");
 		return -1;
 	}
 
-	/* Set file offset */
-	file_descriptors[fildes].file_pointer = offset;
-	return 0;
+	return ret;
 }
 
-/* Truncate a file to a specific length */
-int fs_truncate(int fildes, off_t length) {
-	/* Check file descriptor bounds and existance */
-	if ((fildes < 0) || (fildes > (MAX_FILE_DESCRIPTORS - 1)) || file_descriptors[fildes].inode_index == -1) {
-		fprintf(stderr, "fs_truncate: file not found\n");
+/* Histogram bucket of a value, its number of bits */
+static int histogram_bucket(unsigned long value) {
+	int bits = value ? 64 - __builtin_clzll(value) : 0;
+
+	return (bits < FS_HISTOGRAM_BUCKETS) ? bits : FS_HISTOGRAM_BUCKETS - 1;
+}
+
+/* Count a finished search of the usage bitmap, with alloc_lock held */
+static void count_search(struct fs_instance *fs) {
+	fs->allocations++;
+	fs->alloc_words += fs->alloc_scanned;
+	fs->alloc_scan[histogram_bucket(fs->alloc_scanned)]++;
+	fs->alloc_scanned = 0;
+}
+
+/* First free block at or after block, -1 if there is none before the end of the disk */
+static int find_free(struct fs_instance *fs, int block) {
+	const int words = (fs->disk_super_block.block_count + 63) / 64;
+
+	uint64_t skip = (UINT64_C(1) << (block % 64)) - 1;
+	for (int word = block / 64; word < words; word++) {
+		fs->alloc_scanned++;
+		uint64_t free_bits = ~fs->usage_bitmap[word] & ~skip;
+		if (free_bits) {
+			return word * 64 + __builtin_ctzll(free_bits);
+		}
+		skip = 0;
 	}
-	
-	int inode_index = file_descriptors[fildes].inode_index;
 
-	/* Check that truncation length is not greater than file length */
-	if (length > inode_table[inode_index].file_size) {
-		fprintf(stderr, "fs_truncate: trunaction length greater than file size\n");
+	return -1;
+}
+
+/* Length of the free run starting at block, counting no further than max */
+static int free_run(struct fs_instance *fs, int block, int max) {
+	int length = 0;
+
+	while (length < max && block < fs->disk_super_block.block_count) {
+		fs->alloc_scanned++;
+		int bits = 64 - block % 64;
+		uint64_t used = fs->usage_bitmap[block / 64] >> (block % 64);
+		int run = used ? __builtin_ctzll(used) : bits;
+
+		length += run;
+		block += run;
+		if (run < bits) {
+			break;
+		}
+	}
+
+	return (length < max) ? length : max;
+}
+
+/* Allocate up to count contiguous blocks, -1 if the disk is full
+ * Continuing from goal is preferred so files grow in place, otherwise the
+ * first free run from the next-fit cursor that holds count blocks is used,
+ * or the longest run on the disk if none does. */
+static int allocate_extent(struct fs_instance *fs, int goal, int count, struct extent *extent) {
+	pthread_mutex_lock(&fs->alloc_lock);
+
+	/* Answer a full disk without scanning */
+	if (fs->disk_super_block.free_blocks == 0 || count <= 0) {
+		pthread_mutex_unlock(&fs->alloc_lock);
 		return -1;
 	}
+	if (count > fs->disk_super_block.free_blocks) {
+		count = fs->disk_super_block.free_blocks;
+	}
+
+	extent->start = -1;
+	extent->length = 0;
+
+	/* Extend the file in place if the block after it is free */
+	if (goal >= fs->disk_super_block.data_offset && goal < fs->disk_super_block.block_count) {
+		extent->length = free_run(fs, goal, count);
+		extent->start = goal;
+	}
 
-	/* Truncate last block */
-	int last_block = length / BLOCK_SIZE;
-	int last_block_offset = length % BLOCK_SIZE;
+	/* Search free runs from the cursor, wrapping around once */
+	int block = fs->disk_super_block.next_free;
+	bool wrapped = false;
+	while (extent->length < count) {
+		int start = find_free(fs, block);
+		if (start == -1 || (wrapped && start >= fs->disk_super_block.next_free)) {
+			if (wrapped) {
+				break;
+			}
+			wrapped = true;
+			block = fs->disk_super_block.data_offset;
+			continue;
+		}
+
+		int length = free_run(fs, start, count);
+		if (length > extent->length) {
+			extent->start = start;
+			extent->length = length;
+		}
+		block = start + length;
+	}
 
-	/* Get last block */
-	char *block = calloc(1, BLOCK_SIZE);
-	block_read(inode_table[inode_index].blocks[last_block], block);
+	count_search(fs);
 
-	/* Set rest of block to 0 */
-	for (int i = last_block_offset; i < BLOCK_SIZE; i++) {
-		block[i] = 0;
+	/* Mark the run used and continue after it next time */
+	mark_blocks(fs, extent->start, extent->length, true);
+	fs->disk_super_block.free_blocks -= extent->length;
+	fs->disk_super_block.next_free = extent->start + extent->length;
+	if (fs->disk_super_block.next_free >= fs->disk_super_block.block_count) {
+		fs->disk_super_block.next_free = fs->disk_super_block.data_offset;
 	}
 
-	/* Write block back to disk */
-	block_write(inode_table[inode_index].blocks[last_block], block);
+	pthread_mutex_unlock(&fs->alloc_lock);
 
-	/* Clear block */
-	free(block);
-	block = calloc(1, BLOCK_SIZE);
+	return 0;
+}
+
+/* Hash of a block's contents for the dedup index, four words at a time */
+static uint64_t block_hash(const char *data, int length) {
+	uint64_t lanes[4] = {0x9e3779b97f4a7c15, 0xbf58476d1ce4e5b9, 0x94d049bb133111eb, 0x2545f4914f6cdd1d};
 
-	/* Loop through rest of file to free blocks */
-	while (inode_table[inode_index].blocks[last_block] != -1) {
-		/* Set block to free in usage bitmask */
-		disk_super_block.usage_bitmap[last_block / sizeof(char)] &= ~(1 << (last_block % sizeof(char)));
-		/* Set data to free */
-		block_write(inode_table[inode_index].blocks[last_block], block);
-		/* Set blocks as unused */
-		inode_table[inode_index].blocks[last_block] = -1;
-		last_block++;
+	for (int i = 0; i + 32 <= length; i += 32) {
+		for (int j = 0; j < 4; j++) {
+			uint64_t word;
+			memcpy(&word, data + i + j * 8, 8);
+			lanes[j] = (lanes[j] ^ word) * 0xff51afd7ed558ccd;
+			lanes[j] ^= lanes[j] >> 29;
+		}
 	}
 
-	/* Update file size */
-	inode_table[inode_index].file_size = length;
+	uint64_t hash = length;
+	for (int j = 0; j < 4; j++) {
+		hash = (hash ^ lanes[j]) * 0xc4ceb9fe1a85ec53;
+		hash ^= hash >> 32;
+	}
+	return hash;
+}
 
-	/* Free allocated variables */
-	free(block);
+/* Set up the dedup index on first use, with alloc_lock held */
+static int dedup_setup(struct fs_instance *fs) {
+	int buckets = 1;
+	while (buckets < fs->disk_super_block.block_count) {
+		buckets *= 2;
+	}
+
+	fs->dedup_hashes = malloc(sizeof(uint64_t) * fs->disk_super_block.block_count);
+	fs->dedup_next = malloc(sizeof(int) * fs->disk_super_block.block_count);
+	fs->dedup_buckets = malloc(sizeof(int) * buckets);
+	if (!fs->dedup_hashes || !fs->dedup_next || !fs->dedup_buckets) {
+		fprintf(stderr, "dedup_setup: failed to allocate\n");
+		free(fs->dedup_hashes);
+		fs->dedup_hashes = NULL;
+		free(fs->dedup_next);
+		fs->dedup_next = NULL;
+		free(fs->dedup_buckets);
+		fs->dedup_buckets = NULL;
+		return -1;
+	}
+	for (int i = 0; i < fs->disk_super_block.block_count; i++) {
+		fs->dedup_next[i] = DEDUP_UNINDEXED;
+	}
+	for (int i = 0; i < buckets; i++) {
+		fs->dedup_buckets[i] = DEDUP_END;
+	}
+	fs->dedup_mask = buckets - 1;
 
 	return 0;
 }
+
+/* Add a block holding contents with the given hash to the dedup index, with alloc_lock held */
+static void dedup_insert(struct fs_instance *fs, int block, uint64_t hash) {
+	if (!fs->dedup_buckets && dedup_setup(fs) != 0) {
+		return;
+	}
+	if (fs->dedup_next[block] != DEDUP_UNINDEXED) {
+		return;
+	}
+
+	int bucket = (int) (hash & fs->dedup_mask);
+	fs->dedup_hashes[block] = hash;
+	fs->dedup_next[block] = fs->dedup_buckets[bucket];
+	fs->dedup_buckets[bucket] = block;
+	__atomic_store_n(&fs->dedup_used, true, __ATOMIC_RELEASE);
+}
+
+/* Take a block out of the dedup index as its contents change or it is freed, with alloc_lock held */
+static void dedup_remove(struct fs_instance *fs, int block) {
+	if (!fs->dedup_buckets || fs->dedup_next[block] == DEDUP_UNINDEXED) {
+		return;
+	}
+
+	int *link = &fs->dedup_buckets[fs->dedup_hashes[block] & fs->dedup_mask];
+	while (*link != block) {
+		link = &fs->dedup_next[*link];
+	}
+	*link = fs->dedup_next[block];
+	fs->dedup_next[block] = DEDUP_UNINDEXED;
+}
+
+/* Mark a run of blocks free and count them, with alloc_lock held */
+static void release_blocks(struct fs_instance *fs, int start, int length) {
+	mark_blocks(fs, start, length, false);
+	fs->disk_super_block.free_blocks += length;
+}
+
+/* Mark a run of data blocks free again, a shared block only loses a reference */
+static void free_extent(struct fs_instance *fs, int start, int length) {
+	pthread_mutex_lock(&fs->alloc_lock);
+	if (fs->dedup_used) {
+		/* Free the runs between shared blocks, which stay in the index for the files left holding them */
+		int run = start;
+		for (int block = start; block < start + length; block++) {
+			if (fs->share_table[block] > 0) {
+				release_blocks(fs, run, block - run);
+				set_shares(fs, block, fs->share_table[block] - 1);
+				run = block + 1;
+			} else {
+				dedup_remove(fs, block);
+			}
+		}
+		release_blocks(fs, run, start + length - run);
+	} else {
+		release_blocks(fs, start, length);
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+}
+
+/* Find a block in the dedup index holding the same data and take a reference to it, -1 if there is none
+ * Blocks whose hashes match are compared in full, so a collision is never shared. They are read without
+ * alloc_lock, each after taking its reference: an owner takes a block out of the index before changing
+ * it in place and copies it instead while it is shared, so a block still indexed with the same hash then
+ * keeps what it holds until the reference is dropped again. */
+static int dedup_share(struct fs_instance *fs, const char *data) {
+	char block[fs->block_size];
+	int candidates[DEDUP_CANDIDATES];
+	int count = 0;
+	uint64_t hash = block_hash(data, fs->block_size);
+
+	pthread_mutex_lock(&fs->alloc_lock);
+	if (fs->dedup_buckets) {
+		for (int candidate = fs->dedup_buckets[hash & fs->dedup_mask]; candidate != DEDUP_END && count < DEDUP_CANDIDATES;
+		     candidate = fs->dedup_next[candidate]) {
+			if (fs->dedup_hashes[candidate] == hash) {
+				candidates[count++] = candidate;
+			}
+		}
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+
+	for (int i = 0; i < count; i++) {
+		int candidate = candidates[i];
+		pthread_mutex_lock(&fs->alloc_lock);
+		bool held = fs->dedup_next[candidate] != DEDUP_UNINDEXED && fs->dedup_hashes[candidate] == hash &&
+			fs->share_table[candidate] < MAX_SHARES;
+		if (held) {
+			set_shares(fs, candidate, fs->share_table[candidate] + 1);
+		}
+		pthread_mutex_unlock(&fs->alloc_lock);
+		if (!held) {
+			continue;
+		}
+
+		if (cache_read(fs->cache, candidate, block) == 0 && memcmp(block, data, fs->block_size) == 0) {
+			return candidate;
+		}
+		free_extent(fs, candidate, 1);
+	}
+	return -1;
+}
+
+/* Allocate one block for an extent index, kept low on the disk away from file data */
+static int allocate_index_block(struct fs_instance *fs) {
+	pthread_mutex_lock(&fs->alloc_lock);
+	if (fs->disk_super_block.free_blocks == 0) {
+		pthread_mutex_unlock(&fs->alloc_lock);
+		return -1;
+	}
+
+	int block = find_free(fs, fs->disk_super_block.data_offset);
+	count_search(fs);
+	mark_blocks(fs, block, 1, true);
+	fs->disk_super_block.free_blocks--;
+	pthread_mutex_unlock(&fs->alloc_lock);
+
+	return block;
+}
+
+/* Allocate or free index blocks so an inode can hold exactly extent_count extents */
+static int inode_fit_index(struct fs_instance *fs, struct inode *inode, int extent_count) {
+	int needed = index_blocks_needed(fs, extent_count);
+
+	/* Grow, adding the double indirect block once a second index block is needed */
+	if (needed > inode->index_count) {
+		int *index_blocks = realloc(inode->index_blocks, sizeof(int) * needed);
+		if (!index_blocks) {
+			fprintf(stderr, "inode_fit_index: failed to allocate\n");
+			return -1;
+		}
+		inode->index_blocks = index_blocks;
+
+		while (inode->index_count < needed) {
+			if (inode->index_count == 1 && inode->double_indirect == 0) {
+				if ((inode->double_indirect = allocate_index_block(fs)) == -1) {
+					inode->double_indirect = 0;
+					return -1;
+				}
+			}
+			int block = allocate_index_block(fs);
+			if (block == -1) {
+				return -1;
+			}
+			inode->index_blocks[inode->index_count++] = block;
+		}
+	}
+
+	/* Shrink, freeing the double indirect block once it lists nothing */
+	while (inode->index_count > needed) {
+		free_extent(fs, inode->index_blocks[--inode->index_count], 1);
+	}
+	if (inode->index_count <= 1 && inode->double_indirect != 0) {
+		free_extent(fs, inode->double_indirect, 1);
+		inode->double_indirect = 0;
+	}
+
+	return 0;
+}
+
+/* Number of blocks held by an inode */
+static int inode_blocks(const struct inode *inode) {
+	int count = 0;
+	for (int i = 0; i < inode->extent_count; i++) {
+		count += inode->extents[i].length;
+	}
+	return count;
+}
+
+/* Add an extent after the last one of a file */
+static int inode_add_extent(struct fs_instance *fs, struct inode *inode, int start, int length) {
+	if (inode->extent_count == MAX_EXTENTS) {
+		fprintf(stderr, "inode_add_extent: too many extents\n");
+		return -1;
+	}
+
+	/* Extents past the direct ones need room in an index block */
+	if (inode_fit_index(fs, inode, inode->extent_count + 1) != 0) {
+		fprintf(stderr, "inode_add_extent: cannot allocate index block\n");
+		inode_fit_index(fs, inode, inode->extent_count);
+		return -1;
+	}
+
+	/* Grow the extent list geometrically */
+	if (inode->extent_count == inode->extent_space) {
+		int space = inode->extent_space ? inode->extent_space * 2 : 4;
+		struct extent *extents = realloc(inode->extents, sizeof(struct extent) * space);
+		if (!extents) {
+			fprintf(stderr, "inode_add_extent: failed to allocate\n");
+			return -1;
+		}
+		inode->extents = extents;
+		inode->extent_space = space;
+	}
+
+	inode->extents[inode->extent_count].start = start;
+	inode->extents[inode->extent_count].length = length;
+	inode->extent_count++;
+	inode_changed(fs, inode, inode->extent_count - 1);
+
+	return 0;
+}
+
+/* Add blocks to the end of a file, merging with the last extent when adjacent */
+static int inode_append(struct fs_instance *fs, struct inode *inode, int start, int length) {
+	if (inode->extent_count > 0) {
+		struct extent *last = &inode->extents[inode->extent_count - 1];
+		if (last->start + last->length == start) {
+			last->length += length;
+			inode_changed(fs, inode, inode->extent_count - 1);
+			return 0;
+		}
+	}
+
+	return inode_add_extent(fs, inode, start, length);
+}
+
+/* Replace count extents of an inode from first on with the add_count extents in add */
+static int inode_splice(struct fs_instance *fs, struct inode *inode, int first, int count, const struct extent *add, int add_count) {
+	int extent_count = inode->extent_count - count + add_count;
+	if (extent_count > MAX_EXTENTS) {
+		fprintf(stderr, "inode_splice: too many extents\n");
+		return -1;
+	}
+
+	/* Extents past the direct ones need room in an index block */
+	if (inode_fit_index(fs, inode, extent_count) != 0) {
+		fprintf(stderr, "inode_splice: cannot allocate index block\n");
+		inode_fit_index(fs, inode, inode->extent_count);
+		return -1;
+	}
+	if (extent_count > inode->extent_space) {
+		int space = (inode->extent_space * 2 > extent_count) ? inode->extent_space * 2 : extent_count;
+		struct extent *extents = realloc(inode->extents, sizeof(struct extent) * space);
+		if (!extents) {
+			fprintf(stderr, "inode_splice: failed to allocate\n");
+			return -1;
+		}
+		inode->extents = extents;
+		inode->extent_space = space;
+	}
+
+	memmove(&inode->extents[first + add_count], &inode->extents[first + count],
+	        sizeof(struct extent) * (inode->extent_count - first - count));
+	memcpy(&inode->extents[first], add, sizeof(struct extent) * add_count);
+	inode->extent_count = extent_count;
+	inode_changed(fs, inode, first);
+
+	return 0;
+}
+
+/* Move length file blocks from file_block on, all in one extent, to the disk blocks from start on
+ * The extent is split around them, and they merge with the extents beside them where contiguous. */
+static int inode_remap(struct fs_instance *fs, struct inode *inode, int file_block, int start, int length) {
+	int i = 0;
+	int base = 0;
+	while (base + inode->extents[i].length <= file_block) {
+		base += inode->extents[i].length;
+		i++;
+	}
+	const struct extent *extent = &inode->extents[i];
+	int offset = file_block - base;
+
+	/* The extent before and after take part, so the moved blocks can join them */
+	struct extent pieces[5];
+	int count = 0;
+	int first = (i > 0) ? i - 1 : i;
+	if (i > 0) {
+		pieces[count++] = inode->extents[i - 1];
+	}
+	if (offset > 0) {
+		pieces[count++] = (struct extent) {extent->start, offset};
+	}
+	pieces[count++] = (struct extent) {start, length};
+	if (offset + length < extent->length) {
+		pieces[count++] = (struct extent) {extent->start + offset + length, extent->length - offset - length};
+	}
+	if (i + 1 < inode->extent_count) {
+		pieces[count++] = inode->extents[i + 1];
+	}
+
+	int merged = 0;
+	for (int j = 0; j < count; j++) {
+		if (merged > 0 && pieces[merged - 1].start + pieces[merged - 1].length == pieces[j].start) {
+			pieces[merged - 1].length += pieces[j].length;
+		} else {
+			pieces[merged++] = pieces[j];
+		}
+	}
+
+	return inode_splice(fs, inode, first, (i + 1 < inode->extent_count) ? i + 2 - first : i + 1 - first, pieces, merged);
+}
+
+/* Free every block of a file past its first keep blocks, their contents are discarded later in batches */
+static void inode_trim(struct fs_instance *fs, struct inode *inode, int keep) {
+	int base = 0;
+	int count = 0;
+	int changed = inode->extent_count;
+
+	for (int i = 0; i < inode->extent_count; i++) {
+		struct extent *extent = &inode->extents[i];
+
+		/* Part of the extent past keep is freed, the rest stays */
+		int kept = keep - base;
+		if (kept < 0) {
+			kept = 0;
+		}
+		base += extent->length;
+		if (kept >= extent->length) {
+			count++;
+			continue;
+		}
+
+		free_extent(fs, extent->start + kept, extent->length - kept);
+		if (changed > i) {
+			changed = i;
+		}
+
+		extent->length = kept;
+		if (kept > 0) {
+			count++;
+		}
+	}
+	inode->extent_count = count;
+	inode_changed(fs, inode, changed);
+
+	/* Index blocks past the remaining extents are no longer needed */
+	inode_fit_index(fs, inode, count);
+}
+
+/* Allocate blocks up to need for a file, as contiguously as possible, continuing its last extent
+ * Returns how many blocks the file holds afterwards, short of need if the disk is full */
+static int inode_grow(struct fs_instance *fs, struct inode *inode, int need) {
+	int have = inode_blocks(inode);
+
+	while (have < need) {
+		struct extent extent;
+		int goal = -1;
+		if (inode->extent_count > 0) {
+			goal = inode->extents[inode->extent_count - 1].start + inode->extents[inode->extent_count - 1].length;
+		}
+		if (allocate_extent(fs, goal, need - have, &extent) != 0) {
+			break;
+		}
+		if (inode_append(fs, inode, extent.start, extent.length) != 0) {
+			free_extent(fs, extent.start, extent.length);
+			break;
+		}
+		have += extent.length;
+	}
+
+	return have;
+}
+
+/* Look up the disk blocks holding count file blocks from file_block on */
+static void map_blocks(const struct inode *inode, int file_block, int count, int *blocks) {
+	int i = 0;
+	int base = 0;
+
+	/* Skip the extents that end before the range starts */
+	while (base + inode->extents[i].length <= file_block) {
+		base += inode->extents[i].length;
+		i++;
+	}
+
+	int offset = file_block - base;
+	int mapped = 0;
+	while (mapped < count) {
+		for (int j = offset; j < inode->extents[i].length && mapped < count; j++) {
+			blocks[mapped++] = inode->extents[i].start + j;
+		}
+		offset = 0;
+		i++;
+	}
+}
+
+/* Take the lowest free inode, -1 if every inode is in use */
+static int allocate_inode(struct fs_instance *fs) {
+	int inode_index = -1;
+
+	pthread_mutex_lock(&fs->alloc_lock);
+	for (int word = 0; word < MAX_FILES / 64; word++) {
+		uint64_t free_bits = ~fs->disk_super_block.inode_bitmap[word];
+		if (free_bits) {
+			inode_index = word * 64 + __builtin_ctzll(free_bits);
+			fs->disk_super_block.inode_bitmap[word] |= UINT64_C(1) << (inode_index % 64);
+			fs->super_dirty = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+
+	return inode_index;
+}
+
+/* Mark an inode free again */
+static void free_inode(struct fs_instance *fs, int inode_index) {
+	pthread_mutex_lock(&fs->alloc_lock);
+	fs->disk_super_block.inode_bitmap[inode_index / 64] &= ~(UINT64_C(1) << (inode_index % 64));
+	fs->super_dirty = true;
+	pthread_mutex_unlock(&fs->alloc_lock);
+}
+
+/* Find where a name is, or would go, in the directory, reading its bucket into block */
+static int directory_lookup(struct fs_instance *fs, const char *name, unsigned int hash, char *block, struct directory_slot *slot) {
+	struct inode *directory = inode_get(fs, DIRECTORY_INODE);
+	if (directory == NULL) {
+		return -1;
+	}
+
+	slot->disk_block = slot->entry = slot->free_entry = -1;
+	int buckets = directory->file_size / fs->block_size;
+	if (buckets == 0) {
+		return 0;
+	}
+
+	map_blocks(directory, hash & (buckets - 1), 1, &slot->disk_block);
+	if (cache_read(fs->cache, slot->disk_block, block) != 0) {
+		return -1;
+	}
+
+	/* Compare names only when the stored hash matches */
+	const struct directory_file *entries = (const struct directory_file *) block;
+	for (int i = 0; i < DIRECTORY_ENTRIES; i++) {
+		if (entries[i].name[0] == '\0') {
+			if (slot->free_entry == -1) {
+				slot->free_entry = i;
+			}
+		} else if (entries[i].hash == hash && strcmp(entries[i].name, name) == 0) {
+			slot->entry = i;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/* Double the directory's buckets, splitting each bucket between itself and its new twin */
+static int directory_grow(struct fs_instance *fs) {
+	struct inode *directory = inode_get(fs, DIRECTORY_INODE);
+	if (directory == NULL) {
+		return -1;
+	}
+
+	int buckets = directory->file_size / fs->block_size;
+	int grown = buckets ? buckets * 2 : 1;
+	if (grown > MAX_DIRECTORY_BLOCKS) {
+		fprintf(stderr, "directory_grow: directory too large\n");
+		return -1;
+	}
+	if (inode_grow(fs, directory, grown) < grown) {
+		fprintf(stderr, "directory_grow: disk full\n");
+		inode_trim(fs, directory, buckets);
+		return -1;
+	}
+
+	char block[fs->block_size];
+	char halves[2][fs->block_size];
+	const struct directory_file *entries = (const struct directory_file *) block;
+
+	/* The first bucket starts out empty */
+	if (buckets == 0) {
+		int disk_block;
+		memset(block, 0, fs->block_size);
+		map_blocks(directory, 0, 1, &disk_block);
+		log_bucket(fs, disk_block, block, 0);
+		if (cache_write_ordered(fs->cache, disk_block, block) != 0) {
+			return -1;
+		}
+	}
+
+	/* Entries with the new hash bit set move to the twin bucket */
+	for (int bucket = 0; bucket < buckets; bucket++) {
+		int disk_blocks[2];
+		int counts[2] = {0, 0};
+
+		map_blocks(directory, bucket, 1, &disk_blocks[0]);
+		map_blocks(directory, bucket + buckets, 1, &disk_blocks[1]);
+		if (cache_read(fs->cache, disk_blocks[0], block) != 0) {
+			return -1;
+		}
+
+		memset(halves, 0, sizeof(halves));
+		for (int i = 0; i < DIRECTORY_ENTRIES; i++) {
+			if (entries[i].name[0] != '\0') {
+				int half = (entries[i].hash & buckets) ? 1 : 0;
+				((struct directory_file *) halves[half])[counts[half]++] = entries[i];
+			}
+		}
+
+		log_bucket(fs, disk_blocks[0], halves[0], counts[0]);
+		log_bucket(fs, disk_blocks[1], halves[1], counts[1]);
+		if (cache_write_ordered(fs->cache, disk_blocks[0], halves[0]) != 0 || cache_write_ordered(fs->cache, disk_blocks[1], halves[1]) != 0) {
+			return -1;
+		}
+	}
+
+	directory->file_size = grown * fs->block_size;
+	inode_changed(fs, directory, directory->extent_count);
+
+	return 0;
+}
+
+/* Inode a descriptor is open on, -1 if it is out of range, not in use or nothing is mounted
+ * Descriptors are only claimed and freed under fd_lock, reading one needs no lock. */
+static int fd_inode(struct fs_instance *fs, int fildes) {
+	if ((fs == NULL) || (fildes < 0) || (fildes > (MAX_FILE_DESCRIPTORS - 1))) {
+		return -1;
+	}
+
+	return __atomic_load_n(&fs->file_descriptors[fildes].inode_index, __ATOMIC_ACQUIRE);
+}
+
+/* Open a file by name, with dir_lock held so it cannot be deleted meanwhile */
+static int open_file(struct fs_instance *fs, const char *name) {
+	/* Find file name in directory */
+	char block[fs->block_size];
+	struct directory_slot slot;
+	if (directory_lookup(fs, name, hash_name(name), block, &slot) != 0) {
+		fprintf(stderr, "fs_open: cannot read directory\n");
+		return -1;
+	}
+
+	/* Check to see that inode was found */
+	if (slot.entry == -1) {
+		fprintf(stderr, "fs_open: file could not be found\n");
+		return -1;
+	}
+	int inode_index = ((struct directory_file *) block)[slot.entry].inode_index;
+
+	/* Read the inode in if this is its first use since mount */
+	if (inode_get(fs, inode_index) == NULL) {
+		fprintf(stderr, "fs_open: cannot load inode\n");
+		return -1;
+	}
+
+	/* Find valid file descriptor */
+	int file_descriptor_index = -1;
+	pthread_mutex_lock(&fs->fd_lock);
+	for (int i = 0; i < MAX_FILE_DESCRIPTORS; i++) {
+		if (fs->file_descriptors[i].inode_index  == -1) {
+			// Found free file descriptor
+			fs->file_descriptors[i].file_pointer = 0;
+			fs->file_descriptors[i].readahead_next = 0;
+			fs->file_descriptors[i].readahead_window = 0;
+			fs->file_descriptors[i].readahead_end = 0;
+			__atomic_store_n(&fs->file_descriptors[i].inode_index, inode_index, __ATOMIC_RELEASE);
+			fs->inode_table[inode_index].open_count++;
+			file_descriptor_index = i;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&fs->fd_lock);
+
+	/* Check to see file descriptor was found */
+	if (file_descriptor_index == -1) {
+		fprintf(stderr, "fs_open: no free file descriptors\n");
+		return -1;
+	}
+
+	return file_descriptor_index;
+}
+
+static int op_open(struct fs_instance *fs, const char *name) {
+	/* Confirm disk is mounted */
+	if (fs == NULL) {
+		fprintf(stderr, "fs_open: disk not mounted\n");
+		return -1;
+	}
+
+	pthread_rwlock_rdlock(&fs->dir_lock);
+	int ret = open_file(fs, name);
+	pthread_rwlock_unlock(&fs->dir_lock);
+
+	return ret;
+}
+
+/* Close the file system*/
+static int op_close(struct fs_instance *fs, int fildes) {
+	if (fs == NULL) {
+		fprintf(stderr, "fs_close: disk not mounted\n");
+		return -1;
+	}
+
+	pthread_mutex_lock(&fs->fd_lock);
+
+	/* Check fildes bounds and existance */
+	if ((fildes < 0) || (fildes > (MAX_FILE_DESCRIPTORS - 1)) || fs->file_descriptors[fildes].inode_index == -1) {
+		fprintf(stderr, "fs_close: file not found\n");
+		pthread_mutex_unlock(&fs->fd_lock);
+		return -1;
+	}
+
+	/* Decrement the open descriptor counter */
+	fs->inode_table[fs->file_descriptors[fildes].inode_index].open_count--;
+
+	/* Set file descriptor as free */
+	__atomic_store_n(&fs->file_descriptors[fildes].inode_index, -1, __ATOMIC_RELEASE);
+	fs->file_descriptors[fildes].file_pointer = -1;
+
+	pthread_mutex_unlock(&fs->fd_lock);
+
+	return 0;
+
+}
+
+/* Add a file to the directory, with fs_lock held shared and dir_lock exclusively */
+static int create_file(struct fs_instance *fs, const char *name) {
+	/* Check if file name already exists */
+	char block[fs->block_size];
+	struct directory_slot slot;
+	unsigned int hash = hash_name(name);
+	if (directory_lookup(fs, name, hash, block, &slot) != 0) {
+		fprintf(stderr, "fs_create: cannot read directory\n");
+		return -1;
+	}
+	if (slot.entry != -1) {
+		fprintf(stderr, "fs_create: file name already exists\n");
+		return -1;
+	}
+
+	/* Find open inode table entry */
+	int inode_index = allocate_inode(fs);
+	if (inode_index == -1) {
+		fprintf(stderr, "fs_create: no free inodes\n");
+		return -1;
+	}
+
+	/* Grow the directory until the name's bucket has room */
+	while (slot.free_entry == -1) {
+		if (directory_grow(fs) != 0 || directory_lookup(fs, name, hash, block, &slot) != 0) {
+			fprintf(stderr, "fs_create: too many files in directory\n");
+			free_inode(fs, inode_index);
+			return -1;
+		}
+	}
+
+	/* Create file */
+	struct directory_file *entry = &((struct directory_file *) block)[slot.free_entry];
+	strcpy(entry->name, name);
+	entry->hash = hash;
+	entry->inode_index = inode_index;
+	log_entry(fs, slot.disk_block, slot.free_entry, entry);
+	if (cache_write_ordered(fs->cache, slot.disk_block, block) != 0) {
+		fprintf(stderr, "fs_create: cannot write directory\n");
+		free_inode(fs, inode_index);
+		return -1;
+	}
+
+	/* A free inode is empty, so there is nothing to read in */
+	struct inode *inode = &fs->inode_table[inode_index];
+	inode_release_extents(inode);
+	inode->ref_count = 1;
+	inode->file_size = 0;
+	inode->flags = 0;
+	inode->open_count = 0;
+	inode_changed(fs, inode, 0);
+	inode_set_loaded(fs, inode_index);
+	
+	return 0;
+}
+
+/* Create a new file */
+static int op_create(struct fs_instance *fs, const char *name) {
+	/* Check file name length */
+	if (strlen(name) > MAX_FILE_NAME) {
+		fprintf(stderr, "fs_create: file name too long\n");
+		return -1;
+	}
+	if (name[0] == '\0') {
+		fprintf(stderr, "fs_create: file name empty\n");
+		return -1;
+	}
+
+	/* Check that disk is mounted */
+	if (fs == NULL) {
+		fprintf(stderr, "fs_create: disk not mounted\n");
+		return -1;
+	}
+
+	/* Commit the changes of earlier operations once there are enough of them */
+	log_batch(fs);
+
+	pthread_rwlock_rdlock(&fs->fs_lock);
+	pthread_rwlock_wrlock(&fs->dir_lock);
+	int ret = create_file(fs, name);
+	pthread_rwlock_unlock(&fs->dir_lock);
+	pthread_rwlock_unlock(&fs->fs_lock);
+
+	return ret;
+}
+
+/* Remove a file from the directory, with fs_lock held shared and dir_lock exclusively */
+static int delete_file(struct fs_instance *fs, const char *name) {
+	/* Find directory and inode index */
+	char block[fs->block_size];
+	struct directory_slot slot;
+	if (directory_lookup(fs, name, hash_name(name), block, &slot) != 0) {
+		fprintf(stderr, "fs_delete: cannot read directory\n");
+		return -1;
+	}
+
+	/* Check that directory entry exists */
+	if (slot.entry == -1) {
+		fprintf(stderr, "fs_delete: file not found\n");
+		return -1;
+	}
+	struct directory_file *entry = &((struct directory_file *) block)[slot.entry];
+	int inode_index = entry->inode_index;
+
+	/* Read the inode in to get at its blocks */
+	if (inode_get(fs, inode_index) == NULL) {
+		fprintf(stderr, "fs_delete: cannot load inode\n");
+		return -1;
+	}
+
+	/* Check that there are no file descriptors pointing to file, none can be opened
+	 * while the directory is locked, so nothing else uses the inode from here on */
+	pthread_mutex_lock(&fs->fd_lock);
+	int open_count = fs->inode_table[inode_index].open_count;
+	pthread_mutex_unlock(&fs->fd_lock);
+	if (open_count > 0) {
+		fprintf(stderr, "fs_delete: file is open\n");
+		return -1;
+	}
+
+	/* Free data blocks */
+	inode_trim(fs, &fs->inode_table[inode_index], 0);
+	inode_release_extents(&fs->inode_table[inode_index]);
+
+	/* Clear directory entry and give the inode back */
+	memset(entry, 0, sizeof(struct directory_file));
+	log_entry(fs, slot.disk_block, slot.entry, entry);
+	if (cache_write_ordered(fs->cache, slot.disk_block, block) != 0) {
+		fprintf(stderr, "fs_delete: cannot write directory\n");
+		return -1;
+	}
+	free_inode(fs, inode_index);
+
+	/* Clear inode entry */
+	fs->inode_table[inode_index].ref_count = 0;
+	fs->inode_table[inode_index].file_size = 0;
+	fs->inode_table[inode_index].flags = 0;
+	inode_changed(fs, &fs->inode_table[inode_index], 0);
+
+	return 0;
+}
+
+/* Delete a file */
+static int op_delete(struct fs_instance *fs, const char *name) {
+	/* Check that disk is mounted */
+	if (fs == NULL) {
+		fprintf(stderr, "fs_delete: disk not mounted\n");
+		return -1;
+	}
+
+	/* Commit the changes of earlier operations once there are enough of them */
+	log_batch(fs);
+
+	pthread_rwlock_rdlock(&fs->fs_lock);
+	pthread_rwlock_wrlock(&fs->dir_lock);
+	int ret = delete_file(fs, name);
+	pthread_rwlock_unlock(&fs->dir_lock);
+	pthread_rwlock_unlock(&fs->fs_lock);
+
+	return ret;
+}
+
+/* Move count consecutive blocks of a file to or from buf, batching them into vectored requests */
+static int transfer_blocks(struct fs_instance *fs, bool write, int inode_index, int file_block, int count, char *buf) {
+	int blocks[VECTOR_BLOCKS];
+	char *bufs[VECTOR_BLOCKS];
+
+	for (int base = 0; base < count; base += VECTOR_BLOCKS) {
+		int batch = (count - base < VECTOR_BLOCKS) ? count - base : VECTOR_BLOCKS;
+		map_blocks(&fs->inode_table[inode_index], file_block + base, batch, blocks);
+		for (int i = 0; i < batch; i++) {
+			bufs[i] = buf + (base + i) * fs->block_size;
+		}
+
+		int ret;
+		if (write) {
+			ret = cache_writev(fs->cache, batch, blocks, (const void *const *) bufs);
+		} else {
+			ret = cache_readv(fs->cache, batch, blocks, (void *const *) bufs);
+		}
+		if (ret != 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Read nbyte bytes starting at offset, whole blocks go straight into buf */
+static int read_range(struct fs_instance *fs, int inode_index, char *buf, int nbyte, int offset) {
+	char block[fs->block_size];
+	int file_block = offset / fs->block_size;
+	int block_offset = offset % fs->block_size;
+	int done = 0;
+
+	/* Partial first block goes through the scratch block */
+	if (block_offset != 0 || nbyte < fs->block_size) {
+		int length = fs->block_size - block_offset;
+		if (length > nbyte) {
+			length = nbyte;
+		}
+		int disk_block;
+		map_blocks(&fs->inode_table[inode_index], file_block, 1, &disk_block);
+		if (cache_read(fs->cache, disk_block, block) != 0) {
+			return -1;
+		}
+		memcpy(buf, block + block_offset, length);
+		done += length;
+		file_block++;
+	}
+
+	/* Whole blocks in the middle are read directly into buf */
+	int whole_blocks = (nbyte - done) / fs->block_size;
+	if (whole_blocks > 0) {
+		if (transfer_blocks(fs, false, inode_index, file_block, whole_blocks, buf + done) != 0) {
+			return -1;
+		}
+		done += whole_blocks * fs->block_size;
+		file_block += whole_blocks;
+	}
+
+	/* Partial last block goes through the scratch block */
+	if (done < nbyte) {
+		int disk_block;
+		map_blocks(&fs->inode_table[inode_index], file_block, 1, &disk_block);
+		if (cache_read(fs->cache, disk_block, block) != 0) {
+			return -1;
+		}
+		memcpy(buf + done, block, nbyte - done);
+	}
+
+	return 0;
+}
+
+/* Write part of one block, reading it first only if it holds file data */
+static int write_partial(struct fs_instance *fs, int inode_index, int file_block, int block_offset, const char *buf, int length) {
+	char block[fs->block_size];
+	int disk_block;
+
+	map_blocks(&fs->inode_table[inode_index], file_block, 1, &disk_block);
+
+	if (file_block * fs->block_size < fs->inode_table[inode_index].file_size) {
+		if (cache_read(fs->cache, disk_block, block) != 0) {
+			return -1;
+		}
+	} else {
+		memset(block, 0, fs->block_size);
+	}
+
+	memcpy(block + block_offset, buf, length);
+
+	return cache_write(fs->cache, disk_block, block);
+}
+
+/* Write nbyte bytes starting at offset, whole blocks go straight from buf to disk */
+static int write_range(struct fs_instance *fs, int inode_index, const char *buf, int nbyte, int offset) {
+	int file_block = offset / fs->block_size;
+	int block_offset = offset % fs->block_size;
+	int done = 0;
+
+	/* Partial first block needs a read-modify-write */
+	if (block_offset != 0 || nbyte < fs->block_size) {
+		int length = fs->block_size - block_offset;
+		if (length > nbyte) {
+			length = nbyte;
+		}
+		if (write_partial(fs, inode_index, file_block, block_offset, buf, length) != 0) {
+			return -1;
+		}
+		done += length;
+		file_block++;
+	}
+
+	/* Whole blocks in the middle are overwritten without reading them */
+	int whole_blocks = (nbyte - done) / fs->block_size;
+	if (whole_blocks > 0) {
+		if (transfer_blocks(fs, true, inode_index, file_block, whole_blocks, (char *) buf + done) != 0) {
+			return -1;
+		}
+		done += whole_blocks * fs->block_size;
+		file_block += whole_blocks;
+	}
+
+	/* Partial last block needs a read-modify-write */
+	if (done < nbyte) {
+		if (write_partial(fs, inode_index, file_block, 0, buf + done, nbyte - done) != 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Bytes of a compressed file in one of its chunks, the last chunk may be short */
+static int chunk_bytes(struct fs_instance *fs, const struct inode *inode, int chunk) {
+	int bytes = inode->file_size - chunk * CHUNK_SIZE;
+	return (bytes < CHUNK_SIZE) ? bytes : CHUNK_SIZE;
+}
+
+/* Move the blocks of a chunk's extent to or from buf in one vectored request */
+static int transfer_extent(struct fs_instance *fs, bool write, const struct extent *extent, char *buf) {
+	int blocks[CHUNK_BLOCKS];
+	char *bufs[CHUNK_BLOCKS];
+
+	for (int i = 0; i < extent->length; i++) {
+		blocks[i] = extent->start + i;
+		bufs[i] = buf + i * fs->block_size;
+	}
+	if (write) {
+		return cache_writev(fs->cache, extent->length, blocks, (const void *const *) bufs);
+	}
+	return cache_readv(fs->cache, extent->length, blocks, (void *const *) bufs);
+}
+
+/* Read a chunk of a compressed file into data, which has room for the blocks the chunk spans */
+static int chunk_read(struct fs_instance *fs, const struct inode *inode, int chunk, char *data) {
+	const struct extent *extent = &inode->extents[chunk];
+	int bytes = chunk_bytes(fs, inode, chunk);
+	int blocks = (bytes + fs->block_size - 1) / fs->block_size;
+
+	/* A chunk stored as it is needs no scratch space */
+	if (extent->length == blocks) {
+		return transfer_extent(fs, false, extent, data);
+	}
+
+	char *stored = malloc((size_t) extent->length * fs->block_size);
+	if (!stored) {
+		fprintf(stderr, "chunk_read: failed to allocate\n");
+		return -1;
+	}
+	int ret = transfer_extent(fs, false, extent, stored);
+	if (ret == 0) {
+		const struct chunk_header *header = (const struct chunk_header *) stored;
+		int room = extent->length * fs->block_size - (int) sizeof(struct chunk_header);
+		if (header->length < 0 || header->length > room ||
+		    lz_decompress(stored + sizeof(struct chunk_header), header->length, data, blocks * fs->block_size) != bytes) {
+			fprintf(stderr, "chunk_read: corrupt chunk\n");
+			ret = -1;
+		}
+	}
+	free(stored);
+
+	return ret;
+}
+
+/* Make sure an inode has room for a decompressed chunk */
+static int chunk_buffer(struct fs_instance *fs, struct inode *inode) {
+	if (!inode->chunk_data && !(inode->chunk_data = malloc(CHUNK_SIZE))) {
+		fprintf(stderr, "chunk_buffer: failed to allocate\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* Decompress a chunk into the inode's chunk_data, unless it is there already */
+static int chunk_load(struct fs_instance *fs, struct inode *inode, int chunk) {
+	if (inode->chunk_index == chunk) {
+		return 0;
+	}
+	if (chunk_buffer(fs, inode) != 0) {
+		return -1;
+	}
+
+	inode->chunk_index = -1;
+	if (chunk_read(fs, inode, chunk, inode->chunk_data) != 0) {
+		return -1;
+	}
+	inode->chunk_index = chunk;
+
+	return 0;
+}
+
+/* Store the first bytes of the inode's chunk_data as one of its chunks, with the inode held exclusively
+ * The chunk is compressed if that saves a block, and rewritten in place if its extent is long enough,
+ * otherwise it moves to a new extent. chunk_data keeps the chunk unless this fails. */
+static int chunk_write(struct fs_instance *fs, struct inode *inode, int chunk, int bytes) {
+	int blocks = (bytes + fs->block_size - 1) / fs->block_size;
+	char *data = inode->chunk_data;
+
+	inode->chunk_index = -1;
+	memset(data + bytes, 0, blocks * fs->block_size - bytes);
+
+	char *stored = malloc(CHUNK_SIZE);
+	if (!stored) {
+		fprintf(stderr, "chunk_write: failed to allocate\n");
+		return -1;
+	}
+
+	/* Compressed, the chunk has to fit in a block less than it spans */
+	struct extent extent = {0, blocks};
+	const char *source = data;
+	int room = (blocks - 1) * fs->block_size - (int) sizeof(struct chunk_header);
+	int length = (room > 0) ? lz_compress(data, bytes, stored + sizeof(struct chunk_header), room) : -1;
+	if (length >= 0) {
+		int used = (int) sizeof(struct chunk_header) + length;
+		((struct chunk_header *) stored)->length = length;
+		extent.length = (used + fs->block_size - 1) / fs->block_size;
+		memset(stored + used, 0, extent.length * fs->block_size - used);
+		source = stored;
+	}
+
+	/* A chunk takes one extent, so a new one has to be a single run long enough for it */
+	struct extent *old = (chunk < inode->extent_count) ? &inode->extents[chunk] : NULL;
+	if (old && old->length >= extent.length) {
+		extent.start = old->start;
+	} else {
+		struct extent run = {0, 0};
+		int goal = (chunk > 0) ? inode->extents[chunk - 1].start + inode->extents[chunk - 1].length : -1;
+		if (allocate_extent(fs, goal, extent.length, &run) != 0 || run.length < extent.length) {
+			if (run.length > 0) {
+				free_extent(fs, run.start, run.length);
+			}
+			fprintf(stderr, "chunk_write: disk full\n");
+			free(stored);
+			return -1;
+		}
+		extent.start = run.start;
+	}
+
+	int ret = transfer_extent(fs, true, &extent, (char *) source);
+	free(stored);
+	if (ret != 0) {
+		fprintf(stderr, "chunk_write: failed to write blocks\n");
+		if (!old || extent.start != old->start) {
+			free_extent(fs, extent.start, extent.length);
+		}
+		return -1;
+	}
+
+	/* Give back the blocks the chunk no longer takes */
+	if (!old) {
+		if (inode_add_extent(fs, inode, extent.start, extent.length) != 0) {
+			free_extent(fs, extent.start, extent.length);
+			return -1;
+		}
+	} else {
+		if (extent.start == old->start) {
+			if (old->length > extent.length) {
+				free_extent(fs, old->start + extent.length, old->length - extent.length);
+			}
+		} else {
+			free_extent(fs, old->start, old->length);
+		}
+		*old = extent;
+		inode_changed(fs, inode, chunk);
+	}
+	inode->chunk_index = chunk;
+
+	return 0;
+}
+
+/* Read nbyte bytes of a compressed file starting at offset, with the inode held shared
+ * Whole chunks are decompressed straight into buf, parts of one go through the inode's chunk_data. */
+static int read_compressed(struct fs_instance *fs, int inode_index, char *buf, int nbyte, int offset) {
+	struct inode *inode = &fs->inode_table[inode_index];
+	int done = 0;
+
+	while (done < nbyte) {
+		int chunk = (offset + done) / CHUNK_SIZE;
+		int chunk_offset = (offset + done) % CHUNK_SIZE;
+		int bytes = chunk_bytes(fs, inode, chunk);
+		int length = (bytes - chunk_offset < nbyte - done) ? bytes - chunk_offset : nbyte - done;
+
+		/* buf only has room for whole blocks when the chunk ends on a block */
+		if (chunk_offset == 0 && length == bytes && bytes % fs->block_size == 0) {
+			if (chunk_read(fs, inode, chunk, buf + done) != 0) {
+				return -1;
+			}
+		} else {
+			pthread_mutex_lock(&inode->chunk_lock);
+			int ret = chunk_load(fs, inode, chunk);
+			if (ret == 0) {
+				memcpy(buf + done, inode->chunk_data + chunk_offset, length);
+			}
+			pthread_mutex_unlock(&inode->chunk_lock);
+			if (ret != 0) {
+				return -1;
+			}
+		}
+		done += length;
+	}
+
+	return 0;
+}
+
+/* Write nbyte bytes of a compressed file at offset, a chunk at a time, with the inode held exclusively
+ * Returns the bytes written, short of nbyte if the disk fills up, or -1 if none were */
+static int write_compressed(struct fs_instance *fs, int inode_index, const char *buf, int nbyte, int offset) {
+	struct inode *inode = &fs->inode_table[inode_index];
+	int done = 0;
+
+	while (done < nbyte) {
+		int chunk = (offset + done) / CHUNK_SIZE;
+		int chunk_offset = (offset + done) % CHUNK_SIZE;
+		int length = (CHUNK_SIZE - chunk_offset < nbyte - done) ? CHUNK_SIZE - chunk_offset : nbyte - done;
+		int bytes = (chunk < inode->extent_count) ? chunk_bytes(fs, inode, chunk) : 0;
+
+		/* The part of the chunk the write leaves alone is read in first */
+		int ret;
+		if (chunk_offset > 0 || chunk_offset + length < bytes) {
+			ret = chunk_load(fs, inode, chunk);
+		} else {
+			ret = chunk_buffer(fs, inode);
+		}
+		if (ret == 0) {
+			memcpy(inode->chunk_data + chunk_offset, buf + done, length);
+			ret = chunk_write(fs, inode, chunk, (chunk_offset + length > bytes) ? chunk_offset + length : bytes);
+		}
+		if (ret != 0) {
+			break;
+		}
+		done += length;
+
+		/* The file's size tells how much of the next chunk is in use */
+		if (offset + done > inode->file_size) {
+			inode->file_size = offset + done;
+			inode_changed(fs, inode, inode->extent_count);
+		}
+	}
+
+	return (done > 0) ? done : -1;
+}
+
+/* Free the chunks of a compressed file past length bytes, with the inode held exclusively
+ * What is left of the new last chunk is stored again on its own. */
+static int truncate_compressed(struct fs_instance *fs, struct inode *inode, int length) {
+	int chunks = length / CHUNK_SIZE;
+
+	if (length % CHUNK_SIZE != 0) {
+		if (chunk_load(fs, inode, chunks) != 0 || chunk_write(fs, inode, chunks, length % CHUNK_SIZE) != 0) {
+			return -1;
+		}
+		chunks++;
+	}
+	if (inode->chunk_index >= chunks) {
+		inode->chunk_index = -1;
+	}
+
+	int keep = 0;
+	for (int i = 0; i < chunks; i++) {
+		keep += inode->extents[i].length;
+	}
+	inode_trim(fs, inode, keep);
+
+	return 0;
+}
+
+/* Add the blocks a write filled whole, from byte from to byte to of the file, to the dedup index,
+ * buf holding the data written at offset */
+static void dedup_index(struct fs_instance *fs, const struct inode *inode, const char *buf, int offset, int from, int to) {
+	int blocks[VECTOR_BLOCKS];
+	int first = (from + fs->block_size - 1) / fs->block_size;
+	int end = to / fs->block_size;
+
+	for (int base = first; base < end; base += VECTOR_BLOCKS) {
+		int batch = (end - base < VECTOR_BLOCKS) ? end - base : VECTOR_BLOCKS;
+		uint64_t hashes[batch];
+		map_blocks(inode, base, batch, blocks);
+		for (int i = 0; i < batch; i++) {
+			hashes[i] = block_hash(buf + (size_t) (base + i) * fs->block_size - offset, fs->block_size);
+		}
+		pthread_mutex_lock(&fs->alloc_lock);
+		for (int i = 0; i < batch; i++) {
+			dedup_insert(fs, blocks[i], hashes[i]);
+		}
+		pthread_mutex_unlock(&fs->alloc_lock);
+	}
+}
+
+/* Give a file a copy of its own of one block it shares, at disk block goal if that is free
+ * The contents are only copied if copy is set, otherwise the caller overwrites them whole. */
+static int unshare_block(struct fs_instance *fs, struct inode *inode, int file_block, int block, bool copy, int *goal) {
+	struct extent extent;
+	if (allocate_extent(fs, *goal, 1, &extent) != 0) {
+		return -1;
+	}
+
+	if (copy) {
+		char data[fs->block_size];
+		if (cache_read(fs->cache, block, data) != 0 || cache_write(fs->cache, extent.start, data) != 0) {
+			free_extent(fs, extent.start, 1);
+			return -1;
+		}
+	}
+	if (inode_remap(fs, inode, file_block, extent.start, 1) != 0) {
+		free_extent(fs, extent.start, 1);
+		return -1;
+	}
+	free_extent(fs, block, 1);
+	*goal = extent.start + 1;
+
+	return 0;
+}
+
+/* Ready count blocks of a file from file_block on to be overwritten by a write of nbyte bytes at offset,
+ * with the inode held exclusively: blocks other files share are replaced by copies of the file's own,
+ * and the others leave the dedup index as their contents are about to change
+ * Returns how many blocks are ready, short of count if the disk is full. Only needed once dedup_used is set. */
+static int unshare_blocks(struct fs_instance *fs, struct inode *inode, int file_block, int count, int offset, int nbyte) {
+	int blocks[VECTOR_BLOCKS];
+	int goal = -1;
+
+	for (int base = 0; base < count; base += VECTOR_BLOCKS) {
+		int batch = (count - base < VECTOR_BLOCKS) ? count - base : VECTOR_BLOCKS;
+		map_blocks(inode, file_block + base, batch, blocks);
+		for (int i = 0; i < batch; i++) {
+			pthread_mutex_lock(&fs->alloc_lock);
+			bool shared = fs->share_table[blocks[i]] > 0;
+			if (!shared) {
+				dedup_remove(fs, blocks[i]);
+			}
+			pthread_mutex_unlock(&fs->alloc_lock);
+
+			/* Blocks the write covers whole need not be copied */
+			long start = (long) (file_block + base + i) * fs->block_size;
+			bool whole = start >= offset && start + fs->block_size <= (long) offset + nbyte;
+			if (shared && unshare_block(fs, inode, file_block + base + i, blocks[i], !whole, &goal) != 0) {
+				return base + i;
+			}
+		}
+	}
+
+	return count;
+}
+
+/* Write nbyte bytes of a file that dedups at offset, with the inode held exclusively
+ * Blocks the file has are overwritten in place, new blocks the write fills whole share a block
+ * already holding the same data if there is one, and the rest are allocated as usual.
+ * Returns the bytes written, short of nbyte if the disk fills up, or -1. */
+static int write_dedup(struct fs_instance *fs, int inode_index, const char *buf, int nbyte, int offset) {
+	struct inode *inode = &fs->inode_table[inode_index];
+	int end = offset + nbyte;
+	int have = inode_blocks(inode);
+	int done = 0;
+
+	/* The file has no holes, so what it holds is overwritten and the rest is new, from a block start */
+	long held = (long) have * fs->block_size;
+	if (held > offset) {
+		done = (held < end) ? held - offset : nbyte;
+		if (write_range(fs, inode_index, buf, done, offset) != 0) {
+			return -1;
+		}
+		dedup_index(fs, inode, buf, offset, offset, offset + done);
+	}
+
+	while (done < nbyte) {
+		/* Gather the blocks up to the next one already on disk */
+		int run = 0;
+		int shared = -1;
+		while (done + run * fs->block_size < nbyte) {
+			if (nbyte - done - run * fs->block_size >= fs->block_size &&
+			    (shared = dedup_share(fs, buf + done + run * fs->block_size)) != -1) {
+				break;
+			}
+			run++;
+		}
+
+		/* Allocate and write those, as much of them as fits */
+		if (run > 0) {
+			int first = (offset + done) / fs->block_size;
+			int length = run * fs->block_size;
+			if (length > nbyte - done) {
+				length = nbyte - done;
+			}
+			int got = inode_grow(fs, inode, first + run) - first;
+			if (got < run) {
+				length = got * fs->block_size;
+			}
+			if (length > 0) {
+				if (write_range(fs, inode_index, buf + done, length, offset + done) != 0) {
+					if (shared != -1) {
+						free_extent(fs, shared, 1);
+					}
+					return -1;
+				}
+				dedup_index(fs, inode, buf, offset, offset + done, offset + done + length);
+				done += length;
+			}
+			if (got < run) {
+				if (shared != -1) {
+					free_extent(fs, shared, 1);
+				}
+				break;
+			}
+		}
+
+		/* Then take the shared block on */
+		if (shared != -1) {
+			if (inode_append(fs, inode, shared, 1) != 0) {
+				free_extent(fs, shared, 1);
+				break;
+			}
+			done += fs->block_size;
+		}
+	}
+
+	return done;
+}
+
+/* Read up to nbyte bytes from offset on, stopping at the end of the file, with the inode held shared */
+static int read_file(struct fs_instance *fs, int inode_index, void *buf, size_t nbyte, off_t offset) {
+	int file_size = fs->inode_table[inode_index].file_size;
+
+	/* Check reading boundaries */
+	if (offset >= file_size) {
+		return 0;
+	}
+	if (offset + nbyte > file_size) {
+		nbyte = file_size - offset;
+	}
+	if (nbyte == 0) {
+		return 0;
+	}
+
+	int ret = 0;
+	if (fs->inode_table[inode_index].flags & INODE_INLINE) {
+		memcpy(buf, fs->inode_table[inode_index].inline_data + offset, nbyte);
+	} else if (fs->inode_table[inode_index].flags & INODE_COMPRESSED) {
+		ret = read_compressed(fs, inode_index, buf, nbyte, offset);
+	} else {
+		ret = read_range(fs, inode_index, buf, nbyte, offset);
+	}
+	if (ret != 0) {
+		fprintf(stderr, "read_file: failed to read blocks\n");
+		return -1;
+	}
+
+	return nbyte;
+}
+
+/* Follow a descriptor's reads, and once they run sequentially start reading the
+ * blocks after this one in the background, with the inode held shared and the descriptor's lock held */
+static void read_ahead(struct fs_instance *fs, int fildes, int inode_index, int offset, int nbyte) {
+	struct file_descriptor *descriptor = &fs->file_descriptors[fildes];
+	int first = offset / fs->block_size;
+
+	/* Compressed files are read a whole chunk at a time, which is readahead enough,
+	 * and inline ones are in memory already */
+	if (fs->inode_table[inode_index].flags & (INODE_COMPRESSED | INODE_INLINE)) {
+		return;
+	}
+	int end = (offset + nbyte + fs->block_size - 1) / fs->block_size;
+
+	/* Random reads reset the window and pay nothing more */
+	bool sequential = first == descriptor->readahead_next;
+	descriptor->readahead_next = (offset + nbyte) / fs->block_size;
+	if (!sequential) {
+		descriptor->readahead_window = 0;
+		descriptor->readahead_end = 0;
+		return;
+	}
+	if (descriptor->readahead_window == 0) {
+		descriptor->readahead_window = READAHEAD_MIN;
+	} else if (descriptor->readahead_window * 2 <= READAHEAD_MAX / fs->block_size) {
+		descriptor->readahead_window *= 2;
+	}
+
+	/* Top the window up once half of it has been read, in one batch */
+	int window = descriptor->readahead_window;
+	if (descriptor->readahead_end - end >= window / 2) {
+		return;
+	}
+	int start = (descriptor->readahead_end > end) ? descriptor->readahead_end : end;
+	int stop = end + window;
+	int file_blocks = (fs->inode_table[inode_index].file_size + fs->block_size - 1) / fs->block_size;
+	if (stop > file_blocks) {
+		stop = file_blocks;
+	}
+	if (start >= stop) {
+		return;
+	}
+
+	int blocks[stop - start];
+	map_blocks(&fs->inode_table[inode_index], start, stop - start, blocks);
+	cache_prefetch(fs->cache, stop - start, blocks);
+	descriptor->readahead_end = stop;
+}
+
+/* Read from a file */
+static int op_read(struct fs_instance *fs, int fildes, void *buf, size_t nbyte) {
+	/* Check that disk is mounted */
+	if (fs == NULL) {
+		fprintf(stderr, "fs_read: disk not mounted\n");
+		return -1;
+	}
+
+	/* Check fildes bounds and existance */
+	int inode_index = fd_inode(fs, fildes);
+	if (inode_index == -1) {
+		fprintf(stderr, "fs_read: file not found\n");
+		return -1;
+	}
+
+	/* Readers of the file share its lock, reads through one descriptor take turns */
+	struct inode *inode = &fs->inode_table[inode_index];
+	struct file_descriptor *descriptor = &fs->file_descriptors[fildes];
+	pthread_rwlock_rdlock(&inode->lock);
+	pthread_mutex_lock(&descriptor->lock);
+	int ret = read_file(fs, inode_index, buf, nbyte, descriptor->file_pointer);
+
+	/* Adjust file pointer, reading ahead of it if reads are sequential */
+	if (ret > 0) {
+		read_ahead(fs, fildes, inode_index, descriptor->file_pointer, ret);
+		descriptor->file_pointer += ret;
+	}
+	pthread_mutex_unlock(&descriptor->lock);
+	pthread_rwlock_unlock(&inode->lock);
+
+	return ret;
+}
+
+/* Read from a file at offset, leaving the file pointer alone */
+static int op_pread(struct fs_instance *fs, int fildes, void *buf, size_t nbyte, off_t offset) {
+	/* Check that disk is mounted */
+	if (fs == NULL) {
+		fprintf(stderr, "fs_pread: disk not mounted\n");
+		return -1;
+	}
+
+	/* Check fildes bounds and existance */
+	int inode_index = fd_inode(fs, fildes);
+	if (inode_index == -1) {
+		fprintf(stderr, "fs_pread: file not found\n");
+		return -1;
+	}
+	if (offset < 0) {
+		fprintf(stderr, "fs_pread: offset out of bounds\n");
+		return -1;
+	}
+
+	/* Nothing of the descriptor changes, so threads may share it */
+	pthread_rwlock_rdlock(&fs->inode_table[inode_index].lock);
+	int ret = read_file(fs, inode_index, buf, nbyte, offset);
+	pthread_rwlock_unlock(&fs->inode_table[inode_index].lock);
+
+	return ret;
+}
+
+/* Write nbyte bytes of a file kept in data blocks at offset, growing it as needed, with fs_lock held shared
+ * and the inode exclusively. Returns the bytes written, short of nbyte if the disk fills up, or -1 if none were. */
+static int write_blocks(struct fs_instance *fs, int inode_index, const void *buf, size_t nbyte, off_t offset) {
+	struct inode *inode = &fs->inode_table[inode_index];
+
+	/* Compressed files are written a chunk at a time, each in an extent of its own */
+	if (inode->flags & INODE_COMPRESSED) {
+		return write_compressed(fs, inode_index, buf, nbyte, offset);
+	}
+
+	/* Get range of file blocks covered by the write */
+	int file_offset = offset % fs->block_size;
+	int file_block = offset / fs->block_size;
+	int block_count = (file_offset + nbyte + fs->block_size - 1) / fs->block_size;
+
+	/* Blocks the file holds are overwritten in place, so shared ones need copies first */
+	if (__atomic_load_n(&fs->dedup_used, __ATOMIC_ACQUIRE)) {
+		int held = inode_blocks(inode) - file_block;
+		if (held > block_count) {
+			held = block_count;
+		}
+		int ready = (held > 0) ? unshare_blocks(fs, inode, file_block, held, offset, nbyte) : 0;
+		if (ready < held) {
+			if (ready == 0) {
+				fprintf(stderr, "write_file: disk full\n");
+				return -1;
+			}
+			block_count = ready;
+			nbyte = block_count * fs->block_size - file_offset;
+		}
+	}
+
+	if (inode->flags & INODE_DEDUP) {
+		int written = write_dedup(fs, inode_index, buf, nbyte, offset);
+		if (written <= 0) {
+			fprintf(stderr, (written == 0) ? "write_file: disk full\n" : "write_file: failed to write blocks\n");
+			return -1;
+		}
+		nbyte = written;
+	} else {
+		/* Files have no holes, so only blocks past the current last block are missing */
+		int need = file_block + block_count;
+		int have = inode_grow(fs, inode, need);
+
+		/* Write only what fits */
+		if (have < need) {
+			if (have <= file_block) {
+				fprintf(stderr, "write_file: disk full\n");
+				return -1;
+			}
+			block_count = have - file_block;
+			nbyte = block_count * fs->block_size - file_offset;
+		}
+
+		if (write_range(fs, inode_index, buf, nbyte, offset) != 0) {
+			fprintf(stderr, "write_file: failed to write blocks\n");
+			return -1;
+		}
+	}
+
+	/* Update file size */
+	if (offset + nbyte > inode->file_size) {
+		inode->file_size = offset + nbyte;
+		inode_changed(fs, inode, inode->extent_count);
+	}
+
+	return nbyte;
+}
+
+/* Write nbyte bytes at offset of a file kept in its inode, or of an empty file which then is */
+static int write_inline(struct fs_instance *fs, struct inode *inode, const char *buf, int nbyte, int offset) {
+	if (!inode->inline_data) {
+		inode->inline_data = calloc(1, INLINE_DATA);
+		if (!inode->inline_data) {
+			fprintf(stderr, "write_file: failed to allocate\n");
+			return -1;
+		}
+		inode->flags |= INODE_INLINE;
+	}
+
+	memcpy(inode->inline_data + offset, buf, nbyte);
+	if (offset + nbyte > inode->file_size) {
+		inode->file_size = offset + nbyte;
+	}
+	inode_changed(fs, inode, 0);
+
+	return nbyte;
+}
+
+/* Move the contents of a file kept in its inode out to data blocks, which it is stored in from then on */
+static int inline_migrate(struct fs_instance *fs, int inode_index) {
+	struct inode *inode = &fs->inode_table[inode_index];
+	char *data = inode->inline_data;
+	int size = inode->file_size;
+
+	/* Written out as an empty file of the same kind would be */
+	inode->inline_data = NULL;
+	inode->flags &= ~INODE_INLINE;
+	inode->file_size = 0;
+	if (write_blocks(fs, inode_index, data, size, 0) != size) {
+		/* Whatever blocks it got go back, and it stays in the inode */
+		inode_trim(fs, inode, 0);
+		inode->chunk_index = -1;
+		inode->inline_data = data;
+		inode->flags |= INODE_INLINE;
+		inode->file_size = size;
+		inode_changed(fs, inode, 0);
+		return -1;
+	}
+	free(data);
+
+	return 0;
+}
+
+/* Write nbyte bytes at offset, growing the file as needed, with fs_lock held shared and the inode exclusively
+ * The write may start at the end of the file but not past it, files have no holes. */
+static int write_file(struct fs_instance *fs, int inode_index, const void *buf, size_t nbyte, off_t offset) {
+	struct inode *inode = &fs->inode_table[inode_index];
+
+	if (offset < 0 || offset > inode->file_size) {
+		fprintf(stderr, "write_file: offset out of bounds\n");
+		return -1;
+	}
+
+	/* Check for write overflow and correct */
+	if (offset + nbyte > MAX_FILE_SIZE) {
+		if (offset >= MAX_FILE_SIZE) {
+			fprintf(stderr, "write_file: file size exceeded\n");
+			return -1;
+		}
+		nbyte = MAX_FILE_SIZE - offset;
+	}
+	if (nbyte == 0) {
+		return 0;
+	}
+
+	/* Small files are kept in the inode until a write takes them past INLINE_DATA,
+	 * a file without blocks is empty */
+	if (offset + nbyte <= INLINE_DATA && ((inode->flags & INODE_INLINE) || inode->extent_count == 0)) {
+		return write_inline(fs, inode, buf, nbyte, offset);
+	}
+	if ((inode->flags & INODE_INLINE) && inline_migrate(fs, inode_index) != 0) {
+		fprintf(stderr, "write_file: disk full\n");
+		return -1;
+	}
+
+	return write_blocks(fs, inode_index, buf, nbyte, offset);
+}
+
+/* Write to a file */
+static int op_write(struct fs_instance *fs, int fildes, void *buf, size_t nbyte) {
+	/* Check that disk is mounted */
+	if (fs == NULL) {
+		fprintf(stderr, "fs_write: disk not mounted\n");
+		return -1;
+	}
+
+	/* Commit the changes of earlier operations once there are enough of them */
+	log_batch(fs);
+
+	/* Check file descriptors bounds and existence */
+	int inode_index = fd_inode(fs, fildes);
+	if (inode_index == -1) {
+		fprintf(stderr, "fs_write: file not found\n");
+		return -1;
+	}
+
+	pthread_rwlock_rdlock(&fs->fs_lock);
+	pthread_rwlock_wrlock(&fs->inode_table[inode_index].lock);
+	int ret = write_file(fs, inode_index, buf, nbyte, fs->file_descriptors[fildes].file_pointer);
+
+	/* Increment file pointer */
+	if (ret > 0) {
+		fs->file_descriptors[fildes].file_pointer += ret;
+	}
+	pthread_rwlock_unlock(&fs->inode_table[inode_index].lock);
+	pthread_rwlock_unlock(&fs->fs_lock);
+
+	return ret;
+}
+
+/* Write to a file at offset, leaving the file pointer alone */
+static int op_pwrite(struct fs_instance *fs, int fildes, void *buf, size_t nbyte, off_t offset) {
+	/* Check that disk is mounted */
+	if (fs == NULL) {
+		fprintf(stderr, "fs_pwrite: disk not mounted\n");
+		return -1;
+	}
+
+	/* Commit the changes of earlier operations once there are enough of them */
+	log_batch(fs);
+
+	/* Check file descriptors bounds and existence */
+	int inode_index = fd_inode(fs, fildes);
+	if (inode_index == -1) {
+		fprintf(stderr, "fs_pwrite: file not found\n");
+		return -1;
+	}
+
+	pthread_rwlock_rdlock(&fs->fs_lock);
+	pthread_rwlock_wrlock(&fs->inode_table[inode_index].lock);
+	int ret = write_file(fs, inode_index, buf, nbyte, offset);
+	pthread_rwlock_unlock(&fs->inode_table[inode_index].lock);
+	pthread_rwlock_unlock(&fs->fs_lock);
+
+	return ret;
+}
+
+static int op_get_filesize(struct fs_instance *fs, int fildes) {
+	/* Check that file descriptor is set to file */
+	int inode_index = fd_inode(fs, fildes);
+	if (inode_index == -1) {
+		fprintf(stderr, "fs_get_filesize: file not found\n");
+		return -1;
+	}
+
+	/* Return size of file */
+	pthread_rwlock_rdlock(&fs->inode_table[inode_index].lock);
+	int size = fs->inode_table[inode_index].file_size;
+	pthread_rwlock_unlock(&fs->inode_table[inode_index].lock);
+
+	return size;
+}
+
+/* Order directory entries by inode, so files are listed in the order they were created */
+static int compare_entries(const void *a, const void *b) {
+	return ((const struct directory_file *) a)->inode_index - ((const struct directory_file *) b)->inode_index;
+}
+
+static int op_listfiles(struct fs_instance *fs, char ***files) {
+	/* Check that disk is mounted */
+	if (fs == NULL) {
+		fprintf(stderr, "fs_listfiles: disk not mounted\n");
+		return -1;
+	}
+
+	pthread_rwlock_rdlock(&fs->dir_lock);
+	struct inode *directory = inode_get(fs, DIRECTORY_INODE);
+	if (directory == NULL) {
+		pthread_rwlock_unlock(&fs->dir_lock);
+		return -1;
+	}
+
+	/* Gather the used entries of every bucket */
+	int buckets = directory->file_size / fs->block_size;
+	struct directory_file *found = malloc(sizeof(struct directory_file) * ((size_t) buckets * DIRECTORY_ENTRIES + 1));
+	char block[fs->block_size];
+	const struct directory_file *entries = (const struct directory_file *) block;
+	int count = 0;
+	for (int bucket = 0; bucket < buckets; bucket++) {
+		int disk_block;
+		map_blocks(directory, bucket, 1, &disk_block);
+		if (cache_read(fs->cache, disk_block, block) != 0) {
+			fprintf(stderr, "fs_listfiles: cannot read directory\n");
+			pthread_rwlock_unlock(&fs->dir_lock);
+			free(found);
+			return -1;
+		}
+		for (int i = 0; i < DIRECTORY_ENTRIES; i++) {
+			if (entries[i].name[0] != '\0') {
+				found[count++] = entries[i];
+			}
+		}
+	}
+	pthread_rwlock_unlock(&fs->dir_lock);
+	qsort(found, count, sizeof(struct directory_file), compare_entries);
+
+	/* Loop through directory and find file names */
+	*files = (char **) malloc((count + 1) * sizeof(char *));
+	for (int i = 0; i < count; i++) {
+		(*files)[i] = (char *) malloc(sizeof(found[i].name));
+		strcpy((*files)[i], found[i].name);
+	}
+
+	/* Set last name to NULL */
+	(*files)[count] = NULL;
+	free(found);
+	return 0;
+}
+
+/* Seek to a specific offset in a file */
+static int op_lseek(struct fs_instance *fs, int fildes, off_t offset) {
+	/* Check file descriptor bounds and existance */
+	int inode_index = fd_inode(fs, fildes);
+	if (inode_index == -1) {
+		fprintf(stderr, "fs_lseek: file not found\n");
+		return -1;
+	}
+
+	/* Check offset bounds */
+	struct inode *inode = &fs->inode_table[inode_index];
+	pthread_rwlock_rdlock(&inode->lock);
+	if ((offset < 0) || (offset > (inode->file_size - 1))) {
+		fprintf(stderr, "fs_lseek: offset out of bounds\n");
+		pthread_rwlock_unlock(&inode->lock);
+		return -1;
+	}
+
+	/* Set file offset */
+	pthread_mutex_lock(&fs->file_descriptors[fildes].lock);
+	fs->file_descriptors[fildes].file_pointer = offset;
+	pthread_mutex_unlock(&fs->file_descriptors[fildes].lock);
+	pthread_rwlock_unlock(&inode->lock);
+	return 0;
+}
+
+/* Cut a file down to length bytes, with fs_lock held shared and the inode exclusively */
+static int truncate_file(struct fs_instance *fs, int inode_index, off_t length) {
+	struct inode *inode = &fs->inode_table[inode_index];
+
+	/* Check that truncation length is within the file */
+	if ((length < 0) || (length > inode->file_size)) {
+		fprintf(stderr, "fs_truncate: trunaction length out of bounds\n");
+		return -1;
+	}
+
+	if (inode->flags & INODE_INLINE) {
+		/* Inline files keep the rest of their room zeroed, an empty one holds nothing */
+		memset(inode->inline_data + length, 0, INLINE_DATA - length);
+		if (length == 0) {
+			free(inode->inline_data);
+			inode->inline_data = NULL;
+			inode->flags &= ~INODE_INLINE;
+		}
+	} else if (inode->flags & INODE_COMPRESSED) {
+		/* Compressed files are cut a chunk at a time */
+		if (truncate_compressed(fs, inode, length) != 0) {
+			fprintf(stderr, "fs_truncate: failed to write chunk\n");
+			return -1;
+		}
+	} else {
+		/* Set the rest of the new last block to 0, in a copy of its own if it is shared */
+		int last_block_offset = length % fs->block_size;
+		if (last_block_offset != 0) {
+			if (__atomic_load_n(&fs->dedup_used, __ATOMIC_ACQUIRE) && unshare_blocks(fs, inode, length / fs->block_size, 1, length, 0) != 1) {
+				fprintf(stderr, "fs_truncate: disk full\n");
+				return -1;
+			}
+			char block[fs->block_size];
+			int disk_block;
+			map_blocks(inode, length / fs->block_size, 1, &disk_block);
+			if (cache_read(fs->cache, disk_block, block) != 0) {
+				fprintf(stderr, "fs_truncate: failed to read block\n");
+				return -1;
+			}
+			memset(block + last_block_offset, 0, fs->block_size - last_block_offset);
+			cache_write(fs->cache, disk_block, block);
+		}
+
+		/* Free the blocks past the new end of file */
+		inode_trim(fs, inode, (length + fs->block_size - 1) / fs->block_size);
+	}
+
+	/* Update file size */
+	inode->file_size = length;
+	inode_changed(fs, inode, inode->extent_count);
+
+	/* Keep file pointers inside the file */
+	pthread_mutex_lock(&fs->fd_lock);
+	for (int i = 0; i < MAX_FILE_DESCRIPTORS; i++) {
+		if (fs->file_descriptors[i].inode_index == inode_index && fs->file_descriptors[i].file_pointer > length) {
+			fs->file_descriptors[i].file_pointer = length;
+		}
+	}
+	pthread_mutex_unlock(&fs->fd_lock);
+
+	return 0;
+}
+
+/* Truncate a file to a specific length */
+static int op_truncate(struct fs_instance *fs, int fildes, off_t length) {
+	/* Check that disk is mounted */
+	if (fs == NULL) {
+		fprintf(stderr, "fs_truncate: disk not mounted\n");
+		return -1;
+	}
+
+	/* Commit the changes of earlier operations once there are enough of them */
+	log_batch(fs);
+
+	/* Check file descriptor bounds and existance */
+	int inode_index = fd_inode(fs, fildes);
+	if (inode_index == -1) {
+		fprintf(stderr, "fs_truncate: file not found\n");
+		return -1;
+	}
+
+	pthread_rwlock_rdlock(&fs->fs_lock);
+	pthread_rwlock_wrlock(&fs->inode_table[inode_index].lock);
+	int ret = truncate_file(fs, inode_index, length);
+	pthread_rwlock_unlock(&fs->inode_table[inode_index].lock);
+	pthread_rwlock_unlock(&fs->fs_lock);
+
+	return ret;
+}
+
+/* Readahead window of a descriptor, with the blocks read ahead since mount and those reads used */
+int fsi_get_readahead(struct fs_instance *fs, int fildes, struct fs_readahead *readahead) {
+	/* Check file descriptor bounds and existance */
+	int inode_index = fd_inode(fs, fildes);
+	if (inode_index == -1) {
+		fprintf(stderr, "fs_get_readahead: file not found\n");
+		return -1;
+	}
+
+	struct cache_stats stats;
+	cache_get_stats(fs->cache, &stats);
+	pthread_rwlock_rdlock(&fs->inode_table[inode_index].lock);
+	pthread_mutex_lock(&fs->file_descriptors[fildes].lock);
+	readahead->window = fs->file_descriptors[fildes].readahead_window * fs->block_size;
+	pthread_mutex_unlock(&fs->file_descriptors[fildes].lock);
+	pthread_rwlock_unlock(&fs->inode_table[inode_index].lock);
+	readahead->prefetched = stats.prefetched;
+	readahead->hits = stats.prefetch_hits;
+
+	return 0;
+}
+
+/* Number of extents a file's blocks are split into */
+int fsi_get_extent_count(struct fs_instance *fs, int fildes) {
+	/* Check file descriptor bounds and existance */
+	int inode_index = fd_inode(fs, fildes);
+	if (inode_index == -1) {
+		fprintf(stderr, "fs_get_extent_count: file not found\n");
+		return -1;
+	}
+
+	pthread_rwlock_rdlock(&fs->inode_table[inode_index].lock);
+	int count = fs->inode_table[inode_index].extent_count;
+	pthread_rwlock_unlock(&fs->inode_table[inode_index].lock);
+
+	return count;
+}
+
+/* Store a file's contents compressed or not, which can only change while the file is empty */
+int fsi_set_compression(struct fs_instance *fs, int fildes, int enabled) {
+	/* Check that disk is mounted */
+	if (fs == NULL) {
+		fprintf(stderr, "fs_set_compression: disk not mounted\n");
+		return -1;
+	}
+
+	/* Commit the changes of earlier operations once there are enough of them */
+	log_batch(fs);
+
+	/* Check file descriptor bounds and existance */
+	int inode_index = fd_inode(fs, fildes);
+	if (inode_index == -1) {
+		fprintf(stderr, "fs_set_compression: file not found\n");
+		return -1;
+	}
+
+	pthread_rwlock_rdlock(&fs->fs_lock);
+	struct inode *inode = &fs->inode_table[inode_index];
+	pthread_rwlock_wrlock(&inode->lock);
+	int ret = 0;
+	if (inode->file_size > 0) {
+		fprintf(stderr, "fs_set_compression: file not empty\n");
+		ret = -1;
+	} else if (inode->flags & INODE_DEDUP) {
+		fprintf(stderr, "fs_set_compression: file dedups\n");
+		ret = -1;
+	} else {
+		inode->flags = enabled ? (inode->flags | INODE_COMPRESSED) : (inode->flags & ~INODE_COMPRESSED);
+		inode_changed(fs, inode, inode->extent_count);
+	}
+	pthread_rwlock_unlock(&inode->lock);
+	pthread_rwlock_unlock(&fs->fs_lock);
+
+	return ret;
+}
+
+/* Have a file's new blocks share disk blocks already holding the same data, or stop doing so,
+ * blocks it shares already stay shared until they are overwritten */
+int fsi_set_dedup(struct fs_instance *fs, int fildes, int enabled) {
+	/* Check that disk is mounted */
+	if (fs == NULL) {
+		fprintf(stderr, "fs_set_dedup: disk not mounted\n");
+		return -1;
+	}
+
+	/* Commit the changes of earlier operations once there are enough of them */
+	log_batch(fs);
+
+	/* Check file descriptor bounds and existance */
+	int inode_index = fd_inode(fs, fildes);
+	if (inode_index == -1) {
+		fprintf(stderr, "fs_set_dedup: file not found\n");
+		return -1;
+	}
+
+	pthread_rwlock_rdlock(&fs->fs_lock);
+	struct inode *inode = &fs->inode_table[inode_index];
+	pthread_rwlock_wrlock(&inode->lock);
+	int ret = 0;
+	if (inode->flags & INODE_COMPRESSED) {
+		fprintf(stderr, "fs_set_dedup: file is compressed\n");
+		ret = -1;
+	} else {
+		inode->flags = enabled ? (inode->flags | INODE_DEDUP) : (inode->flags & ~INODE_DEDUP);
+		inode_changed(fs, inode, inode->extent_count);
+	}
+	pthread_rwlock_unlock(&inode->lock);
+	pthread_rwlock_unlock(&fs->fs_lock);
+
+	return ret;
+}
+
+/* Make everything written so far durable, concurrent callers share one commit */
+static int op_sync(struct fs_instance *fs) {
+	if (fs == NULL) {
+		fprintf(stderr, "fs_sync: disk not mounted\n");
+		return -1;
+	}
+
+	pthread_mutex_lock(&fs->sync_lock);
+	unsigned long ticket = ++fs->sync_requested;
+	while (fs->sync_committed < ticket) {
+		/* Wait for the running commit, it may have started before this request */
+		if (fs->sync_running) {
+			pthread_cond_wait(&fs->sync_done, &fs->sync_lock);
+			continue;
+		}
+
+		/* Lead a commit covering every request made so far */
+		unsigned long covered = fs->sync_requested;
+		fs->sync_running = true;
+		pthread_mutex_unlock(&fs->sync_lock);
+		pthread_rwlock_wrlock(&fs->fs_lock);
+		int status = log_commit(fs);
+		pthread_rwlock_unlock(&fs->fs_lock);
+		pthread_mutex_lock(&fs->sync_lock);
+		fs->sync_running = false;
+		fs->sync_committed = covered;
+		fs->sync_status = status;
+		pthread_cond_broadcast(&fs->sync_done);
+	}
+	int ret = fs->sync_status;
+	pthread_mutex_unlock(&fs->sync_lock);
+
+	return ret;
+}
+
+/* Shard of the calling thread, made on its first call, NULL if there is no memory for it */
+static struct stats_shard *stats_shard(struct fs_instance *fs) {
+	if (shard_owner == fs->stats_id) {
+		return shard_cache;
+	}
+
+	/* The thread may have used this instance before, between uses of others */
+	struct stats_shard *shard = __atomic_load_n(&fs->stats_shards, __ATOMIC_ACQUIRE);
+	while (shard && shard->thread != &thread_key) {
+		shard = shard->next;
+	}
+	if (!shard) {
+		shard = calloc(1, sizeof(struct stats_shard));
+		if (!shard) {
+			return NULL;
+		}
+		shard->thread = &thread_key;
+		pthread_mutex_lock(&fs->stats_lock);
+		shard->next = fs->stats_shards;
+		__atomic_store_n(&fs->stats_shards, shard, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&fs->stats_lock);
+	}
+
+	shard_owner = fs->stats_id;
+	shard_cache = shard;
+
+	return shard;
+}
+
+/* Add to a counter of the thread's own shard, others only ever read it */
+static void stats_add(unsigned long *counter, unsigned long value) {
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+static unsigned long stats_clock() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Start time of a call picked to be timed, 0 for the others
+ * Reading the clock costs about as much as a cached read, so only a sample is timed. */
+static unsigned long stats_start() {
+	sample_state ^= sample_state << 13;
+	sample_state ^= sample_state >> 17;
+	sample_state ^= sample_state << 5;
+
+	return (sample_state % FS_STATS_SAMPLE == 0) ? stats_clock() : 0;
+}
+
+/* Count a call that returned ret, and its time if it started at start */
+static void stats_record(struct fs_instance *fs, enum fs_op op, unsigned long start, int ret) {
+	if (fs == NULL) {
+		return;
+	}
+
+	struct stats_shard *shard = stats_shard(fs);
+	if (!shard) {
+		return;
+	}
+
+	struct fs_op_stats *op_stats = &shard->stats.ops[op];
+	stats_add(&op_stats->calls, 1);
+	if (ret == -1) {
+		stats_add(&op_stats->errors, 1);
+	}
+	if (start != 0) {
+		unsigned long elapsed = stats_clock() - start;
+		stats_add(&op_stats->timed, 1);
+		stats_add(&op_stats->nanoseconds, elapsed);
+		stats_add(&op_stats->latency[histogram_bucket(elapsed)], 1);
+	}
+
+	if (ret > 0 && (op == FS_OP_READ || op == FS_OP_PREAD)) {
+		stats_add(&shard->stats.bytes_read, ret);
+	} else if (ret > 0 && (op == FS_OP_WRITE || op == FS_OP_PWRITE)) {
+		stats_add(&shard->stats.bytes_written, ret);
+	}
+}
+
+/* Counters since mount, summed over the threads that made calls */
+int fsi_stats(struct fs_instance *fs, struct fs_stats *stats) {
+	if (fs == NULL) {
+		fprintf(stderr, "fs_stats: disk not mounted\n");
+		return -1;
+	}
+
+	memset(stats, 0, sizeof(struct fs_stats));
+	struct stats_shard *shard = __atomic_load_n(&fs->stats_shards, __ATOMIC_ACQUIRE);
+	for (; shard; shard = shard->next) {
+		for (int op = 0; op < FS_OP_COUNT; op++) {
+			struct fs_op_stats *from = &shard->stats.ops[op];
+			struct fs_op_stats *to = &stats->ops[op];
+			to->calls += __atomic_load_n(&from->calls, __ATOMIC_RELAXED);
+			to->errors += __atomic_load_n(&from->errors, __ATOMIC_RELAXED);
+			to->timed += __atomic_load_n(&from->timed, __ATOMIC_RELAXED);
+			to->nanoseconds += __atomic_load_n(&from->nanoseconds, __ATOMIC_RELAXED);
+			for (int i = 0; i < FS_HISTOGRAM_BUCKETS; i++) {
+				to->latency[i] += __atomic_load_n(&from->latency[i], __ATOMIC_RELAXED);
+			}
+		}
+		stats->bytes_read += __atomic_load_n(&shard->stats.bytes_read, __ATOMIC_RELAXED);
+		stats->bytes_written += __atomic_load_n(&shard->stats.bytes_written, __ATOMIC_RELAXED);
+	}
+
+	struct disk_stats disk_stats;
+	disk_get_stats(fs->disk, &disk_stats);
+	stats->block_reads = disk_stats.reads;
+	stats->block_writes = disk_stats.writes;
+
+	pthread_mutex_lock(&fs->alloc_lock);
+	stats->allocations = fs->allocations;
+	stats->alloc_words = fs->alloc_words;
+	memcpy(stats->alloc_scan, fs->alloc_scan, sizeof(stats->alloc_scan));
+	pthread_mutex_unlock(&fs->alloc_lock);
+
+	return 0;
+}
+
+/* The calls counted by fsi_stats */
+
+int fsi_open(struct fs_instance *fs, const char *name) {
+	unsigned long start = stats_start();
+	int ret = op_open(fs, name);
+	stats_record(fs, FS_OP_OPEN, start, ret);
+
+	return ret;
+}
+
+int fsi_close(struct fs_instance *fs, int fildes) {
+	unsigned long start = stats_start();
+	int ret = op_close(fs, fildes);
+	stats_record(fs, FS_OP_CLOSE, start, ret);
+
+	return ret;
+}
+
+int fsi_create(struct fs_instance *fs, const char *name) {
+	unsigned long start = stats_start();
+	int ret = op_create(fs, name);
+	stats_record(fs, FS_OP_CREATE, start, ret);
+
+	return ret;
+}
+
+int fsi_delete(struct fs_instance *fs, const char *name) {
+	unsigned long start = stats_start();
+	int ret = op_delete(fs, name);
+	stats_record(fs, FS_OP_DELETE, start, ret);
+
+	return ret;
+}
+
+int fsi_read(struct fs_instance *fs, int fildes, void *buf, size_t nbyte) {
+	unsigned long start = stats_start();
+	int ret = op_read(fs, fildes, buf, nbyte);
+	stats_record(fs, FS_OP_READ, start, ret);
+
+	return ret;
+}
+
+int fsi_pread(struct fs_instance *fs, int fildes, void *buf, size_t nbyte, off_t offset) {
+	unsigned long start = stats_start();
+	int ret = op_pread(fs, fildes, buf, nbyte, offset);
+	stats_record(fs, FS_OP_PREAD, start, ret);
+
+	return ret;
+}
+
+int fsi_write(struct fs_instance *fs, int fildes, void *buf, size_t nbyte) {
+	unsigned long start = stats_start();
+	int ret = op_write(fs, fildes, buf, nbyte);
+	stats_record(fs, FS_OP_WRITE, start, ret);
+
+	return ret;
+}
+
+int fsi_pwrite(struct fs_instance *fs, int fildes, void *buf, size_t nbyte, off_t offset) {
+	unsigned long start = stats_start();
+	int ret = op_pwrite(fs, fildes, buf, nbyte, offset);
+	stats_record(fs, FS_OP_PWRITE, start, ret);
+
+	return ret;
+}
+
+int fsi_get_filesize(struct fs_instance *fs, int fildes) {
+	unsigned long start = stats_start();
+	int ret = op_get_filesize(fs, fildes);
+	stats_record(fs, FS_OP_GET_FILESIZE, start, ret);
+
+	return ret;
+}
+
+int fsi_listfiles(struct fs_instance *fs, char ***files) {
+	unsigned long start = stats_start();
+	int ret = op_listfiles(fs, files);
+	stats_record(fs, FS_OP_LISTFILES, start, ret);
+
+	return ret;
+}
+
+int fsi_lseek(struct fs_instance *fs, int fildes, off_t offset) {
+	unsigned long start = stats_start();
+	int ret = op_lseek(fs, fildes, offset);
+	stats_record(fs, FS_OP_LSEEK, start, ret);
+
+	return ret;
+}
+
+int fsi_truncate(struct fs_instance *fs, int fildes, off_t length) {
+	unsigned long start = stats_start();
+	int ret = op_truncate(fs, fildes, length);
+	stats_record(fs, FS_OP_TRUNCATE, start, ret);
+
+	return ret;
+}
+
+int fsi_sync(struct fs_instance *fs) {
+	unsigned long start = stats_start();
+	int ret = op_sync(fs);
+	stats_record(fs, FS_OP_SYNC, start, ret);
+
+	return ret;
+}
+
+/* Instance mounted with mount_fs, the functions without one act on it */
+static struct fs_instance *mounted_fs = NULL;
+
+/* Mount the file system onto the disk */
+int mount_fs(const char *disk_name) {
+	if (mounted_fs != NULL) {
+		fprintf(stderr, "mount_fs: disk already mounted\n");
+		return -1;
+	}
+
+	mounted_fs = fsi_mount(disk_name);
+
+	return (mounted_fs != NULL) ? 0 : -1;
+}
+
+int umount_fs(const char *disk_name) {
+	int ret = fsi_umount(mounted_fs);
+	mounted_fs = NULL;
+
+	return ret;
+}
+
+int fs_open(const char *name) {
+	return fsi_open(mounted_fs, name);
+}
+
+int fs_close(int fildes) {
+	return fsi_close(mounted_fs, fildes);
+}
+
+int fs_create(const char *name) {
+	return fsi_create(mounted_fs, name);
+}
+
+int fs_delete(const char *name) {
+	return fsi_delete(mounted_fs, name);
+}
+
+int fs_read(int fildes, void *buf, size_t nbyte) {
+	return fsi_read(mounted_fs, fildes, buf, nbyte);
+}
+
+int fs_write(int fildes, void *buf, size_t nbyte) {
+	return fsi_write(mounted_fs, fildes, buf, nbyte);
+}
+
+int fs_pread(int fildes, void *buf, size_t nbyte, off_t offset) {
+	return fsi_pread(mounted_fs, fildes, buf, nbyte, offset);
+}
+
+int fs_pwrite(int fildes, void *buf, size_t nbyte, off_t offset) {
+	return fsi_pwrite(mounted_fs, fildes, buf, nbyte, offset);
+}
+
+int fs_get_filesize(int fildes) {
+	return fsi_get_filesize(mounted_fs, fildes);
+}
+
+int fs_listfiles(char ***files) {
+	return fsi_listfiles(mounted_fs, files);
+}
+
+int fs_lseek(int fildes, off_t offset) {
+	return fsi_lseek(mounted_fs, fildes, offset);
+}
+
+int fs_truncate(int fildes, off_t length) {
+	return fsi_truncate(mounted_fs, fildes, length);
+}
+
+int fs_get_extent_count(int fildes) {
+	return fsi_get_extent_count(mounted_fs, fildes);
+}
+
+int fs_get_readahead(int fildes, struct fs_readahead *readahead) {
+	return fsi_get_readahead(mounted_fs, fildes, readahead);
+}
+
+int fs_set_compression(int fildes, int enabled) {
+	return fsi_set_compression(mounted_fs, fildes, enabled);
+}
+
+int fs_set_dedup(int fildes, int enabled) {
+	return fsi_set_dedup(mounted_fs, fildes, enabled);
+}
+
+int fs_sync() {
+	return fsi_sync(mounted_fs);
+}
+
+int fs_stats(struct fs_stats *stats) {
+	return fsi_stats(mounted_fs, stats);
+}
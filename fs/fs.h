@@ -3,7 +3,60 @@
 
 #include <sys/types.h>
 
+/* Readahead of a descriptor, the block counts are for the whole file system since mount */
+struct fs_readahead {
+	int window;		/* bytes read ahead of the descriptor's sequential reads */
+	unsigned long prefetched;	/* blocks read ahead */
+	unsigned long hits;	/* blocks read ahead that a read then found in memory */
+};
+
+/* Calls counted by fs_stats */
+enum fs_op {
+	FS_OP_OPEN,
+	FS_OP_CLOSE,
+	FS_OP_CREATE,
+	FS_OP_DELETE,
+	FS_OP_READ,
+	FS_OP_WRITE,
+	FS_OP_PREAD,
+	FS_OP_PWRITE,
+	FS_OP_GET_FILESIZE,
+	FS_OP_LISTFILES,
+	FS_OP_LSEEK,
+	FS_OP_TRUNCATE,
+	FS_OP_SYNC,
+	FS_OP_COUNT
+};
+
+/* Histogram buckets, bucket i counts values of i bits, from 2^(i-1) up to 2^i - 1,
+ * bucket 0 counts zeros and the last bucket also everything past it */
+#define FS_HISTOGRAM_BUCKETS 32
+
+/* One call in FS_STATS_SAMPLE, picked at random, is timed, which keeps the cost of timing low */
+#define FS_STATS_SAMPLE 16
+
+struct fs_op_stats {
+	unsigned long calls;
+	unsigned long errors;	/* calls that returned -1 */
+	unsigned long timed;	/* calls that were timed */
+	unsigned long nanoseconds;	/* time spent in the timed calls */
+	unsigned long latency[FS_HISTOGRAM_BUCKETS];	/* timed calls by nanoseconds taken */
+};
+
+/* Activity of a file system since it was mounted */
+struct fs_stats {
+	struct fs_op_stats ops[FS_OP_COUNT];
+	unsigned long bytes_read;	/* returned by fs_read and fs_pread */
+	unsigned long bytes_written;	/* taken by fs_write and fs_pwrite */
+	unsigned long block_reads;	/* blocks read from the disk */
+	unsigned long block_writes;	/* blocks written to the disk */
+	unsigned long allocations;	/* searches of the usage bitmap for free blocks */
+	unsigned long alloc_words;	/* bitmap words the searches looked at */
+	unsigned long alloc_scan[FS_HISTOGRAM_BUCKETS];	/* searches by bitmap words looked at */
+};
+
 int make_fs(const char *disk_name);
+int make_fs_geometry(const char *disk_name, int block_count, int block_size);
 int mount_fs(const char *disk_name);
 int umount_fs(const char *disk_name);
 int fs_open(const char *name);
@@ -12,9 +65,45 @@ int fs_create(const char *name);
 int fs_delete(const char *name);
 int fs_read(int fildes, void *buf, size_t nbyte);
 int fs_write(int fildes, void *buf, size_t nbyte);
+int fs_pread(int fildes, void *buf, size_t nbyte, off_t offset);
+int fs_pwrite(int fildes, void *buf, size_t nbyte, off_t offset);
 int fs_get_filesize(int fildes);
 int fs_listfiles(char ***files);
 int fs_lseek(int fildes, off_t offset);
 int fs_truncate(int fildes, off_t length);
+int fs_get_extent_count(int fildes);
+int fs_get_readahead(int fildes, struct fs_readahead *readahead);
+int fs_sync();
+int fs_stats(struct fs_stats *stats);
+/* Store a file's contents compressed or not, while it is still empty. Suits files written
+ * in large pieces, as a write to part of a chunk compresses the whole chunk again */
+int fs_set_compression(int fildes, int enabled);
+/* Have a file's new blocks share disk blocks already holding the same data, not for compressed files */
+int fs_set_dedup(int fildes, int enabled);
+
+/* A mounted file system, any number of disks may be mounted at once and each used from
+ * several threads, the functions above act on the one mounted with mount_fs */
+struct fs_instance;
+
+struct fs_instance *fsi_mount(const char *disk_name);
+int fsi_umount(struct fs_instance *fs);
+int fsi_open(struct fs_instance *fs, const char *name);
+int fsi_close(struct fs_instance *fs, int fildes);
+int fsi_create(struct fs_instance *fs, const char *name);
+int fsi_delete(struct fs_instance *fs, const char *name);
+int fsi_read(struct fs_instance *fs, int fildes, void *buf, size_t nbyte);
+int fsi_write(struct fs_instance *fs, int fildes, void *buf, size_t nbyte);
+int fsi_pread(struct fs_instance *fs, int fildes, void *buf, size_t nbyte, off_t offset);
+int fsi_pwrite(struct fs_instance *fs, int fildes, void *buf, size_t nbyte, off_t offset);
+int fsi_get_filesize(struct fs_instance *fs, int fildes);
+int fsi_listfiles(struct fs_instance *fs, char ***files);
+int fsi_lseek(struct fs_instance *fs, int fildes, off_t offset);
+int fsi_truncate(struct fs_instance *fs, int fildes, off_t length);
+int fsi_get_extent_count(struct fs_instance *fs, int fildes);
+int fsi_get_readahead(struct fs_instance *fs, int fildes, struct fs_readahead *readahead);
+int fsi_sync(struct fs_instance *fs);
+int fsi_stats(struct fs_instance *fs, struct fs_stats *stats);
+int fsi_set_compression(struct fs_instance *fs, int fildes, int enabled);
+int fsi_set_dedup(struct fs_instance *fs, int fildes, int enabled);
 
 #endif /* INCLUDE_FS_H */
@@ -0,0 +1,322 @@
+#include "fs.h"
+#include "disk.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BYTES_KB 1024
+#define BYTES_MB (1024 * BYTES_KB)
+
+/* Size of the file the throughput workloads run on, half the default disk */
+#define FILE_SIZE (16 * BYTES_MB)
+/* Most calls a random workload makes at one I/O size */
+#define RANDOM_OPS 20000
+/* Files made, opened and deleted by the small-file workload */
+#define SMALL_FILES 2000
+/* Mounts timed, of a disk holding the small files */
+#define MOUNT_ROUNDS 20
+
+static const char *disk_name = "bench_fs";
+static const char *file_name = "bench_file";
+
+static char *buf;
+/* Text of a few words, which compresses well unlike buf */
+static char *text;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* One result per line: workload, I/O size in bytes (0 when it has none), value and unit */
+static void report(const char *workload, int size, double value, const char *unit) {
+  printf("%s\t%d\t%.1f\t%s\n", workload, size, value, unit);
+  fflush(stdout);
+}
+
+static void fail(const char *workload) {
+  fprintf(stderr, "fs_bench: %s failed\n", workload);
+  exit(EXIT_FAILURE);
+}
+
+/* Start each workload on a freshly made disk */
+static void fresh_disk() {
+  remove(disk_name);
+  if (make_fs(disk_name) != 0 || mount_fs(disk_name) != 0) {
+    fail("make_fs");
+  }
+}
+
+static void drop_disk() {
+  if (umount_fs(disk_name) != 0) {
+    fail("umount_fs");
+  }
+  remove(disk_name);
+}
+
+/* Write the file from start to end in calls of size bytes, then read it back the same way */
+static void sequential(int size) {
+  fresh_disk();
+  if (fs_create(file_name) != 0) {
+    fail("fs_create");
+  }
+  int fd = fs_open(file_name);
+  if (fd < 0) {
+    fail("fs_open");
+  }
+
+  double start = now();
+  for (int done = 0; done < FILE_SIZE; done += size) {
+    int length = (FILE_SIZE - done < size) ? FILE_SIZE - done : size;
+    if (fs_write(fd, buf + done, length) != length) {
+      fail("seq_write");
+    }
+  }
+  report("seq_write", size, FILE_SIZE / (now() - start) / BYTES_MB, "MiB/s");
+
+  char *read_buf = malloc(FILE_SIZE);
+  if (fs_lseek(fd, 0) != 0) {
+    fail("fs_lseek");
+  }
+  start = now();
+  for (int done = 0; done < FILE_SIZE; done += size) {
+    int length = (FILE_SIZE - done < size) ? FILE_SIZE - done : size;
+    if (fs_read(fd, read_buf + done, length) != length) {
+      fail("seq_read");
+    }
+  }
+  report("seq_read", size, FILE_SIZE / (now() - start) / BYTES_MB, "MiB/s");
+  if (memcmp(buf, read_buf, FILE_SIZE) != 0) {
+    fail("seq_read");
+  }
+  free(read_buf);
+
+  fs_close(fd);
+  drop_disk();
+}
+
+/* Write and read calls of size bytes at random offsets aligned to size, within a full file */
+static void random_access(int size) {
+  fresh_disk();
+  if (fs_create(file_name) != 0) {
+    fail("fs_create");
+  }
+  int fd = fs_open(file_name);
+  if (fd < 0 || fs_write(fd, buf, FILE_SIZE) != FILE_SIZE) {
+    fail("fs_write");
+  }
+
+  int slots = FILE_SIZE / size;
+  int ops = (slots < RANDOM_OPS) ? slots : RANDOM_OPS;
+  char *io_buf = malloc(size);
+  unsigned int seed = 1;
+
+  double start = now();
+  for (int i = 0; i < ops; i++) {
+    off_t offset = (off_t) (rand_r(&seed) % slots) * size;
+    if (fs_pwrite(fd, buf + offset, size, offset) != size) {
+      fail("rand_write");
+    }
+  }
+  double elapsed = now() - start;
+  report("rand_write", size, (double) ops * size / elapsed / BYTES_MB, "MiB/s");
+  report("rand_write_ops", size, ops / elapsed, "ops/s");
+
+  start = now();
+  for (int i = 0; i < ops; i++) {
+    off_t offset = (off_t) (rand_r(&seed) % slots) * size;
+    if (fs_pread(fd, io_buf, size, offset) != size || memcmp(io_buf, buf + offset, size) != 0) {
+      fail("rand_read");
+    }
+  }
+  elapsed = now() - start;
+  report("rand_read", size, (double) ops * size / elapsed / BYTES_MB, "MiB/s");
+  report("rand_read_ops", size, ops / elapsed, "ops/s");
+
+  free(io_buf);
+  fs_close(fd);
+  drop_disk();
+}
+
+/* Make many small files of size bytes, open each, time mounting the disk they are on, then delete them all */
+static void small_files(int size) {
+  char name[16];
+
+  fresh_disk();
+
+  double start = now();
+  for (int i = 0; i < SMALL_FILES; i++) {
+    sprintf(name, "small_%d", i);
+    if (fs_create(name) != 0) {
+      fail("create");
+    }
+    int fd = fs_open(name);
+    if (fd < 0 || fs_write(fd, buf, size) != size || fs_close(fd) != 0) {
+      fail("create");
+    }
+  }
+  report("create", size, SMALL_FILES / (now() - start), "ops/s");
+
+  start = now();
+  for (int i = 0; i < SMALL_FILES; i++) {
+    sprintf(name, "small_%d", i);
+    int fd = fs_open(name);
+    if (fd < 0 || fs_close(fd) != 0) {
+      fail("open");
+    }
+  }
+  report("open", size, SMALL_FILES / (now() - start), "ops/s");
+
+  /* Mount and unmount the disk the files are on */
+  double mount_time = 0;
+  double umount_time = 0;
+  for (int i = 0; i < MOUNT_ROUNDS; i++) {
+    start = now();
+    if (umount_fs(disk_name) != 0) {
+      fail("umount");
+    }
+    umount_time += now() - start;
+    start = now();
+    if (mount_fs(disk_name) != 0) {
+      fail("mount");
+    }
+    mount_time += now() - start;
+  }
+  report("mount", size, mount_time / MOUNT_ROUNDS * 1e6, "us");
+  report("umount", size, umount_time / MOUNT_ROUNDS * 1e6, "us");
+
+  start = now();
+  for (int i = 0; i < SMALL_FILES; i++) {
+    sprintf(name, "small_%d", i);
+    if (fs_delete(name) != 0) {
+      fail("delete");
+    }
+  }
+  report("delete", size, SMALL_FILES / (now() - start), "ops/s");
+
+  drop_disk();
+}
+
+/* Write a compressed file of text in calls of size bytes and read it back, with the
+ * blocks written for it as a share of those it would take uncompressed */
+static void compressed(int size) {
+  struct fs_stats before, after;
+
+  fresh_disk();
+  if (fs_create(file_name) != 0) {
+    fail("fs_create");
+  }
+  int fd = fs_open(file_name);
+  if (fd < 0 || fs_set_compression(fd, 1) != 0 || fs_sync() != 0 || fs_stats(&before) != 0) {
+    fail("fs_set_compression");
+  }
+
+  double start = now();
+  for (int done = 0; done < FILE_SIZE; done += size) {
+    int length = (FILE_SIZE - done < size) ? FILE_SIZE - done : size;
+    if (fs_write(fd, text + done, length) != length) {
+      fail("comp_write");
+    }
+  }
+  if (fs_sync() != 0 || fs_stats(&after) != 0) {
+    fail("fs_sync");
+  }
+  report("comp_write", size, FILE_SIZE / (now() - start) / BYTES_MB, "MiB/s");
+  report("comp_space", size, 100.0 * (after.block_writes - before.block_writes) / (FILE_SIZE / 4096), "%");
+
+  char *read_buf = malloc(FILE_SIZE);
+  if (fs_lseek(fd, 0) != 0) {
+    fail("fs_lseek");
+  }
+  start = now();
+  for (int done = 0; done < FILE_SIZE; done += size) {
+    int length = (FILE_SIZE - done < size) ? FILE_SIZE - done : size;
+    if (fs_read(fd, read_buf + done, length) != length) {
+      fail("comp_read");
+    }
+  }
+  report("comp_read", size, FILE_SIZE / (now() - start) / BYTES_MB, "MiB/s");
+  if (memcmp(text, read_buf, FILE_SIZE) != 0) {
+    fail("comp_read");
+  }
+  free(read_buf);
+
+  fs_close(fd);
+  drop_disk();
+}
+
+/* Write one file in calls of size bytes until the disk is full, size divides FILE_SIZE */
+static void fill(int size) {
+  fresh_disk();
+  if (fs_create(file_name) != 0) {
+    fail("fs_create");
+  }
+  int fd = fs_open(file_name);
+  if (fd < 0) {
+    fail("fs_open");
+  }
+
+  long total = 0;
+  double start = now();
+  int n;
+  /* A short write, or none at all once the last block is taken, means the disk is full */
+  while ((n = fs_write(fd, buf + total % FILE_SIZE, size)) > 0) {
+    total += n;
+    if (n < size) {
+      break;
+    }
+  }
+  if (total == 0) {
+    fail("fill");
+  }
+  double elapsed = now() - start;
+  report("fill", size, elapsed * 1e3, "ms");
+  report("fill_rate", size, total / elapsed / BYTES_MB, "MiB/s");
+
+  fs_close(fd);
+  drop_disk();
+}
+
+int main(int argc, char **argv) {
+  const int sizes[] = {BYTES_MB, 64 * BYTES_KB, 4 * BYTES_KB, 1000, 100};
+  const int random_sizes[] = {64 * BYTES_KB, 4 * BYTES_KB, 100};
+
+  /* "mmap" as the first argument runs on the mapped disk backend */
+  if (argc > 1 && strcmp(argv[1], "mmap") == 0) {
+    set_disk_backend(DISK_BACKEND_MMAP);
+  }
+
+  buf = malloc(FILE_SIZE);
+  for (int i = 0; i < FILE_SIZE; i++) {
+    buf[i] = 'A' + rand() % 26;
+  }
+  const char *words[] = {"block ", "inode ", "extent ", "cache ", "disk ", "file ", "write ", "read "};
+  text = malloc(FILE_SIZE);
+  for (int done = 0; done < FILE_SIZE; ) {
+    const char *word = words[rand() % 8];
+    for (int i = 0; word[i] != '\0' && done < FILE_SIZE; i++) {
+      text[done++] = word[i];
+    }
+  }
+
+  printf("# workload\tsize\tvalue\tunit\n");
+  for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    sequential(sizes[i]);
+  }
+  for (int i = 0; i < sizeof(random_sizes) / sizeof(random_sizes[0]); i++) {
+    random_access(random_sizes[i]);
+  }
+  compressed(BYTES_MB);
+  compressed(64 * BYTES_KB);
+  small_files(1000);
+  small_files(200);
+  fill(BYTES_MB);
+  fill(4 * BYTES_KB);
+
+  free(buf);
+  free(text);
+
+  return EXIT_SUCCESS;
+}
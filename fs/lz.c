@@ -0,0 +1,191 @@
+#include <string.h>
+#include <stdint.h>
+
+#include "lz.h"
+
+/* Positions of earlier sequences by the hash of their first LZ_MIN_MATCH bytes */
+#define LZ_HASH_BITS 12
+#define LZ_HASH_SIZE (1 << LZ_HASH_BITS)
+
+/* Farthest a match may be, offsets take two bytes */
+#define LZ_MAX_OFFSET 65535
+
+/* Literals skipped without a match before the search steps two bytes at a time, then three... */
+#define LZ_SKIP_SHIFT 5
+
+/* Length of a match already known to cover LZ_MIN_MATCH bytes, a word at a time while it can */
+static int match_length(const char *src, int candidate, int pos, int length)
+{
+	int match = LZ_MIN_MATCH;
+
+	while (pos + match + 8 <= length) {
+		uint64_t a, b;
+		memcpy(&a, src + candidate + match, 8);
+		memcpy(&b, src + pos + match, 8);
+		if (a != b) {
+			break;
+		}
+		match += 8;
+	}
+	while (pos + match < length && src[candidate + match] == src[pos + match]) {
+		match++;
+	}
+
+	return match;
+}
+
+/* Write the bytes of a length past the 15 its token field holds */
+static int put_length(char *dst, int out, int value)
+{
+	value -= 15;
+	while (value >= 255) {
+		dst[out++] = (char) 255;
+		value -= 255;
+	}
+	dst[out++] = (char) value;
+
+	return out;
+}
+
+/* Append a sequence of literals followed by a match, or only literals when offset is 0 */
+static int emit(char *dst, int out, int capacity, const char *literals, int literal_length, int offset, int match)
+{
+	int code = offset ? match - LZ_MIN_MATCH : 0;
+
+	/* Token, length bytes, literals and offset at most */
+	if (out + 1 + (literal_length / 255 + 1) + literal_length + 2 + (code / 255 + 1) > capacity) {
+		return -1;
+	}
+
+	int token = out++;
+	dst[token] = (char) ((literal_length < 15 ? literal_length : 15) << 4);
+	if (literal_length >= 15) {
+		out = put_length(dst, out, literal_length);
+	}
+	memcpy(dst + out, literals, literal_length);
+	out += literal_length;
+
+	if (offset) {
+		dst[out++] = (char) (offset & 0xff);
+		dst[out++] = (char) (offset >> 8);
+		dst[token] |= (char) (code < 15 ? code : 15);
+		if (code >= 15) {
+			out = put_length(dst, out, code);
+		}
+	}
+
+	return out;
+}
+
+int lz_compress(const char *src, int length, char *dst, int capacity)
+{
+	int table[LZ_HASH_SIZE];
+	int anchor = 0;
+	int pos = 0;
+	int out = 0;
+
+	memset(table, 0xff, sizeof(table));
+
+	while (pos + LZ_MIN_MATCH <= length) {
+		uint32_t sequence;
+		memcpy(&sequence, src + pos, LZ_MIN_MATCH);
+		int hash = (int) ((sequence * 2654435761u) >> (32 - LZ_HASH_BITS));
+		int candidate = table[hash];
+		table[hash] = pos;
+
+		if (candidate < 0 || pos - candidate > LZ_MAX_OFFSET || memcmp(src + candidate, src + pos, LZ_MIN_MATCH) != 0) {
+			/* Data that does not repeat is skipped over faster the longer it goes on */
+			pos += 1 + ((pos - anchor) >> LZ_SKIP_SHIFT);
+			continue;
+		}
+
+		int match = match_length(src, candidate, pos, length);
+		out = emit(dst, out, capacity, src + anchor, pos - anchor, pos - candidate, match);
+		if (out < 0) {
+			return -1;
+		}
+		pos += match;
+		anchor = pos;
+	}
+
+	/* The last sequence is the literals left over */
+	return emit(dst, out, capacity, src + anchor, length - anchor, 0, 0);
+}
+
+/* Read the bytes of a length past the 15 its token field holds, -1 past the end of src */
+static int get_length(const unsigned char *src, int length, int *in, int value)
+{
+	unsigned char byte;
+
+	do {
+		if (*in >= length) {
+			return -1;
+		}
+		byte = src[(*in)++];
+		value += byte;
+	} while (byte == 255);
+
+	return value;
+}
+
+int lz_decompress(const char *src, int length, char *dst, int capacity)
+{
+	const unsigned char *in_bytes = (const unsigned char *) src;
+	int in = 0;
+	int out = 0;
+
+	while (in < length) {
+		int token = in_bytes[in++];
+
+		/* Literals */
+		int literal_length = token >> 4;
+		if (literal_length == 15 && (literal_length = get_length(in_bytes, length, &in, 15)) < 0) {
+			return -1;
+		}
+		if (literal_length > length - in || literal_length > capacity - out) {
+			return -1;
+		}
+		if (literal_length <= 16 && length - in >= 16 && capacity - out >= 16) {
+			/* Short runs are copied as a fixed 16 bytes when both sides have room past them */
+			memcpy(dst + out, src + in, 16);
+		} else {
+			memcpy(dst + out, src + in, literal_length);
+		}
+		in += literal_length;
+		out += literal_length;
+
+		/* Only the last sequence ends without a match */
+		if (in == length) {
+			break;
+		}
+		if (length - in < 2) {
+			return -1;
+		}
+		int offset = in_bytes[in] | (in_bytes[in + 1] << 8);
+		in += 2;
+		int match = token & 15;
+		if (match == 15 && (match = get_length(in_bytes, length, &in, 15)) < 0) {
+			return -1;
+		}
+		match += LZ_MIN_MATCH;
+		if (offset == 0 || offset > out || match > capacity - out) {
+			return -1;
+		}
+
+		if (offset >= 16 && match <= 16 && capacity - out >= 16) {
+			memcpy(dst + out, dst + out - offset, 16);
+		} else {
+			/* A match overlapping what it copies repeats it, and the bytes a whole number of
+			 * repeats back are the same, so each copy can reach further back than the last */
+			for (int copied = 0; copied < match; ) {
+				int distance = (offset + copied) / offset * offset;
+				int n = (distance < match - copied) ? distance : match - copied;
+				memcpy(dst + out + copied, dst + out + copied - distance, n);
+				copied += n;
+			}
+		}
+		out += match;
+	}
+
+	return out;
+}
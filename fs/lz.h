@@ -0,0 +1,15 @@
+#ifndef _LZ_H_
+#define _LZ_H_
+
+/* LZ77 codec in the style of LZ4: runs of literals and back references of at
+ * least LZ_MIN_MATCH bytes up to 64 KiB back, no entropy coding, so it is fast
+ * both ways and only shrinks data that repeats itself */
+#define LZ_MIN_MATCH 4
+
+/* Compress length bytes into dst, the compressed length or -1 if it needs more than capacity */
+int lz_compress(const char *src, int length, char *dst, int capacity);
+
+/* Decompress length bytes into dst, the decompressed length or -1 if src is corrupt or too big */
+int lz_decompress(const char *src, int length, char *dst, int capacity);
+
+#endif
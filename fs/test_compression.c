@@ -0,0 +1,160 @@
+#include "../fs.h"
+#include <assert.h>
+
+#define FILE_SIZE (1024 * 1024)
+#define BIG_FILE_SIZE (40 * 1024 * 1024) // more than the disk holds uncompressed
+
+const char *disk_name = "test_fs";
+char text[FILE_SIZE];
+char read_buf[FILE_SIZE];
+
+// Text made of a few words repeats itself, so it compresses well
+void make_text(char *buf, int size) {
+  const char *words[] = {"block ", "inode ", "extent ", "cache ", "disk ", "file ", "write ", "read "};
+  int done = 0;
+  while (done < size) {
+    const char *word = words[rand() % 8];
+    int length = strlen(word);
+    if (length > size - done) {
+      length = size - done;
+    }
+    memcpy(buf + done, word, length);
+    done += length;
+  }
+}
+
+// Blocks written to the disk for one file of data, counted through a sync
+unsigned long blocks_written(const char *name, int compressed) {
+  struct fs_stats before, after;
+  assert(fs_sync() == 0);
+  assert(fs_stats(&before) == 0);
+  assert(fs_create(name) == 0);
+  int fd = fs_open(name);
+  assert(fd >= 0);
+  assert(fs_set_compression(fd, compressed) == 0);
+  assert(fs_write(fd, text, FILE_SIZE) == FILE_SIZE);
+  assert(fs_close(fd) == 0);
+  assert(fs_sync() == 0);
+  assert(fs_stats(&after) == 0);
+  return after.block_writes - before.block_writes;
+}
+
+int main() {
+  srand(1);
+  make_text(text, FILE_SIZE);
+
+  remove(disk_name); // remove disk if it exists
+  assert(make_fs(disk_name) == 0);
+  assert(fs_set_compression(0, 1) == -1); // disk not mounted
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_set_compression(0, 1) == -1); // file not open
+
+  // compressed text takes far fewer blocks than it spans
+  unsigned long plain = blocks_written("plain", 0);
+  unsigned long packed = blocks_written("packed", 1);
+  assert(plain >= FILE_SIZE / 4096);
+  assert(packed < plain * 3 / 4);
+
+  // it reads back whole, and in small pieces across chunks
+  int fd = fs_open("packed");
+  assert(fd >= 0);
+  assert(fs_get_filesize(fd) == FILE_SIZE);
+  assert(fs_get_extent_count(fd) == FILE_SIZE / (64 * 1024)); // one extent per chunk
+  assert(fs_read(fd, read_buf, FILE_SIZE) == FILE_SIZE);
+  assert(memcmp(read_buf, text, FILE_SIZE) == 0);
+  for (int offset = 1; offset < FILE_SIZE; offset += 65000) {
+    assert(fs_pread(fd, read_buf, 1000, offset) == 1000);
+    assert(memcmp(read_buf, text + offset, 1000) == 0);
+  }
+  assert(fs_set_compression(fd, 0) == -1); // file not empty
+
+  // overwriting part of a chunk, and across two, keeps the rest
+  char noise[3000];
+  for (int i = 0; i < sizeof(noise); i++) {
+    noise[i] = rand();
+  }
+  memcpy(text + 1000, noise, 100);
+  assert(fs_pwrite(fd, noise, 100, 1000) == 100);
+  memcpy(text + 65000, noise, sizeof(noise));
+  assert(fs_pwrite(fd, noise, sizeof(noise), 65000) == sizeof(noise));
+  assert(fs_pread(fd, read_buf, FILE_SIZE, 0) == FILE_SIZE);
+  assert(memcmp(read_buf, text, FILE_SIZE) == 0);
+
+  // cutting the file short keeps what is left of its last chunk
+  int length = 3 * 65536 + 1234;
+  assert(fs_truncate(fd, length) == 0);
+  assert(fs_get_filesize(fd) == length);
+  assert(fs_get_extent_count(fd) == 4);
+  assert(fs_pread(fd, read_buf, FILE_SIZE, 0) == length);
+  assert(memcmp(read_buf, text, length) == 0);
+
+  // small appends grow the last chunk and then start new ones
+  assert(fs_lseek(fd, length - 1) == 0);
+  assert(fs_read(fd, read_buf, 1) == 1);
+  for (int i = 0; i < 100; i++) {
+    assert(fs_write(fd, text + length, 1000) == 1000);
+    length += 1000;
+  }
+  assert(fs_get_filesize(fd) == length);
+  assert(fs_pread(fd, read_buf, FILE_SIZE, 0) == length);
+  assert(memcmp(read_buf, text, length) == 0);
+  assert(fs_close(fd) == 0);
+
+  // data that does not compress is stored as it is
+  char random[20000];
+  for (int i = 0; i < sizeof(random); i++) {
+    random[i] = rand();
+  }
+  assert(fs_create("random") == 0);
+  fd = fs_open("random");
+  assert(fs_set_compression(fd, 1) == 0);
+  assert(fs_write(fd, random, sizeof(random)) == sizeof(random));
+  assert(fs_pread(fd, read_buf, sizeof(random), 0) == sizeof(random));
+  assert(memcmp(read_buf, random, sizeof(random)) == 0);
+  assert(fs_close(fd) == 0);
+
+  // the chunks and the compression setting survive a remount
+  assert(umount_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+  fd = fs_open("packed");
+  assert(fs_read(fd, read_buf, FILE_SIZE) == length);
+  assert(memcmp(read_buf, text, length) == 0);
+  assert(fs_write(fd, text + length, 5000) == 5000);
+  assert(fs_pread(fd, read_buf, length + 5000, 0) == length + 5000);
+  assert(memcmp(read_buf, text, length + 5000) == 0);
+  assert(fs_close(fd) == 0);
+  fd = fs_open("random");
+  assert(fs_read(fd, read_buf, sizeof(random)) == sizeof(random));
+  assert(memcmp(read_buf, random, sizeof(random)) == 0);
+  assert(fs_close(fd) == 0);
+  assert(fs_delete("packed") == 0);
+  assert(fs_delete("plain") == 0);
+  assert(fs_delete("random") == 0);
+
+  // more text fits than the disk holds uncompressed
+  char *big = malloc(BIG_FILE_SIZE);
+  make_text(big, BIG_FILE_SIZE);
+  assert(fs_create("big") == 0);
+  fd = fs_open("big");
+  assert(fs_set_compression(fd, 1) == 0);
+  assert(fs_write(fd, big, BIG_FILE_SIZE) == BIG_FILE_SIZE);
+  assert(fs_lseek(fd, 0) == 0);
+  char *big_read = malloc(BIG_FILE_SIZE);
+  assert(fs_read(fd, big_read, BIG_FILE_SIZE) == BIG_FILE_SIZE);
+  assert(memcmp(big, big_read, BIG_FILE_SIZE) == 0);
+  assert(fs_close(fd) == 0);
+
+  // deleting it gives every block back
+  assert(fs_delete("big") == 0);
+  assert(fs_create("plain") == 0);
+  fd = fs_open("plain");
+  assert(fs_write(fd, big, 16 * 1024 * 1024) == 16 * 1024 * 1024);
+  assert(fs_close(fd) == 0);
+  free(big);
+  free(big_read);
+
+  assert(umount_fs(disk_name) == 0);
+  assert(remove(disk_name) == 0);
+
+  return 0;
+}
@@ -0,0 +1,139 @@
+#include "../fs.h"
+#include <assert.h>
+
+#define BYTES_MB (1024 * 1024)
+#define COPY_SIZE (8 * BYTES_MB)
+#define COPIES 8 // more copies than the disk holds without dedup
+
+const char *disk_name = "test_fs";
+const char *names[COPIES] = {"copy0", "copy1", "copy2", "copy3", "copy4", "copy5", "copy6", "copy7"};
+char data[COPY_SIZE];
+char read_buf[COPY_SIZE];
+
+// Bytes one file takes before the disk is full, the file is deleted again
+long fill_disk() {
+  assert(fs_create("fill") == 0);
+  int fd = fs_open("fill");
+  long total = 0;
+  int n;
+  while ((n = fs_write(fd, data, BYTES_MB)) > 0) {
+    total += n;
+  }
+  assert(fs_close(fd) == 0);
+  assert(fs_delete("fill") == 0);
+  return total;
+}
+
+unsigned long block_writes() {
+  struct fs_stats stats;
+  assert(fs_sync() == 0);
+  assert(fs_stats(&stats) == 0);
+  return stats.block_writes;
+}
+
+void check_file(const char *name, const char *expected, int size) {
+  int fd = fs_open(name);
+  assert(fd >= 0);
+  assert(fs_get_filesize(fd) == size);
+  assert(fs_read(fd, read_buf, COPY_SIZE) == size);
+  assert(memcmp(read_buf, expected, size) == 0);
+  assert(fs_close(fd) == 0);
+}
+
+int main() {
+  for (int i = 0; i < COPY_SIZE; i++) {
+    data[i] = rand();
+  }
+
+  remove(disk_name); // remove disk if it exists
+  assert(make_fs(disk_name) == 0);
+  assert(fs_set_dedup(0, 1) == -1); // disk not mounted
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_set_dedup(0, 1) == -1); // file not open
+  long capacity = fill_disk();
+  assert(capacity < COPIES * (long) COPY_SIZE);
+
+  // the first copy is written out, the others share its blocks
+  for (int i = 0; i < COPIES; i++) {
+    unsigned long before = block_writes();
+    assert(fs_create(names[i]) == 0);
+    int fd = fs_open(names[i]);
+    assert(fs_set_dedup(fd, 1) == 0);
+    assert(fs_write(fd, data, COPY_SIZE) == COPY_SIZE);
+    assert(fs_close(fd) == 0);
+    unsigned long written = block_writes() - before;
+    if (i == 0) {
+      assert(written >= COPY_SIZE / 4096);
+    } else {
+      assert(written < COPY_SIZE / 4096 / 16);
+    }
+  }
+  for (int i = 0; i < COPIES; i++) {
+    check_file(names[i], data, COPY_SIZE);
+  }
+
+  // overwriting part of a shared block, or all of one, leaves the other copies alone
+  char *changed = malloc(COPY_SIZE);
+  memcpy(changed, data, COPY_SIZE);
+  memset(changed + 5000, 'x', 100);
+  memset(changed + 8192, 'y', 4096);
+  int fd = fs_open(names[1]);
+  assert(fs_pwrite(fd, changed + 5000, 100, 5000) == 100);
+  assert(fs_pwrite(fd, changed + 8192, 4096, 8192) == 4096);
+  assert(fs_close(fd) == 0);
+  check_file(names[1], changed, COPY_SIZE);
+  check_file(names[0], data, COPY_SIZE);
+  check_file(names[2], data, COPY_SIZE);
+
+  // cutting a copy short in a shared block leaves the rest of it to the others
+  fd = fs_open(names[2]);
+  assert(fs_truncate(fd, 10000) == 0);
+  assert(fs_close(fd) == 0);
+  check_file(names[2], data, 10000);
+  check_file(names[3], data, COPY_SIZE);
+
+  // the blocks stay as long as any copy holds them
+  assert(fs_delete(names[0]) == 0);
+  check_file(names[3], data, COPY_SIZE);
+
+  // a file that does not dedup gets blocks of its own
+  unsigned long before = block_writes();
+  assert(fs_create("plain") == 0);
+  fd = fs_open("plain");
+  assert(fs_write(fd, data, BYTES_MB) == BYTES_MB);
+  assert(fs_set_compression(fd, 1) == -1); // file not empty
+  assert(fs_close(fd) == 0);
+  assert(block_writes() - before >= BYTES_MB / 4096);
+
+  // compressed files do not dedup
+  assert(fs_create("packed") == 0);
+  fd = fs_open("packed");
+  assert(fs_set_compression(fd, 1) == 0);
+  assert(fs_set_dedup(fd, 1) == -1);
+  assert(fs_close(fd) == 0);
+  fd = fs_open(names[4]);
+  assert(fs_truncate(fd, 0) == 0);
+  assert(fs_set_compression(fd, 1) == -1); // file dedups
+  assert(fs_close(fd) == 0);
+
+  // the share counts survive a remount, so deletes still leave the others their blocks
+  assert(umount_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+  check_file(names[1], changed, COPY_SIZE);
+  for (int i = 1; i < COPIES - 1; i++) {
+    assert(fs_delete(names[i]) == 0);
+  }
+  check_file(names[COPIES - 1], data, COPY_SIZE);
+
+  // once every copy is gone the disk holds as much as before
+  assert(fs_delete(names[COPIES - 1]) == 0);
+  assert(fs_delete("plain") == 0);
+  assert(fs_delete("packed") == 0);
+  assert(fill_disk() == capacity);
+  free(changed);
+
+  assert(umount_fs(disk_name) == 0);
+  assert(remove(disk_name) == 0);
+
+  return 0;
+}
@@ -24,7 +24,7 @@ int main() {
     assert(fs_create(file_names[i]) == -1); // file already exists
   }
 
-  assert(fs_create("65") == -1);     // no more space
+  assert(fs_create("65") == 0);      // directory grows past 64 files
   assert(umount_fs(disk_name) == 0); // unmount the disk
   assert(fs_create("65") == -1);     // disk not mounted
   assert(remove(disk_name) == 0);    // remove the disk
@@ -0,0 +1,58 @@
+#include "../fs.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#define BYTES_KB 1024
+#define BYTES_MB (1024 * BYTES_KB)
+
+int main() {
+  const char *disk_name = "test_fs";
+  const int block_sizes[] = {1 * BYTES_KB, 4 * BYTES_KB, 64 * BYTES_KB};
+  const int file_size = 3 * BYTES_MB + 17;
+  char *buf = malloc(file_size);
+  char *read_buf = malloc(file_size);
+  struct stat st;
+
+  for (int i = 0; i < file_size; i++) {
+    buf[i] = 'A' + rand() % 26;
+  }
+
+  // Invalid geometries are refused
+  assert(make_fs_geometry(disk_name, 8192, 3000) == -1);   // not a power of two
+  assert(make_fs_geometry(disk_name, 8192, 512) == -1);    // block too small
+  assert(make_fs_geometry(disk_name, 0, 4096) == -1);      // no blocks
+  assert(make_fs_geometry(disk_name, 16, 4096) == -1);     // no room for data
+
+  for (int i = 0; i < sizeof(block_sizes) / sizeof(block_sizes[0]); i++) {
+    // 1 GiB image, sparse until blocks are written
+    int block_count = 1024 * BYTES_MB / block_sizes[i];
+    remove(disk_name);
+    assert(make_fs_geometry(disk_name, block_count, block_sizes[i]) == 0);
+    assert(stat(disk_name, &st) == 0);
+    assert(st.st_size == (off_t) block_count * block_sizes[i]);
+    assert(st.st_blocks * 512 < st.st_size / 16);
+
+    // A file written with this block size survives a remount
+    assert(mount_fs(disk_name) == 0);
+    assert(fs_create("file") == 0);
+    int fd = fs_open("file");
+    assert(fd >= 0);
+    assert(fs_write(fd, buf, file_size) == file_size);
+    assert(fs_close(fd) == 0);
+    assert(umount_fs(disk_name) == 0);
+
+    assert(mount_fs(disk_name) == 0);
+    fd = fs_open("file");
+    assert(fd >= 0);
+    assert(fs_get_filesize(fd) == file_size);
+    assert(fs_read(fd, read_buf, file_size) == file_size);
+    assert(memcmp(buf, read_buf, file_size) == 0);
+    assert(fs_close(fd) == 0);
+    assert(umount_fs(disk_name) == 0);
+  }
+
+  assert(remove(disk_name) == 0);
+  free(buf);
+  free(read_buf);
+}
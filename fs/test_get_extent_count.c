@@ -0,0 +1,50 @@
+#include "../fs.h"
+#include <assert.h>
+
+#define BYTES_KB 1024
+#define BYTES_MB (1024 * BYTES_KB)
+
+int main() {
+  const char *disk_name = "test_fs";
+  static char buf[BYTES_MB];
+
+  remove(disk_name); // remove disk if it exists
+  assert(make_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+
+  // empty file has no extents, a sequential 1 MiB file has one
+  assert(fs_create("seq") == 0);
+  int fd = fs_open("seq");
+  assert(fd >= 0);
+  assert(fs_get_extent_count(fd) == 0);
+  assert(fs_write(fd, buf, BYTES_MB) == BYTES_MB);
+  assert(fs_get_extent_count(fd) == 1);
+
+  // appends grow the last extent in place
+  assert(fs_truncate(fd, 4 * BYTES_KB) == 0);
+  assert(fs_get_extent_count(fd) == 1);
+  assert(fs_lseek(fd, 4 * BYTES_KB - 1) == 0);
+  for (int i = 0; i < 8; i++) {
+    assert(fs_write(fd, buf, 4 * BYTES_KB) == 4 * BYTES_KB);
+  }
+  assert(fs_get_extent_count(fd) == 1);
+
+  // interleaved appends to two files fragment both
+  assert(fs_create("a") == 0);
+  assert(fs_create("b") == 0);
+  int fd_a = fs_open("a");
+  int fd_b = fs_open("b");
+  for (int i = 0; i < 4; i++) {
+    assert(fs_write(fd_a, buf, 4 * BYTES_KB) == 4 * BYTES_KB);
+    assert(fs_write(fd_b, buf, 4 * BYTES_KB) == 4 * BYTES_KB);
+  }
+  assert(fs_get_extent_count(fd_a) > 1);
+  assert(fs_get_extent_count(fd_b) > 1);
+  assert(fs_close(fd_a) == 0);
+  assert(fs_close(fd_b) == 0);
+  assert(fs_close(fd) == 0);
+  assert(fs_get_extent_count(fd) == -1); // file not opened
+
+  assert(umount_fs(disk_name) == 0);
+  assert(remove(disk_name) == 0);
+}
@@ -0,0 +1,153 @@
+#include "../fs.h"
+#include <assert.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define SMALL_SIZE 200 // fits in the inode
+#define FILE_SIZE (64 * 1024)
+#define FILES 1000
+
+const char *disk_name = "test_fs";
+char data[FILE_SIZE];
+char read_buf[FILE_SIZE];
+
+// Bytes one file takes before the disk is full, the file is deleted again
+long fill_disk() {
+  assert(fs_create("fill") == 0);
+  int fd = fs_open("fill");
+  long total = 0;
+  int n;
+  while ((n = fs_write(fd, data, FILE_SIZE)) > 0) {
+    total += n;
+  }
+  assert(fs_close(fd) == 0);
+  assert(fs_delete("fill") == 0);
+  return total;
+}
+
+void check_file(const char *name, const char *expected, int size) {
+  int fd = fs_open(name);
+  assert(fd >= 0);
+  assert(fs_get_filesize(fd) == size);
+  assert(fs_read(fd, read_buf, FILE_SIZE) == size);
+  assert(memcmp(read_buf, expected, size) == 0);
+  assert(fs_close(fd) == 0);
+}
+
+int main() {
+  char name[16];
+  for (int i = 0; i < FILE_SIZE; i++) {
+    data[i] = 'a' + i % 26;
+  }
+
+  remove(disk_name); // remove disk if it exists
+  assert(make_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+  for (int i = 0; i < FILES; i++) {
+    sprintf(name, "small%d", i);
+    assert(fs_create(name) == 0);
+  }
+  long capacity = fill_disk(); // with the directory grown for them
+
+  // small files take no data blocks
+  for (int i = 0; i < FILES; i++) {
+    sprintf(name, "small%d", i);
+    int fd = fs_open(name);
+    assert(fs_write(fd, data + i, SMALL_SIZE) == SMALL_SIZE);
+    assert(fs_get_extent_count(fd) == 0);
+    assert(fs_close(fd) == 0);
+  }
+  assert(fill_disk() == capacity);
+  check_file("small0", data, SMALL_SIZE);
+
+  // reading one back after a remount reads no block past the directory and the inode table
+  assert(umount_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+  struct fs_stats before, after;
+  assert(fs_stats(&before) == 0);
+  check_file("small1", data + 1, SMALL_SIZE);
+  assert(fs_stats(&after) == 0);
+  assert(after.block_reads - before.block_reads <= 2);
+
+  // writes inside the inode change it in place
+  int fd = fs_open("small2");
+  char expected[FILE_SIZE];
+  memcpy(expected, data + 2, SMALL_SIZE);
+  memset(expected + 10, 'x', 20);
+  assert(fs_pwrite(fd, expected + 10, 20, 10) == 20);
+  assert(fs_truncate(fd, 100) == 0);
+  assert(fs_get_filesize(fd) == 100);
+  assert(fs_pread(fd, read_buf, FILE_SIZE, 0) == 100);
+  assert(memcmp(read_buf, expected, 100) == 0);
+
+  // growing past it moves the file to data blocks, keeping what it held
+  memcpy(expected + 100, data, FILE_SIZE - 100);
+  assert(fs_pwrite(fd, data, FILE_SIZE - 100, 100) == FILE_SIZE - 100);
+  assert(fs_get_extent_count(fd) == 1);
+  assert(fs_pread(fd, read_buf, FILE_SIZE, 0) == FILE_SIZE);
+  assert(memcmp(read_buf, expected, FILE_SIZE) == 0);
+
+  // and it stays there when cut short again
+  assert(fs_truncate(fd, 50) == 0);
+  assert(fs_get_extent_count(fd) == 1);
+  assert(fs_close(fd) == 0);
+  check_file("small2", expected, 50);
+
+  // an emptied file starts out in its inode again
+  fd = fs_open("small3");
+  assert(fs_truncate(fd, 0) == 0);
+  assert(fs_write(fd, data, SMALL_SIZE) == SMALL_SIZE);
+  assert(fs_get_extent_count(fd) == 0);
+  assert(fs_close(fd) == 0);
+  check_file("small3", data, SMALL_SIZE);
+
+  // a compressed file is compressed once it moves out
+  assert(fs_create("packed") == 0);
+  fd = fs_open("packed");
+  assert(fs_set_compression(fd, 1) == 0);
+  assert(fs_write(fd, data, SMALL_SIZE) == SMALL_SIZE);
+  assert(fs_get_extent_count(fd) == 0);
+  assert(fs_write(fd, data + SMALL_SIZE, FILE_SIZE - SMALL_SIZE) == FILE_SIZE - SMALL_SIZE);
+  assert(fs_get_extent_count(fd) == 1);
+  assert(fs_close(fd) == 0);
+  check_file("packed", data, FILE_SIZE);
+
+  // the contents survive a remount, and changes synced before a crash are replayed from the log
+  assert(umount_fs(disk_name) == 0);
+  pid_t pid = fork();
+  assert(pid != -1);
+  if (pid == 0) {
+    assert(mount_fs(disk_name) == 0);
+    fd = fs_open("small4");
+    assert(fs_pwrite(fd, "changed", 7, 0) == 7);
+    assert(fs_close(fd) == 0);
+    assert(fs_sync() == 0);
+    _exit(EXIT_SUCCESS); // without unmounting
+  }
+  int status;
+  assert(waitpid(pid, &status, 0) == pid);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+  assert(mount_fs(disk_name) == 0);
+  check_file("small2", expected, 50);
+  memcpy(expected, data + 4, SMALL_SIZE);
+  memcpy(expected, "changed", 7);
+  check_file("small4", expected, SMALL_SIZE);
+  check_file("packed", data, FILE_SIZE);
+  for (int i = 5; i < FILES; i++) {
+    sprintf(name, "small%d", i);
+    check_file(name, data + i, SMALL_SIZE);
+  }
+
+  // deleting them all gives the disk back as it was
+  for (int i = 0; i < FILES; i++) {
+    sprintf(name, "small%d", i);
+    assert(fs_delete(name) == 0);
+  }
+  assert(fs_delete("packed") == 0);
+  assert(fill_disk() == capacity);
+
+  assert(umount_fs(disk_name) == 0);
+  assert(remove(disk_name) == 0);
+
+  return 0;
+}
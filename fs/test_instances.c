@@ -0,0 +1,137 @@
+#include "../fs.h"
+#include "../disk.h"
+#include <assert.h>
+#include <pthread.h>
+
+#define DISKS 3
+#define ROUNDS 20
+#define FILE_SIZE (64 * 1024)
+
+const char *disk_names[DISKS] = {"test_fs", "test_fs_1", "test_fs_2"};
+struct fs_instance *instances[DISKS];
+
+// Each thread works on a disk of its own, with the same file names as the others
+void *disk_thread(void *arg) {
+  int id = (int) (long) arg;
+  struct fs_instance *fs = instances[id];
+  char *write_buf = malloc(FILE_SIZE);
+  char *read_buf = malloc(FILE_SIZE);
+  char name[16];
+
+  for (int round = 0; round < ROUNDS; round++) {
+    sprintf(name, "file_%d", round);
+    memset(write_buf, 'a' + (id * ROUNDS + round) % 26, FILE_SIZE);
+
+    assert(fsi_create(fs, name) == 0);
+    int fd = fsi_open(fs, name);
+    assert(fd >= 0);
+    assert(fsi_write(fs, fd, write_buf, FILE_SIZE) == FILE_SIZE);
+    assert(fsi_pread(fs, fd, read_buf, FILE_SIZE, 0) == FILE_SIZE);
+    assert(memcmp(read_buf, write_buf, FILE_SIZE) == 0);
+    assert(fsi_close(fs, fd) == 0);
+    if (round % 5 == 0) {
+      assert(fsi_sync(fs) == 0);
+    }
+  }
+
+  free(write_buf);
+  free(read_buf);
+  return NULL;
+}
+
+int main() {
+  char read_buf[FILE_SIZE];
+  char expected[FILE_SIZE];
+
+  for (int i = 0; i < DISKS; i++) {
+    remove(disk_names[i]); // remove disk if it exists
+    assert(make_fs(disk_names[i]) == 0);
+    instances[i] = fsi_mount(disk_names[i]);
+    assert(instances[i] != NULL);
+  }
+
+  // the functions without an instance only see the disk mounted with mount_fs
+  assert(fs_open("file_0") == -1); // nothing mounted with mount_fs
+  assert(fsi_mount("missing_disk") == NULL);
+  assert(fsi_umount(NULL) == -1);
+  assert(fsi_open(NULL, "file_0") == -1);
+
+  // one thread per disk
+  pthread_t threads[DISKS];
+  for (int i = 0; i < DISKS; i++) {
+    assert(pthread_create(&threads[i], NULL, disk_thread, (void *) (long) i) == 0);
+  }
+  for (int i = 0; i < DISKS; i++) {
+    assert(pthread_join(threads[i], NULL) == 0);
+  }
+
+  // each disk holds only what its own thread wrote
+  for (int i = 0; i < DISKS; i++) {
+    assert(fsi_umount(instances[i]) == 0);
+  }
+  for (int i = DISKS - 1; i >= 0; i--) {
+    instances[i] = fsi_mount(disk_names[i]);
+    assert(instances[i] != NULL);
+  }
+  for (int i = 0; i < DISKS; i++) {
+    char **files;
+    int count = 0;
+    assert(fsi_listfiles(instances[i], &files) == 0);
+    while (files[count] != NULL) {
+      free(files[count++]);
+    }
+    free(files);
+    assert(count == ROUNDS);
+
+    for (int round = 0; round < ROUNDS; round++) {
+      char name[16];
+      sprintf(name, "file_%d", round);
+      int fd = fsi_open(instances[i], name);
+      assert(fd >= 0);
+      assert(fsi_get_filesize(instances[i], fd) == FILE_SIZE);
+      assert(fsi_read(instances[i], fd, read_buf, FILE_SIZE) == FILE_SIZE);
+      memset(expected, 'a' + (i * ROUNDS + round) % 26, FILE_SIZE);
+      assert(memcmp(read_buf, expected, FILE_SIZE) == 0);
+      assert(fsi_close(instances[i], fd) == 0);
+    }
+  }
+
+  // deleting on one disk leaves the same name on the others
+  assert(fsi_delete(instances[0], "file_0") == 0);
+  assert(fsi_open(instances[0], "file_0") == -1);
+  int fd = fsi_open(instances[1], "file_0");
+  assert(fd >= 0);
+  assert(fsi_close(instances[1], fd) == 0);
+
+  // mount_fs mounts one disk at a time for the functions without an instance
+  for (int i = 0; i < DISKS; i++) {
+    assert(fsi_umount(instances[i]) == 0);
+  }
+  assert(mount_fs(disk_names[0]) == 0);
+  assert(mount_fs(disk_names[1]) == -1); // disk already mounted
+  assert(fs_open("file_0") == -1);
+  fd = fs_open("file_1");
+  assert(fd >= 0);
+  assert(fs_close(fd) == 0);
+  assert(umount_fs(disk_names[0]) == 0);
+  assert(umount_fs(disk_names[0]) == -1); // nothing left to unmount
+
+  // the disk calls without a handle act on the one disk opened with open_disk
+  char block[BLOCK_SIZE], block_back[BLOCK_SIZE];
+  memset(block, 'z', BLOCK_SIZE);
+  assert(open_disk(disk_names[2]) == 0);
+  assert(open_disk(disk_names[1]) == -1); // disk already open
+  assert(disk_block_size() == BLOCK_SIZE);
+  int last = disk_block_count() - 1;
+  assert(block_write(last, block) == 0);
+  assert(block_read(last, block_back) == 0);
+  assert(memcmp(block, block_back, BLOCK_SIZE) == 0);
+  assert(close_disk() == 0);
+  assert(close_disk() == -1); // nothing left to close
+
+  for (int i = 0; i < DISKS; i++) {
+    assert(remove(disk_names[i]) == 0);
+  }
+
+  return 0;
+}
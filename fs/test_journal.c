@@ -0,0 +1,102 @@
+#include "../fs.h"
+#include <assert.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define FILES 200
+
+const char *disk_name = "test_fs";
+char write_buf[16384];
+char read_buf[16384];
+
+int file_size(int i) { return 1000 + i * 37; }
+
+void fill(int i) {
+  for (int j = 0; j < file_size(i); j++) {
+    write_buf[j] = 'a' + (i + j) % 26;
+  }
+}
+
+// Odd files are there with their contents, even ones are gone
+void check_files() {
+  char name[16];
+  for (int i = 0; i < FILES; i++) {
+    sprintf(name, "f%d", i);
+    int fd = fs_open(name);
+    if (i % 2 == 0) {
+      assert(fd == -1);
+      continue;
+    }
+    assert(fd >= 0);
+    fill(i);
+    assert(fs_get_filesize(fd) == file_size(i));
+    assert(fs_read(fd, read_buf, file_size(i)) == file_size(i));
+    assert(memcmp(read_buf, write_buf, file_size(i)) == 0);
+    assert(fs_close(fd) == 0);
+  }
+
+  char **files;
+  int count = 0;
+  assert(fs_listfiles(&files) == 0);
+  while (files[count] != NULL) {
+    free(files[count++]);
+  }
+  free(files);
+  assert(count == FILES / 2 || count == FILES / 2 + 1); // "late" may have been committed
+}
+
+void run(int block_size) {
+  char name[16];
+
+  remove(disk_name); // remove disk if it exists
+
+  pid_t pid = fork();
+  assert(pid != -1);
+  if (pid == 0) {
+    // every sync commits a transaction, enough of them to wrap the log
+    assert(make_fs_geometry(disk_name, 8192, block_size) == 0);
+    assert(mount_fs(disk_name) == 0);
+    for (int i = 0; i < FILES; i++) {
+      sprintf(name, "f%d", i);
+      assert(fs_create(name) == 0);
+      int fd = fs_open(name);
+      assert(fd >= 0);
+      fill(i);
+      assert(fs_write(fd, write_buf, file_size(i)) == file_size(i));
+      assert(fs_close(fd) == 0);
+      assert(fs_sync() == 0);
+    }
+    for (int i = 0; i < FILES; i += 2) {
+      sprintf(name, "f%d", i);
+      assert(fs_delete(name) == 0);
+    }
+    assert(fs_sync() == 0);
+
+    // not synced, then exit without unmounting
+    assert(fs_create("late") == 0);
+    _exit(EXIT_SUCCESS);
+  }
+
+  int status;
+  assert(waitpid(pid, &status, 0) == pid);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+
+  // mounting replays the log
+  assert(mount_fs(disk_name) == 0);
+  check_files();
+  assert(umount_fs(disk_name) == 0);
+
+  // and leaves nothing to replay the next time
+  assert(mount_fs(disk_name) == 0);
+  check_files();
+  assert(umount_fs(disk_name) == 0);
+
+  assert(remove(disk_name) == 0);
+}
+
+int main() {
+  run(4096);
+  run(1024);
+
+  return 0;
+}
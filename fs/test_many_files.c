@@ -0,0 +1,65 @@
+#include "../fs.h"
+#include <assert.h>
+#include <stdlib.h>
+
+#define NUM_FILES 4095
+
+int main() {
+  const char *disk_name = "test_fs";
+  char name[16];
+  char buf[16];
+
+  remove(disk_name);
+  assert(make_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+
+  // Fill every inode, writing each file's name into it
+  for (int i = 0; i < NUM_FILES; i++) {
+    sprintf(name, "file%d", i);
+    assert(fs_create(name) == 0);
+    int fd = fs_open(name);
+    assert(fd >= 0);
+    assert(fs_write(fd, name, strlen(name)) == strlen(name));
+    assert(fs_close(fd) == 0);
+  }
+  assert(fs_create("one_too_many") == -1); // no free inodes
+
+  // Everything is still there after a remount, listed in creation order
+  assert(umount_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+  char **files;
+  assert(fs_listfiles(&files) == 0);
+  for (int i = 0; i < NUM_FILES; i++) {
+    sprintf(name, "file%d", i);
+    assert(files[i] != NULL && strcmp(files[i], name) == 0);
+    free(files[i]);
+  }
+  assert(files[NUM_FILES] == NULL);
+  free(files);
+
+  for (int i = 0; i < NUM_FILES; i++) {
+    sprintf(name, "file%d", i);
+    int fd = fs_open(name);
+    assert(fd >= 0);
+    memset(buf, 0, sizeof(buf));
+    assert(fs_read(fd, buf, sizeof(buf)) == strlen(name));
+    assert(strcmp(buf, name) == 0);
+    assert(fs_close(fd) == 0);
+  }
+
+  // Deleted names go away and their inodes can be reused
+  for (int i = 0; i < NUM_FILES; i += 2) {
+    sprintf(name, "file%d", i);
+    assert(fs_delete(name) == 0);
+    assert(fs_open(name) == -1);
+  }
+  for (int i = 0; i < NUM_FILES; i += 2) {
+    sprintf(name, "new%d", i);
+    assert(fs_create(name) == 0);
+  }
+  assert(fs_open("file1") >= 0);
+  assert(fs_open("new0") >= 0);
+
+  assert(umount_fs(disk_name) == 0);
+  assert(remove(disk_name) == 0);
+}
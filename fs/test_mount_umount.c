@@ -1,5 +1,36 @@
 #include "../fs.h"
 #include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+
+// Make writes to the open disk image fail by putting a read-only handle of it in place of its own
+void fail_disk_writes(const char *disk_name) {
+  char real[PATH_MAX];
+  assert(realpath(disk_name, real) != NULL);
+  DIR *fds = opendir("/proc/self/fd");
+  assert(fds != NULL);
+  bool found = false;
+  struct dirent *entry;
+  while ((entry = readdir(fds)) != NULL) {
+    char target[PATH_MAX];
+    ssize_t n = readlinkat(dirfd(fds), entry->d_name, target, sizeof(target) - 1);
+    if (n < 0) {
+      continue;
+    }
+    target[n] = '\0';
+    if (strcmp(target, real) == 0) {
+      int readonly = open(disk_name, O_RDONLY);
+      assert(readonly >= 0);
+      assert(dup2(readonly, atoi(entry->d_name)) >= 0);
+      assert(close(readonly) == 0);
+      found = true;
+    }
+  }
+  assert(closedir(fds) == 0);
+  assert(found);
+}
 
 int main() {
   const char *disk_name = "test_fs";
@@ -26,5 +57,17 @@ int main() {
   }
   assert(non_zero_byte == true);
   assert(fclose(fp) == 0);
+
+  // a flush that fails while unmounting is reported
+  char data[16 * 1024];
+  memset(data, 'x', sizeof(data));
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_create("file") == 0);
+  int fd = fs_open("file");
+  assert(fs_write(fd, data, sizeof(data)) == sizeof(data));
+  assert(fs_close(fd) == 0);
+  fail_disk_writes(disk_name);
+  assert(umount_fs(disk_name) == -1);
+
   assert(remove(disk_name) == 0);
 }
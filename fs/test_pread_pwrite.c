@@ -0,0 +1,89 @@
+#include "../fs.h"
+#include <assert.h>
+#include <pthread.h>
+
+#define FILE_SIZE (64 * 1024)
+#define THREADS 4
+#define READS 500
+
+const char *disk_name = "test_fs";
+const char *file_name = "test_file";
+char write_buf[FILE_SIZE];
+char read_buf[FILE_SIZE];
+int shared_fd;
+
+// Threads share one descriptor, each read checks what is at its offset
+void *reader_thread(void *arg) {
+  unsigned int seed = (unsigned int) (long) arg;
+  char buf[5000];
+  for (int i = 0; i < READS; i++) {
+    int offset = rand_r(&seed) % FILE_SIZE;
+    int length = rand_r(&seed) % sizeof(buf);
+    int expected = (offset + length > FILE_SIZE) ? FILE_SIZE - offset : length;
+    assert(fs_pread(shared_fd, buf, length, offset) == expected);
+    assert(memcmp(buf, write_buf + offset, expected) == 0);
+  }
+  return NULL;
+}
+
+int main() {
+  for (int i = 0; i < FILE_SIZE; i++) {
+    write_buf[i] = 'a' + i % 26;
+  }
+
+  remove(disk_name); // remove disk if it exists
+  assert(make_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_create(file_name) == 0);
+
+  int fd = fs_open(file_name);
+  assert(fd >= 0);
+  assert(fs_pread(fd, read_buf, 10, 0) == 0); // empty file
+  assert(fs_pwrite(fd, write_buf, 10, 1) == -1); // would leave a hole
+  assert(fs_pwrite(fd, write_buf, 10, -1) == -1); // invalid offset
+
+  // write the file in two pieces, the second starting at the current end
+  assert(fs_pwrite(fd, write_buf, 1000, 0) == 1000);
+  assert(fs_pwrite(fd, write_buf + 1000, FILE_SIZE - 1000, 1000) == FILE_SIZE - 1000);
+  assert(fs_get_filesize(fd) == FILE_SIZE);
+
+  // the file pointer did not move
+  assert(fs_read(fd, read_buf, FILE_SIZE) == FILE_SIZE);
+  assert(memcmp(read_buf, write_buf, FILE_SIZE) == 0);
+
+  // overwrite in the middle, across a block boundary, without moving the pointer
+  assert(fs_lseek(fd, 100) == 0);
+  memset(write_buf + 4000, 'X', 200);
+  assert(fs_pwrite(fd, write_buf + 4000, 200, 4000) == 200);
+  assert(fs_pread(fd, read_buf, 300, 3950) == 300);
+  assert(memcmp(read_buf, write_buf + 3950, 300) == 0);
+  assert(fs_read(fd, read_buf, 10) == 10);
+  assert(memcmp(read_buf, write_buf + 100, 10) == 0);
+
+  // reads stop at the end of the file
+  assert(fs_pread(fd, read_buf, 100, FILE_SIZE - 10) == 10);
+  assert(fs_pread(fd, read_buf, 100, FILE_SIZE) == 0);
+  assert(fs_pread(fd, read_buf, 100, FILE_SIZE + 100) == 0);
+  assert(fs_pread(fd, read_buf, 100, -1) == -1); // invalid offset
+
+  // many threads reading through one descriptor
+  shared_fd = fd;
+  pthread_t threads[THREADS];
+  for (int i = 0; i < THREADS; i++) {
+    assert(pthread_create(&threads[i], NULL, reader_thread, (void *) (long) (i + 1)) == 0);
+  }
+  for (int i = 0; i < THREADS; i++) {
+    assert(pthread_join(threads[i], NULL) == 0);
+  }
+
+  assert(fs_close(fd) == 0);
+  assert(fs_pread(fd, read_buf, 10, 0) == -1); // file not opened
+  assert(fs_pwrite(fd, write_buf, 10, 0) == -1); // file not opened
+
+  fd = fs_open(file_name);
+  assert(fd >= 0);
+  assert(umount_fs(disk_name) == 0);
+  assert(fs_pread(fd, read_buf, 10, 0) == -1); // disk not mounted
+  assert(fs_pwrite(fd, write_buf, 10, 0) == -1); // disk not mounted
+  assert(remove(disk_name) == 0);
+}
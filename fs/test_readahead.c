@@ -0,0 +1,92 @@
+#include "../fs.h"
+#include <assert.h>
+
+#define FILE_SIZE (4 * 1024 * 1024)
+#define READ_SIZE 4096
+
+const char *disk_name = "test_fs";
+const char *file_name = "test_file";
+char write_buf[FILE_SIZE];
+char read_buf[FILE_SIZE];
+
+int main() {
+  struct fs_readahead readahead;
+
+  for (int i = 0; i < FILE_SIZE; i++) {
+    write_buf[i] = 'a' + (i / 7) % 26;
+  }
+
+  remove(disk_name); // remove disk if it exists
+  assert(make_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_create(file_name) == 0);
+  int fd = fs_open(file_name);
+  assert(fs_write(fd, write_buf, FILE_SIZE) == FILE_SIZE);
+  assert(fs_close(fd) == 0);
+
+  // remount so that nothing is cached
+  assert(umount_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+  fd = fs_open(file_name);
+  assert(fd >= 0);
+  assert(fs_get_readahead(fd, &readahead) == 0);
+  assert(readahead.window == 0);
+  assert(readahead.prefetched == 0);
+
+  // sequential reads grow the window, and find what was read ahead
+  int last_window = 0;
+  for (int offset = 0; offset < FILE_SIZE; offset += READ_SIZE) {
+    assert(fs_read(fd, read_buf + offset, READ_SIZE) == READ_SIZE);
+    assert(fs_get_readahead(fd, &readahead) == 0);
+    assert(readahead.window >= last_window);
+    last_window = readahead.window;
+  }
+  assert(memcmp(read_buf, write_buf, FILE_SIZE) == 0);
+  assert(last_window > 4 * READ_SIZE);
+  assert(readahead.prefetched > 0);
+  assert(readahead.hits > 0);
+  assert(readahead.hits <= readahead.prefetched);
+
+  // the end of the file stops it
+  assert(fs_read(fd, read_buf, READ_SIZE) == 0);
+
+  // a jump resets the window
+  assert(fs_lseek(fd, FILE_SIZE / 2 + 100) == 0);
+  assert(fs_read(fd, read_buf, 10) == 10);
+  assert(memcmp(read_buf, write_buf + FILE_SIZE / 2 + 100, 10) == 0);
+  assert(fs_get_readahead(fd, &readahead) == 0);
+  assert(readahead.window == 0);
+
+  // random reads through another descriptor leave it at zero and still read the right data
+  int fd2 = fs_open(file_name);
+  assert(fd2 >= 0);
+  unsigned int seed = 1;
+  for (int i = 0; i < 100; i++) {
+    int offset = rand_r(&seed) % (FILE_SIZE - READ_SIZE);
+    assert(fs_pread(fd2, read_buf, READ_SIZE, offset) == READ_SIZE);
+    assert(memcmp(read_buf, write_buf + offset, READ_SIZE) == 0);
+    assert(fs_lseek(fd2, offset) == 0);
+    assert(fs_read(fd2, read_buf, READ_SIZE) == READ_SIZE);
+    assert(memcmp(read_buf, write_buf + offset, READ_SIZE) == 0);
+    assert(fs_lseek(fd2, rand_r(&seed) % FILE_SIZE) == 0);
+  }
+  assert(fs_get_readahead(fd2, &readahead) == 0);
+  assert(readahead.window == 0);
+
+  // writes over blocks read ahead are what later reads see
+  assert(fs_lseek(fd, 0) == 0);
+  assert(fs_read(fd, read_buf, READ_SIZE) == READ_SIZE);
+  assert(fs_read(fd, read_buf, READ_SIZE) == READ_SIZE);
+  memset(write_buf + 3 * READ_SIZE, 'X', READ_SIZE);
+  assert(fs_pwrite(fd2, write_buf + 3 * READ_SIZE, READ_SIZE, 3 * READ_SIZE) == READ_SIZE);
+  assert(fs_read(fd, read_buf, 2 * READ_SIZE) == 2 * READ_SIZE);
+  assert(memcmp(read_buf, write_buf + 2 * READ_SIZE, 2 * READ_SIZE) == 0);
+
+  assert(fs_close(fd2) == 0);
+  assert(fs_close(fd) == 0);
+  assert(fs_get_readahead(fd, &readahead) == -1); // file not opened
+  assert(umount_fs(disk_name) == 0);
+  assert(remove(disk_name) == 0);
+
+  return 0;
+}
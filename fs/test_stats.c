@@ -0,0 +1,133 @@
+#include "../fs.h"
+#include <assert.h>
+#include <pthread.h>
+
+#define THREADS 4
+#define READS 1000
+#define FILE_SIZE (64 * 1024)
+
+const char *disk_name = "test_fs";
+const char *file_name = "test_file";
+char write_buf[FILE_SIZE];
+
+// Each thread reads the file through a descriptor of its own
+void *reader_thread(void *arg) {
+  char buf[100];
+  int fd = fs_open(file_name);
+  assert(fd >= 0);
+  for (int i = 0; i < READS; i++) {
+    assert(fs_pread(fd, buf, sizeof(buf), i * sizeof(buf) % (FILE_SIZE - sizeof(buf))) == sizeof(buf));
+  }
+  assert(fs_close(fd) == 0);
+  return NULL;
+}
+
+unsigned long histogram_total(const unsigned long *buckets) {
+  unsigned long total = 0;
+  for (int i = 0; i < FS_HISTOGRAM_BUCKETS; i++) {
+    total += buckets[i];
+  }
+  return total;
+}
+
+int main() {
+  struct fs_stats stats;
+  char read_buf[FILE_SIZE];
+
+  memset(write_buf, 'a', FILE_SIZE);
+  remove(disk_name); // remove disk if it exists
+  assert(fs_stats(&stats) == -1); // disk not mounted
+
+  assert(make_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_stats(&stats) == 0);
+  for (int op = 0; op < FS_OP_COUNT; op++) {
+    assert(stats.ops[op].calls == 0);
+  }
+  assert(stats.bytes_read == 0);
+  assert(stats.bytes_written == 0);
+
+  // calls, errors and bytes are counted per operation
+  assert(fs_create(file_name) == 0);
+  assert(fs_create(file_name) == -1); // file name already exists
+  int fd = fs_open(file_name);
+  assert(fd >= 0);
+  assert(fs_write(fd, write_buf, FILE_SIZE) == FILE_SIZE);
+  assert(fs_lseek(fd, 0) == 0);
+  assert(fs_read(fd, read_buf, FILE_SIZE) == FILE_SIZE);
+  assert(fs_pread(fd, read_buf, 10, 0) == 10);
+  assert(fs_pwrite(fd, write_buf, 20, 0) == 20);
+  assert(fs_get_filesize(fd) == FILE_SIZE);
+  assert(fs_sync() == 0);
+  assert(fs_close(fd) == 0);
+
+  assert(fs_stats(&stats) == 0);
+  assert(stats.ops[FS_OP_CREATE].calls == 2);
+  assert(stats.ops[FS_OP_CREATE].errors == 1);
+  assert(stats.ops[FS_OP_OPEN].calls == 1);
+  assert(stats.ops[FS_OP_WRITE].calls == 1);
+  assert(stats.ops[FS_OP_READ].calls == 1);
+  assert(stats.ops[FS_OP_PREAD].calls == 1);
+  assert(stats.ops[FS_OP_PWRITE].calls == 1);
+  assert(stats.ops[FS_OP_LSEEK].calls == 1);
+  assert(stats.ops[FS_OP_GET_FILESIZE].calls == 1);
+  assert(stats.ops[FS_OP_SYNC].calls == 1);
+  assert(stats.ops[FS_OP_CLOSE].calls == 1);
+  assert(stats.ops[FS_OP_DELETE].calls == 0);
+  assert(stats.ops[FS_OP_OPEN].errors == 0);
+  assert(stats.bytes_read == FILE_SIZE + 10);
+  assert(stats.bytes_written == FILE_SIZE + 20);
+
+  // every timed call lands in one latency bucket
+  for (int op = 0; op < FS_OP_COUNT; op++) {
+    assert(stats.ops[op].timed <= stats.ops[op].calls);
+    assert(histogram_total(stats.ops[op].latency) == stats.ops[op].timed);
+  }
+
+  // the sync wrote blocks, and the write searched the bitmap
+  assert(stats.block_writes > 0);
+  assert(stats.allocations > 0);
+  assert(stats.alloc_words >= stats.allocations);
+  assert(histogram_total(stats.alloc_scan) == stats.allocations);
+
+  // counts of several threads are merged
+  pthread_t threads[THREADS];
+  for (int i = 0; i < THREADS; i++) {
+    assert(pthread_create(&threads[i], NULL, reader_thread, NULL) == 0);
+  }
+  for (int i = 0; i < THREADS; i++) {
+    assert(pthread_join(threads[i], NULL) == 0);
+  }
+  assert(fs_stats(&stats) == 0);
+  assert(stats.ops[FS_OP_PREAD].calls == 1 + THREADS * READS);
+  assert(stats.ops[FS_OP_OPEN].calls == 1 + THREADS);
+  assert(stats.bytes_read == FILE_SIZE + 10 + THREADS * READS * 100);
+  // a sample of the calls is timed
+  assert(stats.ops[FS_OP_PREAD].timed > 0);
+  assert(stats.ops[FS_OP_PREAD].timed < stats.ops[FS_OP_PREAD].calls / 2);
+  assert(stats.ops[FS_OP_PREAD].nanoseconds > 0);
+  assert(histogram_total(stats.ops[FS_OP_PREAD].latency) == stats.ops[FS_OP_PREAD].timed);
+
+  // counting starts over with each mount, reads after it come from the disk
+  assert(umount_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_stats(&stats) == 0);
+  assert(stats.ops[FS_OP_PREAD].calls == 0);
+  unsigned long block_reads = stats.block_reads;
+  fd = fs_open(file_name);
+  assert(fs_read(fd, read_buf, FILE_SIZE) == FILE_SIZE);
+  assert(fs_read(fd, read_buf, 1) == 0); // end of file
+  assert(fs_close(fd) == 0);
+  assert(fs_delete(file_name) == 0);
+  assert(fs_stats(&stats) == 0);
+  assert(stats.block_reads >= block_reads + FILE_SIZE / 4096);
+  assert(stats.ops[FS_OP_READ].calls == 2);
+  assert(stats.ops[FS_OP_READ].errors == 0);
+  assert(stats.bytes_read == FILE_SIZE);
+  assert(stats.ops[FS_OP_DELETE].calls == 1);
+
+  assert(umount_fs(disk_name) == 0);
+  assert(remove(disk_name) == 0);
+
+  return 0;
+}
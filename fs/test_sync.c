@@ -0,0 +1,73 @@
+#include "../fs.h"
+#include <assert.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define THREADS 8
+#define SYNCS 50
+
+const char *disk_name = "test_fs";
+const char *file_names[] = {"first", "second"};
+char write_buf[] = "hello world";
+char read_buf[sizeof(write_buf)];
+
+void *sync_thread(void *arg) {
+  for (int i = 0; i < SYNCS; i++) {
+    assert(fs_sync() == 0);
+  }
+  return NULL;
+}
+
+int main() {
+  remove(disk_name); // remove disk if it exists
+
+  assert(fs_sync() == -1); // nothing mounted
+
+  pid_t pid = fork();
+  assert(pid != -1);
+  if (pid == 0) {
+    // write two files and sync them, then exit without unmounting
+    assert(make_fs(disk_name) == 0);
+    assert(mount_fs(disk_name) == 0);
+    for (int i = 0; i < 2; i++) {
+      assert(fs_create(file_names[i]) == 0);
+      int fd = fs_open(file_names[i]);
+      assert(fd >= 0);
+      assert(fs_write(fd, write_buf, sizeof(write_buf)) == sizeof(write_buf));
+      assert(fs_close(fd) == 0);
+      assert(fs_sync() == 0);
+    }
+    assert(fs_sync() == 0); // nothing left to write
+    _exit(EXIT_SUCCESS);
+  }
+
+  int status;
+  assert(waitpid(pid, &status, 0) == pid);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+
+  // both files made it to disk
+  assert(mount_fs(disk_name) == 0);
+  for (int i = 0; i < 2; i++) {
+    int fd = fs_open(file_names[i]);
+    assert(fd >= 0);
+    assert(fs_get_filesize(fd) == sizeof(write_buf));
+    assert(fs_read(fd, read_buf, sizeof(read_buf)) == sizeof(read_buf));
+    assert(strcmp(write_buf, read_buf) == 0);
+    assert(fs_close(fd) == 0);
+  }
+
+  // concurrent syncs all succeed
+  pthread_t threads[THREADS];
+  for (int i = 0; i < THREADS; i++) {
+    assert(pthread_create(&threads[i], NULL, sync_thread, NULL) == 0);
+  }
+  for (int i = 0; i < THREADS; i++) {
+    assert(pthread_join(threads[i], NULL) == 0);
+  }
+
+  assert(umount_fs(disk_name) == 0);
+  assert(remove(disk_name) == 0);
+
+  return 0;
+}
@@ -0,0 +1,161 @@
+#include "../fs.h"
+#include <assert.h>
+#include <pthread.h>
+
+#define THREADS 4
+#define ROUNDS 20
+#define SHARED_SIZE (256 * 1024)
+#define COUNTED (64 * 1024) // ints in the file read through one descriptor
+#define CHUNK 100
+
+const char *disk_name = "test_fs";
+char shared_buf[SHARED_SIZE];
+int counted_fd;
+int seen[THREADS][COUNTED];
+
+// Each thread reads the shared file through its own descriptor
+void *reader_thread(void *arg) {
+  char *buf = malloc(SHARED_SIZE);
+  for (int round = 0; round < ROUNDS; round++) {
+    int fd = fs_open("shared");
+    assert(fd >= 0);
+    assert(fs_get_filesize(fd) == SHARED_SIZE);
+    assert(fs_read(fd, buf, SHARED_SIZE) == SHARED_SIZE);
+    assert(memcmp(buf, shared_buf, SHARED_SIZE) == 0);
+    assert(fs_close(fd) == 0);
+  }
+  free(buf);
+  return NULL;
+}
+
+// Each thread reads pieces of the counted file through the same descriptor until it runs out
+void *counted_thread(void *arg) {
+  int id = (int) (long) arg;
+  int buf[CHUNK];
+  int n;
+  while ((n = fs_read(counted_fd, buf, sizeof(buf))) > 0) {
+    assert(n == sizeof(buf) || n == COUNTED % CHUNK * sizeof(int));
+    for (int i = 0; i < n / sizeof(int); i++) {
+      seen[id][buf[i]]++;
+    }
+  }
+  assert(n == 0);
+  return NULL;
+}
+
+// Each thread creates, fills, checks and deletes files of its own
+void *writer_thread(void *arg) {
+  int id = (int) (long) arg;
+  char name[16];
+  char write_buf[6000];
+  char read_buf[6000];
+
+  for (int round = 0; round < ROUNDS; round++) {
+    sprintf(name, "t%d_%d", id, round);
+    int size = 1000 + (id * ROUNDS + round) * 97 % 5000;
+    memset(write_buf, 'a' + (id + round) % 26, size);
+
+    assert(fs_create(name) == 0);
+    int fd = fs_open(name);
+    assert(fd >= 0);
+    assert(fs_write(fd, write_buf, size) == size);
+    assert(fs_truncate(fd, size / 2) == 0);
+    assert(fs_lseek(fd, 0) == 0);
+    assert(fs_read(fd, read_buf, size) == size / 2);
+    assert(memcmp(read_buf, write_buf, size / 2) == 0);
+    assert(fs_close(fd) == 0);
+
+    // every other file is kept
+    if (round % 2 == 0) {
+      assert(fs_delete(name) == 0);
+    }
+    if (round % 5 == 0) {
+      assert(fs_sync() == 0);
+    }
+  }
+  return NULL;
+}
+
+int main() {
+  remove(disk_name); // remove disk if it exists
+
+  assert(make_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+
+  for (int i = 0; i < SHARED_SIZE; i++) {
+    shared_buf[i] = 'A' + i % 26;
+  }
+  assert(fs_create("shared") == 0);
+  int fd = fs_open("shared");
+  assert(fs_write(fd, shared_buf, SHARED_SIZE) == SHARED_SIZE);
+  assert(fs_close(fd) == 0);
+
+  // readers and writers at once
+  pthread_t threads[2 * THREADS];
+  for (int i = 0; i < THREADS; i++) {
+    assert(pthread_create(&threads[i], NULL, reader_thread, NULL) == 0);
+    assert(pthread_create(&threads[THREADS + i], NULL, writer_thread, (void *) (long) i) == 0);
+  }
+  for (int i = 0; i < 2 * THREADS; i++) {
+    assert(pthread_join(threads[i], NULL) == 0);
+  }
+
+  // the kept files and the shared one are listed
+  char **files;
+  int count = 0;
+  assert(fs_listfiles(&files) == 0);
+  while (files[count] != NULL) {
+    free(files[count++]);
+  }
+  free(files);
+  assert(count == 1 + THREADS * ROUNDS / 2);
+
+  // and survive a remount
+  assert(umount_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+  char name[16];
+  char read_buf[6000];
+  for (int id = 0; id < THREADS; id++) {
+    for (int round = 1; round < ROUNDS; round += 2) {
+      sprintf(name, "t%d_%d", id, round);
+      int size = 1000 + (id * ROUNDS + round) * 97 % 5000;
+      fd = fs_open(name);
+      assert(fd >= 0);
+      assert(fs_get_filesize(fd) == size / 2);
+      assert(fs_read(fd, read_buf, size) == size / 2);
+      assert(read_buf[0] == 'a' + (id + round) % 26);
+      assert(fs_close(fd) == 0);
+    }
+  }
+
+  // threads reading through one descriptor get every byte exactly once between them
+  int *counted = malloc(COUNTED * sizeof(int));
+  for (int i = 0; i < COUNTED; i++) {
+    counted[i] = i;
+  }
+  assert(fs_create("counted") == 0);
+  counted_fd = fs_open("counted");
+  assert(fs_write(counted_fd, counted, COUNTED * sizeof(int)) == COUNTED * sizeof(int));
+  assert(fs_lseek(counted_fd, 0) == 0);
+  for (int i = 0; i < THREADS; i++) {
+    assert(pthread_create(&threads[i], NULL, counted_thread, (void *) (long) i) == 0);
+  }
+  for (int i = 0; i < THREADS; i++) {
+    assert(pthread_join(threads[i], NULL) == 0);
+  }
+  for (int i = 0; i < COUNTED; i++) {
+    int total = 0;
+    for (int t = 0; t < THREADS; t++) {
+      total += seen[t][i];
+    }
+    assert(total == 1);
+  }
+  assert(fs_close(counted_fd) == 0);
+  assert(fs_delete("counted") == 0);
+  free(counted);
+
+  assert(umount_fs(disk_name) == 0);
+  assert(remove(disk_name) == 0);
+
+  return 0;
+}